@@ -0,0 +1,382 @@
+/* Copyright (C) 2007 xyster.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "platform.h"
+#include "debug.h"
+#include "ribsu-util.h"
+#include "capture.h"
+
+#define MODULE_NAME capture
+DBG_MODULE_DEFINE();
+
+#define CAP_MAGIC    "RIBSUCAP"
+#define CAP_HDR_LEN  (16)
+#define CAP_REC_LEN  (12)
+#define CAP_DATA_MAX (0xffff) // longer reads are split over records
+#define CAP_OUT_MAX  (4096)   // decoded output per frame, as RIBSU_OUT_MAX
+
+typedef struct cap_writer
+{
+    int fd;
+} cap_writer;
+
+typedef struct cap_reader
+{
+    const UInt8 *base;
+    size_t len;
+    size_t pos;
+} cap_reader;
+
+static void   cap_put16(UInt8 *p, UInt16 v);
+static void   cap_put32(UInt8 *p, UInt32 v);
+static void   cap_put64(UInt8 *p, UInt64 v);
+static UInt16 cap_get16(const UInt8 *p);
+static UInt32 cap_get32(const UInt8 *p);
+static UInt64 cap_get64(const UInt8 *p);
+
+// Start or continue a recording, the header goes in only if the file is new
+int
+cap_open(void **ctx0, const char *path)
+{
+    cap_writer *ctx;
+    struct stat st;
+    UInt8 hdr[CAP_HDR_LEN];
+    int error;
+
+    *ctx0 = NULL;
+
+    ctx = malloc(sizeof(*ctx));
+    if (!ctx)
+    {
+        U_NOMEM();
+        return -1;
+    }
+
+    ctx->fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (ctx->fd < 0)
+    {
+        ERR("Failed to open %s - %s(%d)\n", path, strerror(errno), errno);
+        error = -1;
+        goto out;
+    }
+
+    if (fstat(ctx->fd, &st))
+    {
+        ERR("Failed to stat %s - %s(%d)\n", path, strerror(errno), errno);
+        error = -1;
+        goto out;
+    }
+
+    if (!st.st_size)
+    {
+        bcopy(CAP_MAGIC, hdr, 8);
+        cap_put32(hdr + 8, CAP_VERSION);
+        cap_put32(hdr + 12, 0);
+
+        if (write(ctx->fd, hdr, sizeof(hdr)) != sizeof(hdr))
+        {
+            ERR("Failed to write %s - %s(%d)\n", path, strerror(errno), errno);
+            error = -1;
+            goto out;
+        }
+    }
+
+    DBG("Recording to %s\n", path);
+
+    *ctx0 = ctx;
+
+    error = 0;
+
+out:
+
+    if (error)
+    {
+        if (ctx->fd >= 0) close(ctx->fd);
+        free(ctx);
+    }
+
+    return error;
+}
+
+// One write per record, so a record is either all there or cut at the end
+int
+cap_record(void *ctx0, UInt32 mode, UInt32 state, buffer *buf)
+{
+    cap_writer *ctx;
+    UInt8 hdr[CAP_REC_LEN];
+    struct iovec iov[2];
+    UInt32 off, n;
+    UInt64 ns;
+
+    ctx = ctx0;
+    ns = u_now();
+
+    for (off = 0; off < buf->len; off += n)
+    {
+        n = buf->len - off;
+        if (n > CAP_DATA_MAX) n = CAP_DATA_MAX;
+
+        cap_put64(hdr, ns);
+        hdr[8] = mode;
+        hdr[9] = state;
+        cap_put16(hdr + 10, n);
+
+        iov[0].iov_base = hdr;
+        iov[0].iov_len = sizeof(hdr);
+        iov[1].iov_base = buf->buf + off;
+        iov[1].iov_len = n;
+
+        if (writev(ctx->fd, iov, 2) != (ssize_t)(sizeof(hdr) + n))
+        {
+            ERR("Failed to record %u bytes - %s(%d)\n", (unsigned)n, strerror(errno), errno);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void
+cap_close(void *ctx0)
+{
+    cap_writer *ctx;
+
+    ctx = ctx0;
+    if (!ctx) return;
+
+    close(ctx->fd);
+    free(ctx);
+}
+
+int
+cap_map(void **ctx0, const char *path)
+{
+    cap_reader *ctx;
+    struct stat st;
+    void *p;
+    int fd;
+
+    *ctx0 = NULL;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        ERR("Failed to open %s - %s(%d)\n", path, strerror(errno), errno);
+        return -1;
+    }
+
+    if (fstat(fd, &st))
+    {
+        ERR("Failed to stat %s - %s(%d)\n", path, strerror(errno), errno);
+        close(fd);
+        return -1;
+    }
+
+    if (st.st_size < CAP_HDR_LEN)
+    {
+        ERR("%s is not a capture\n", path);
+        close(fd);
+        return -1;
+    }
+
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+    {
+        ERR("Failed to map %s - %s(%d)\n", path, strerror(errno), errno);
+        return -1;
+    }
+
+    if (bcmp(p, CAP_MAGIC, 8)  ||  cap_get32((UInt8 *)p + 8) != CAP_VERSION)
+    {
+        ERR("%s is not a version %d capture\n", path, CAP_VERSION);
+        munmap(p, st.st_size);
+        return -1;
+    }
+
+    ctx = malloc(sizeof(*ctx));
+    if (!ctx)
+    {
+        U_NOMEM();
+        munmap(p, st.st_size);
+        return -1;
+    }
+
+    ctx->base = p;
+    ctx->len = st.st_size;
+    ctx->pos = CAP_HDR_LEN;
+
+    madvise(p, st.st_size, MADV_SEQUENTIAL);
+
+    *ctx0 = ctx;
+
+    return 0;
+}
+
+// The next record, -1 at the end
+int
+cap_next(void *ctx0, cap_rec *rec)
+{
+    cap_reader *ctx;
+    const UInt8 *p;
+    UInt32 n;
+
+    ctx = ctx0;
+
+    if (ctx->pos + CAP_REC_LEN > ctx->len) goto end;
+
+    p = ctx->base + ctx->pos;
+    n = cap_get16(p + 10);
+    if (ctx->pos + CAP_REC_LEN + n > ctx->len) goto end;
+
+    rec->ns = cap_get64(p);
+    rec->mode = p[8];
+    rec->state = p[9];
+    buf_attach(&rec->data, n, (UInt8 *)p + CAP_REC_LEN);
+    rec->data.len = n;
+
+    ctx->pos += CAP_REC_LEN + n;
+
+    return 0;
+
+end:
+    if (ctx->pos != ctx->len)
+    {
+        LOG("Capture ends with %u bytes of a cut record\n", (unsigned)(ctx->len - ctx->pos));
+        ctx->pos = ctx->len;
+    }
+
+    return -1;
+}
+
+void
+cap_rewind(void *ctx0)
+{
+    cap_reader *ctx;
+
+    ctx = ctx0;
+    ctx->pos = CAP_HDR_LEN;
+}
+
+// Feed the rest of a capture through usm, handing every frame it decodes to
+// fn. Returns the number of frames.
+int
+cap_replay(void *ctx, usm_ctx *usm, UInt32 flags, cap_frame_fn fn, void *fn_arg)
+{
+    cap_rec rec;
+    buffer out;
+    UInt8 out_buf[CAP_OUT_MAX];
+    UInt64 rec0, now0, due, now;
+    struct timespec ts;
+    int first, n;
+
+    buf_attach(&out, sizeof(out_buf), out_buf);
+    rec0 = now0 = 0;
+    first = 1;
+    n = 0;
+
+    while (!cap_next(ctx, &rec))
+    {
+        if (flags & CAP_F_REALTIME)
+        {
+            // a recording appended to after a reboot goes back in time
+            if (first  ||  rec.ns < rec0)
+            {
+                rec0 = rec.ns;
+                now0 = u_now();
+            }
+
+            due = rec.ns - rec0;
+            now = u_now() - now0;
+            if (due > now)
+            {
+                ts.tv_sec = (due - now) / 1000000000;
+                ts.tv_nsec = (due - now) % 1000000000;
+                nanosleep(&ts, NULL);
+            }
+        }
+        first = 0;
+
+        if (rec.mode != usm->mode  ||  rec.state != usm->state)
+        {
+            DBG("Resyncing to mode %u state %u\n", (unsigned)rec.mode, (unsigned)rec.state);
+            usm_set_mode(usm, rec.mode, rec.state);
+        }
+
+        usm_process_uirt(usm, &rec.data, &out);
+        do {
+            if (out.len)
+            {
+                n++;
+                if (fn) fn(fn_arg, &out);
+            }
+            usm_process_uirt_more(usm, &out);
+        } while (out.len);
+    }
+
+    return n;
+}
+
+void
+cap_unmap(void *ctx0)
+{
+    cap_reader *ctx;
+
+    ctx = ctx0;
+    if (!ctx) return;
+
+    munmap((void *)ctx->base, ctx->len);
+    free(ctx);
+}
+
+void
+cap_put16(UInt8 *p, UInt16 v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+void
+cap_put32(UInt8 *p, UInt32 v)
+{
+    cap_put16(p, v);
+    cap_put16(p + 2, v >> 16);
+}
+
+void
+cap_put64(UInt8 *p, UInt64 v)
+{
+    cap_put32(p, v);
+    cap_put32(p + 4, v >> 32);
+}
+
+UInt16
+cap_get16(const UInt8 *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+UInt32
+cap_get32(const UInt8 *p)
+{
+    return cap_get16(p) | ((UInt32)cap_get16(p + 2) << 16);
+}
+
+UInt64
+cap_get64(const UInt8 *p)
+{
+    return cap_get32(p) | ((UInt64)cap_get32(p + 4) << 32);
+}
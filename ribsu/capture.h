@@ -0,0 +1,51 @@
+/* Copyright (C) 2007 xyster.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+
+#ifndef __CAPTURE_H
+#define __CAPTURE_H
+
+#include "uirt-sm.h"
+
+/* Recordings of what the device sent, for replaying through the state
+ * machine later. A file is append only, a header and then one record per
+ * read from the device, all little endian:
+ *
+ *   header  "RIBSUCAP", UInt32 version, UInt32 reserved
+ *   record  UInt64 ns (CLOCK_MONOTONIC), UInt8 mode, UInt8 state,
+ *           UInt16 len, len bytes as read
+ *
+ * Mode and state are the usm_ctx ones from before the bytes were processed,
+ * so a replay can put the machine back where it was when a recording starts
+ * mid-session. A record cut short by a crash ends the replay, it isn't an
+ * error.
+ */
+
+#define CAP_VERSION    (1)
+#define CAP_F_REALTIME (1 << 0) // keep the recorded gaps instead of running flat out
+
+typedef void (*cap_frame_fn)(void *, buffer *);
+
+typedef struct cap_rec
+{
+    UInt64 ns;
+    UInt32 mode;
+    UInt32 state;
+    buffer data; // points into the mapped file
+} cap_rec;
+
+int  cap_open(void **ctx, const char *path);
+int  cap_record(void *ctx, UInt32 mode, UInt32 state, buffer *buf);
+void cap_close(void *ctx);
+
+int  cap_map(void **ctx, const char *path);
+int  cap_next(void *ctx, cap_rec *rec);
+void cap_rewind(void *ctx);
+int  cap_replay(void *ctx, usm_ctx *usm, UInt32 flags, cap_frame_fn fn, void *fn_arg);
+void cap_unmap(void *ctx);
+
+#endif
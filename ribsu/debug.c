@@ -0,0 +1,439 @@
+/* Copyright (C) 2007 xyster.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "platform.h"
+#include "debug.h"
+#include "ribsu-util.h"
+
+/* The trace ring is a bounded multi producer queue of fixed size records
+ * (Vyukov's, a sequence number per slot). A record is the format string,
+ * which doubles as its id, and the arguments as the format says they were
+ * passed, strings copied in. Only the writer thread ever formats. When the
+ * ring is full the record is dropped and counted, a trace never waits.
+ * Traces under way are counted so that stopping waits them out before the
+ * ring goes away.
+ */
+
+#define DBG_RING_DEFAULT (4096) // records
+#define DBG_REC_DATA     (232)  // bytes of arguments, longer strings are cut
+#define DBG_IDLE_USEC    (5000) // writer sleep when there is nothing to do
+#define DBG_BUSY_USEC    (100)  // stop's sleep while traces finish
+
+typedef struct dbg_rec
+{
+    volatile UInt32 seq;
+    UInt32 len;
+    UInt64 ns;
+    const char *fmt;
+    UInt8 data[DBG_REC_DATA];
+} dbg_rec;
+
+// Argument kinds, as the format says
+enum {
+    DBG_A_INT,
+    DBG_A_LONG,
+    DBG_A_LLONG,
+    DBG_A_SIZE,
+    DBG_A_DOUBLE,
+    DBG_A_PTR,
+    DBG_A_STR,
+    DBG_A_NONE, // nothing we can handle, the arguments end here
+};
+
+int dbg_ring_on;
+
+static struct {
+    dbg_rec *rec;
+    UInt32 mask;
+    volatile UInt32 tail; // next to reserve
+    UInt32 head;          // next to write out, writer thread only
+    volatile UInt32 drops;
+    volatile UInt32 busy; // in dbg_trace(), the ring can't be freed
+    volatile int stop;
+    FILE *out;
+    pthread_t writer;
+} dbg_ring;
+
+static const char *dbg_spec(const char *p, const char **start, char *spec, int *kind, int *star);
+static void       *dbg_write_thread(void *arg);
+static int         dbg_drain(void);
+static void        dbg_format(dbg_rec *r);
+
+// Route LOG, DBG and DMP through the ring to out until dbg_ring_stop(),
+// slots is a power of 2 or 0 for the default
+int
+dbg_ring_start(FILE *out, unsigned slots)
+{
+    UInt32 i;
+
+    if (dbg_ring.rec) return -1;
+
+    if (!slots) slots = DBG_RING_DEFAULT;
+    if (slots & (slots - 1)) return -1;
+
+    dbg_ring.rec = malloc(slots * sizeof(*dbg_ring.rec));
+    if (!dbg_ring.rec) return -1;
+
+    for (i = 0; i < slots; i++)
+    {
+        dbg_ring.rec[i].seq = i;
+    }
+    dbg_ring.mask = slots - 1;
+    dbg_ring.tail = dbg_ring.head = 0;
+    dbg_ring.drops = 0;
+    dbg_ring.busy = 0;
+    dbg_ring.stop = 0;
+    dbg_ring.out = out;
+
+    if (pthread_create(&dbg_ring.writer, NULL, dbg_write_thread, NULL))
+    {
+        free(dbg_ring.rec);
+        dbg_ring.rec = NULL;
+        return -1;
+    }
+
+    U_BARRIER();
+    dbg_ring_on = 1;
+
+    return 0;
+}
+
+// Everything traced before this is written out
+void
+dbg_ring_stop(void)
+{
+    struct timespec ts;
+
+    if (!dbg_ring.rec) return;
+
+    dbg_ring_on = 0;
+    U_BARRIER();
+
+    // a trace that saw the ring on before it went off is still to finish
+    while (dbg_ring.busy)
+    {
+        ts.tv_sec = 0;
+        ts.tv_nsec = DBG_BUSY_USEC * 1000;
+        nanosleep(&ts, NULL);
+    }
+
+    dbg_ring.stop = 1;
+    pthread_join(dbg_ring.writer, NULL);
+
+    if (dbg_ring.drops)
+    {
+        fprintf(dbg_ring.out, "LOG: debug: %u traces dropped on a full ring\n", (unsigned)dbg_ring.drops);
+    }
+    fflush(dbg_ring.out);
+
+    free(dbg_ring.rec);
+    dbg_ring.rec = NULL;
+}
+
+unsigned
+dbg_ring_drops(void)
+{
+    return dbg_ring.drops;
+}
+
+void
+dbg_trace(const char *fmt, ...)
+{
+    dbg_rec *r;
+    va_list ap;
+    const char *p, *s, *q;
+    char spec[32];
+    UInt32 pos, len, n;
+    SInt32 dif;
+    int kind, star;
+    union {
+        int i;
+        long l;
+        long long ll;
+        size_t z;
+        double d;
+        void *p;
+    } a;
+
+    // dbg_ring_on was looked at before the ring was marked busy, look again
+    U_ATOMIC_INC(&dbg_ring.busy);
+    if (!dbg_ring_on) goto out;
+
+    // reserve a slot
+    for (pos = dbg_ring.tail;; pos = dbg_ring.tail)
+    {
+        r = &dbg_ring.rec[pos & dbg_ring.mask];
+        dif = (SInt32)(r->seq - pos);
+        if (!dif)
+        {
+            if (U_ATOMIC_CAS(&dbg_ring.tail, pos, pos + 1)) break;
+        } else if (dif < 0)
+        {
+            U_ATOMIC_INC(&dbg_ring.drops);
+            goto out;
+        }
+    }
+
+    r->ns = u_now();
+    r->fmt = fmt;
+    len = 0;
+
+    va_start(ap, fmt);
+    for (p = fmt; (p = dbg_spec(p, &q, spec, &kind, &star));)
+    {
+        if (kind == DBG_A_NONE) break;
+
+        // a * width or precision comes first, as an int
+        for (; star; star--)
+        {
+            a.i = va_arg(ap, int);
+            if (len + sizeof(a.i) > DBG_REC_DATA) goto full;
+            bcopy(&a.i, r->data + len, sizeof(a.i));
+            len += sizeof(a.i);
+        }
+
+        switch (kind)
+        {
+            case DBG_A_INT:    a.i = va_arg(ap, int); n = sizeof(a.i); break;
+            case DBG_A_LONG:   a.l = va_arg(ap, long); n = sizeof(a.l); break;
+            case DBG_A_LLONG:  a.ll = va_arg(ap, long long); n = sizeof(a.ll); break;
+            case DBG_A_SIZE:   a.z = va_arg(ap, size_t); n = sizeof(a.z); break;
+            case DBG_A_DOUBLE: a.d = va_arg(ap, double); n = sizeof(a.d); break;
+            case DBG_A_PTR:    a.p = va_arg(ap, void *); n = sizeof(a.p); break;
+            default:
+                // a NUL terminated copy, cut to what fits
+                s = va_arg(ap, const char *);
+                if (!s) s = "(null)";
+                if (len >= DBG_REC_DATA) goto full;
+                for (n = 0; s[n]  &&  len + n + 1 < DBG_REC_DATA; n++)
+                {
+                    r->data[len + n] = s[n];
+                }
+                r->data[len + n] = '\0';
+                len += n + 1;
+                continue;
+        }
+
+        if (len + n > DBG_REC_DATA) goto full;
+        bcopy(&a, r->data + len, n);
+        len += n;
+    }
+full:
+    va_end(ap);
+
+    r->len = len;
+
+    // publish
+    U_BARRIER();
+    r->seq = pos + 1;
+
+out:
+    U_ATOMIC_DEC(&dbg_ring.busy);
+}
+
+// Find the next conversion at or after p, skipping %%, copy it to spec and
+// say what it takes. Returns the end of it, NULL once there are no more.
+const char *
+dbg_spec(const char *p, const char **start, char *spec, int *kind, int *star)
+{
+    int l;
+
+    for (;; p += 2)
+    {
+        for (; *p  &&  *p != '%'; p++);
+        if (!*p) return NULL;
+        if (p[1] != '%') break;
+    }
+
+    *start = p++;
+    *star = 0;
+    l = 0;
+
+    for (; *p  &&  strchr("-+ #0123456789.*", *p); p++)
+    {
+        if (*p == '*') (*star)++;
+    }
+
+    for (; *p  &&  strchr("hlqjzt", *p); p++)
+    {
+        l = (*p == 'l' ? l + 1 : (*p == 'h' ? l : (*p == 'q' ? 2 : 3)));
+    }
+
+    switch (*p)
+    {
+        case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+            *kind = (l == 0 ? DBG_A_INT : (l == 1 ? DBG_A_LONG : (l == 2 ? DBG_A_LLONG : DBG_A_SIZE)));
+            break;
+        case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+            *kind = DBG_A_DOUBLE;
+            break;
+        case 'p':
+            *kind = DBG_A_PTR;
+            break;
+        case 's':
+            *kind = DBG_A_STR;
+            break;
+        default:
+            *kind = DBG_A_NONE;
+            return p;
+    }
+    p++;
+
+    if (p - *start >= 32  ||  *star > 2)
+    {
+        *kind = DBG_A_NONE;
+        return p;
+    }
+    bcopy(*start, spec, p - *start);
+    spec[p - *start] = '\0';
+
+    return p;
+}
+
+void *
+dbg_write_thread(void *arg)
+{
+    struct timespec ts;
+
+    (void)arg;
+
+    for (;;)
+    {
+        if (dbg_drain())
+        {
+            fflush(dbg_ring.out);
+            continue;
+        }
+
+        // nothing new, and stop is only set once every trace is through
+        if (dbg_ring.stop) break;
+
+        ts.tv_sec = 0;
+        ts.tv_nsec = DBG_IDLE_USEC * 1000;
+        nanosleep(&ts, NULL);
+    }
+
+    return NULL;
+}
+
+// Write out whatever has been published, returns how many
+int
+dbg_drain(void)
+{
+    dbg_rec *r;
+    int n;
+
+    for (n = 0;; n++)
+    {
+        r = &dbg_ring.rec[dbg_ring.head & dbg_ring.mask];
+        if (r->seq != dbg_ring.head + 1) break;
+
+        U_BARRIER();
+        dbg_format(r);
+
+        U_BARRIER();
+        r->seq = dbg_ring.head + dbg_ring.mask + 1;
+        dbg_ring.head++;
+    }
+
+    return n;
+}
+
+// As OUT4() would have, with the time in front
+void
+dbg_format(dbg_rec *r)
+{
+    FILE *out;
+    const char *p, *q, *lit;
+    char spec[32];
+    UInt32 off;
+    int kind, star, w[2], i;
+    union {
+        int i;
+        long l;
+        long long ll;
+        size_t z;
+        double d;
+        void *p;
+    } a;
+
+    out = dbg_ring.out;
+    fprintf(out, "%llu.%06llu ", (unsigned long long)(r->ns / 1000000000),
+            (unsigned long long)(r->ns / 1000 % 1000000));
+
+    off = 0;
+    lit = r->fmt;
+    for (p = r->fmt; (p = dbg_spec(p, &q, spec, &kind, &star)); lit = p)
+    {
+        if (kind == DBG_A_NONE) break;
+
+        // what's between conversions goes as is
+        for (; lit < q; lit++)
+        {
+            if (lit[0] == '%') lit++;
+            fputc(*lit, out);
+        }
+
+        for (i = 0; i < star; i++)
+        {
+            if (off + sizeof(int) > r->len) goto cut;
+            bcopy(r->data + off, &w[i], sizeof(int));
+            off += sizeof(int);
+        }
+
+        if (kind == DBG_A_STR)
+        {
+            if (off >= r->len) goto cut;
+            a.p = r->data + off;
+            off += strlen((char *)a.p) + 1;
+        } else
+        {
+            i = (kind == DBG_A_INT ? sizeof(a.i) : (kind == DBG_A_LONG ? sizeof(a.l) :
+                 (kind == DBG_A_LLONG ? sizeof(a.ll) : (kind == DBG_A_SIZE ? sizeof(a.z) :
+                 (kind == DBG_A_DOUBLE ? sizeof(a.d) : sizeof(a.p))))));
+            if (off + i > r->len) goto cut;
+            bcopy(r->data + off, &a, i);
+            off += i;
+        }
+
+        switch (kind * 3 + star)
+        {
+#define DBG_CASE(k, v) \
+            case k * 3:     fprintf(out, spec, v); break; \
+            case k * 3 + 1: fprintf(out, spec, w[0], v); break; \
+            case k * 3 + 2: fprintf(out, spec, w[0], w[1], v); break;
+            DBG_CASE(DBG_A_INT, a.i)
+            DBG_CASE(DBG_A_LONG, a.l)
+            DBG_CASE(DBG_A_LLONG, a.ll)
+            DBG_CASE(DBG_A_SIZE, a.z)
+            DBG_CASE(DBG_A_DOUBLE, a.d)
+            DBG_CASE(DBG_A_PTR, a.p)
+            DBG_CASE(DBG_A_STR, (char *)a.p)
+#undef DBG_CASE
+        }
+    }
+
+    // and after the last, or from one we can't handle on
+    for (; *lit; lit++)
+    {
+        if (lit[0] == '%'  &&  lit[1] == '%') lit++;
+        fputc(*lit, out);
+    }
+    fputc('\n', out);
+    return;
+
+cut:
+    fputs("...\n", out);
+}
@@ -21,16 +21,29 @@
 #define DBG_MODULE_DEFINE2(module) DBG_MODULE_DEFINE3(module)
 #define DBG_MODULE_DEFINE3(module) int dbg_level_##module
 
+// Levels above this are compiled out, e.g. -DDBG_LEVEL_MAX=DBG_LOG_LVL
+// leaves no trace of DBG() or DMP() in the binary
+#ifndef DBG_LEVEL_MAX
+#define DBG_LEVEL_MAX DBG_DMP_LVL
+#endif
+
 #define OUT(type, level, x...) do { \
     OUT2(MODULE_NAME, __LINE__, type, level, x); \
 } while (0)
 
 #define OUT2(module, line, type, level, x...) OUT3(module, line, type, level, x)
 
-#define OUT3(module, line, type, level, x...) if (dbg_level_##module >= level) \
+// Errors always go straight out, the rest through the trace ring if it's on
+#define OUT3(module, line, type, level, x...) if ((level) <= DBG_LEVEL_MAX  &&  dbg_level_##module >= level) \
 { \
-    OUT4(type": "#module": "__FILE__"("#line"): "x); \
-    OUT4("\n"); \
+    if ((level) > DBG_ERR_LVL  &&  dbg_ring_on) \
+    { \
+        dbg_trace(type": "#module": "__FILE__"("#line"): "x); \
+    } else \
+    { \
+        OUT4(type": "#module": "__FILE__"("#line"): "x); \
+        OUT4("\n"); \
+    } \
 } \
 
 #define OUT4(x...) fprintf(stderr, x) 
@@ -41,6 +54,15 @@
 #define DBG(x...) OUT("DBG", DBG_DBG_LVL, x)
 #define DMP(x...) OUT("DMP", DBG_DMP_LVL, x)
 
+// Trace ring, formatted on a thread of its own so tracing doesn't hold up
+// the caller (see debug.c)
+extern int dbg_ring_on;
+
+int      dbg_ring_start(FILE *out, unsigned slots);
+void     dbg_ring_stop(void);
+unsigned dbg_ring_drops(void);
+void     dbg_trace(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
 
 
 #endif
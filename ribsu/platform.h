@@ -0,0 +1,37 @@
+/* Copyright (C) 2007 xyster.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+
+#ifndef __PLATFORM_H
+#define __PLATFORM_H
+
+#ifdef __APPLE__
+
+#include <CoreFoundation/CoreFoundation.h>
+
+#else
+
+// Provide the handful of Carbon types the rest of the code relies on
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+typedef uint8_t  UInt8;
+typedef uint16_t UInt16;
+typedef uint32_t UInt32;
+typedef uint64_t UInt64;
+typedef int8_t   SInt8;
+typedef int16_t  SInt16;
+typedef int32_t  SInt32;
+typedef int64_t  SInt64;
+typedef unsigned char Boolean;
+
+#endif
+
+#endif
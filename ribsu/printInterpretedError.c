@@ -1,3 +1,5 @@
+#ifdef __APPLE__
+
 
 #include <CoreFoundation/CoreFoundation.h>
 #include <IOKit/IOCFPlugIn.h>
@@ -12,6 +14,8 @@ DBG_MODULE();
 
 void printInterpretedError(char *s, IOReturn err)
 {
+    UInt32 system, sub, code;
+    
 // These should be defined somewhere, but I can't find them. These from Accessing hardware.
 
 #if 0
@@ -27,8 +31,6 @@ static struct{int err; char *where;} systemSources[] = {
     };
 #endif
 
-UInt32 system, sub, code;
-    
     ERR("%s (0x%08X) ", s, err);
     
     system = err_get_system(err);
@@ -55,3 +57,5 @@ UInt32 system, sub, code;
         ERR("error %ld(0x%lX) from system %ld(0x%lX) - subsytem %ld(0x%lX) ", code, code, system, system, sub, sub);
     }
 }
+
+#endif
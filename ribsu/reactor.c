@@ -0,0 +1,614 @@
+/* Copyright (C) 2007 xyster.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "platform.h"
+
+#ifdef __linux__
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+#include "debug.h"
+#include "reactor.h"
+#include "ribsu-util.h"
+
+#define MODULE_NAME reactor
+DBG_MODULE_DEFINE();
+
+typedef struct reactor_source
+{
+    int fd;
+    reactor_fd_fn fn;
+    void *fn_arg;
+    int dead;
+#ifndef __linux__
+    CFSocketRef sock;
+    CFRunLoopSourceRef rls;
+#endif
+    struct reactor_source *next;
+} reactor_source;
+
+#ifdef __linux__
+
+#define REACTOR_MAX_EVENTS 64
+
+static struct {
+    int epfd;
+    int wakefd;
+    volatile sig_atomic_t stop;
+    reactor_source *sources;
+    reactor_timer *timers; // sorted by deadline
+    pthread_mutex_t lock;  // the two lists, never held over a callback
+    pthread_t thread;      // in reactor_run()
+    int running;
+} reactor = { .epfd = -1, .wakefd = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static int    reactor_setup(void);
+static int    reactor_timeout(void);
+static void   reactor_run_timers(void);
+static void   reactor_reap(void);
+static void   reactor_unlink(reactor_timer *t);
+static reactor_source *reactor_find(int fd);
+
+int
+reactor_add_fd(int fd, reactor_fd_fn fn, void *fn_arg)
+{
+    reactor_source *src;
+    struct epoll_event ev;
+    int error;
+
+    src = malloc(sizeof(*src));
+    if (!src)
+    {
+        U_NOMEM();
+        return -1;
+    }
+
+    bzero(src, sizeof(*src));
+    src->fd = fd;
+    src->fn = fn;
+    src->fn_arg = fn_arg;
+
+    pthread_mutex_lock(&reactor.lock);
+
+    if (reactor_setup())
+    {
+        error = -1;
+        goto out;
+    }
+
+    bzero(&ev, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = src;
+    if (epoll_ctl(reactor.epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+        ERR("Failed to add fd %d - %s(%d)\n", fd, strerror(errno), errno);
+        error = -1;
+        goto out;
+    }
+
+    src->next = reactor.sources;
+    reactor.sources = src;
+
+    error = 0;
+
+out:
+    pthread_mutex_unlock(&reactor.lock);
+
+    if (error) free(src);
+
+    return error;
+}
+
+int
+reactor_remove_fd(int fd)
+{
+    reactor_source *src;
+
+    pthread_mutex_lock(&reactor.lock);
+
+    src = reactor_find(fd);
+    if (src)
+    {
+        epoll_ctl(reactor.epfd, EPOLL_CTL_DEL, fd, NULL);
+
+        // the source may still be referenced by the event batch being
+        // dispatched, so only mark it here and let reactor_reap() free it
+        src->dead = 1;
+    }
+
+    pthread_mutex_unlock(&reactor.lock);
+
+    return (src ? 0 : -1);
+}
+
+void
+reactor_timer_init(reactor_timer *t, reactor_timer_fn fn, void *fn_arg)
+{
+    bzero(t, sizeof(*t));
+
+    t->fn = fn;
+    t->fn_arg = fn_arg;
+}
+
+void
+reactor_timer_arm(reactor_timer *t, UInt32 usec)
+{
+    reactor_timer **pp;
+    int wake;
+
+    pthread_mutex_lock(&reactor.lock);
+
+    reactor_unlink(t);
+
+    t->deadline = u_now() + (UInt64)usec * 1000;
+
+    for (pp = &reactor.timers; *pp && (*pp)->deadline <= t->deadline; pp = &(*pp)->next);
+
+    t->next = *pp;
+    *pp = t;
+    t->armed = 1;
+
+    // the reactor is waiting on another thread for a later deadline
+    wake = (reactor.timers == t  &&  reactor.running  &&  !pthread_equal(reactor.thread, pthread_self()));
+
+    pthread_mutex_unlock(&reactor.lock);
+
+    if (wake) reactor_wakeup();
+}
+
+void
+reactor_timer_cancel(reactor_timer *t)
+{
+    pthread_mutex_lock(&reactor.lock);
+    reactor_unlink(t);
+    pthread_mutex_unlock(&reactor.lock);
+}
+
+// The timer list is locked
+void
+reactor_unlink(reactor_timer *t)
+{
+    reactor_timer **pp;
+
+    if (!t->armed) return;
+
+    for (pp = &reactor.timers; *pp; pp = &(*pp)->next)
+    {
+        if (*pp == t)
+        {
+            *pp = t->next;
+            break;
+        }
+    }
+
+    t->next = NULL;
+    t->armed = 0;
+}
+
+void
+reactor_timer_deinit(reactor_timer *t)
+{
+    reactor_timer_cancel(t);
+}
+
+void
+reactor_run(void)
+{
+    struct epoll_event ev[REACTOR_MAX_EVENTS];
+    reactor_source *src;
+    UInt64 v;
+    int n, i, timeout;
+
+    pthread_mutex_lock(&reactor.lock);
+    if (reactor_setup())
+    {
+        pthread_mutex_unlock(&reactor.lock);
+        return;
+    }
+    reactor.thread = pthread_self();
+    reactor.running = 1;
+    pthread_mutex_unlock(&reactor.lock);
+
+    while (!reactor.stop)
+    {
+        pthread_mutex_lock(&reactor.lock);
+        timeout = reactor_timeout();
+        pthread_mutex_unlock(&reactor.lock);
+
+        n = epoll_wait(reactor.epfd, ev, REACTOR_MAX_EVENTS, timeout);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            ERR("epoll_wait failed - %s(%d)\n", strerror(errno), errno);
+            break;
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            src = ev[i].data.ptr;
+            if (!src)
+            {
+                // wakeup, just drain the counter
+                if (read(reactor.wakefd, &v, sizeof(v)) < 0) {}
+                continue;
+            }
+
+            if (!src->dead)
+            {
+                src->fn(src->fd, src->fn_arg);
+            }
+        }
+
+        reactor_run_timers();
+        reactor_reap();
+    }
+
+    pthread_mutex_lock(&reactor.lock);
+    reactor.running = 0;
+    pthread_mutex_unlock(&reactor.lock);
+
+    reactor.stop = 0;
+}
+
+void
+reactor_stop(void)
+{
+    reactor.stop = 1;
+    reactor_wakeup();
+}
+
+void
+reactor_wakeup(void)
+{
+    UInt64 v = 1;
+
+    if (reactor.wakefd < 0) return;
+
+    if (write(reactor.wakefd, &v, sizeof(v)) < 0) {}
+}
+
+// The lists are locked
+int
+reactor_setup(void)
+{
+    struct epoll_event ev;
+
+    if (reactor.epfd >= 0) return 0;
+
+    reactor.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor.epfd < 0)
+    {
+        ERR("Failed to create epoll fd - %s(%d)\n", strerror(errno), errno);
+        return -1;
+    }
+
+    reactor.wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (reactor.wakefd < 0)
+    {
+        ERR("Failed to create wakeup fd - %s(%d)\n", strerror(errno), errno);
+        goto error;
+    }
+
+    bzero(&ev, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(reactor.epfd, EPOLL_CTL_ADD, reactor.wakefd, &ev) < 0)
+    {
+        ERR("Failed to add wakeup fd - %s(%d)\n", strerror(errno), errno);
+        goto error;
+    }
+
+    return 0;
+
+error:
+    if (reactor.wakefd >= 0) close(reactor.wakefd);
+    close(reactor.epfd);
+    reactor.wakefd = reactor.epfd = -1;
+
+    return -1;
+}
+
+// milliseconds until the earliest timer, rounded up, or -1 to block. The
+// timer list is locked.
+int
+reactor_timeout(void)
+{
+    UInt64 now;
+
+    if (!reactor.timers) return -1;
+
+    now = u_now();
+    if (reactor.timers->deadline <= now) return 0;
+
+    return (int)((reactor.timers->deadline - now + 999999) / 1000000);
+}
+
+void
+reactor_run_timers(void)
+{
+    reactor_timer *t;
+    reactor_timer_fn fn;
+    void *fn_arg;
+    UInt64 now;
+
+    now = u_now();
+
+    pthread_mutex_lock(&reactor.lock);
+
+    while ((t = reactor.timers) && t->deadline <= now)
+    {
+        reactor.timers = t->next;
+        t->next = NULL;
+        t->armed = 0;
+        fn = t->fn;
+        fn_arg = t->fn_arg;
+
+        // the callback is free to re-arm the timer, or to arm others from
+        // wherever it likes
+        pthread_mutex_unlock(&reactor.lock);
+        fn(fn_arg);
+        pthread_mutex_lock(&reactor.lock);
+    }
+
+    pthread_mutex_unlock(&reactor.lock);
+}
+
+void
+reactor_reap(void)
+{
+    reactor_source **pp, *src;
+
+    pthread_mutex_lock(&reactor.lock);
+
+    pp = &reactor.sources;
+    while ((src = *pp))
+    {
+        if (src->dead)
+        {
+            *pp = src->next;
+            free(src);
+        } else
+        {
+            pp = &src->next;
+        }
+    }
+
+    pthread_mutex_unlock(&reactor.lock);
+}
+
+// The source list is locked
+reactor_source *
+reactor_find(int fd)
+{
+    reactor_source *src;
+
+    for (src = reactor.sources; src; src = src->next)
+    {
+        if (src->fd == fd  &&  !src->dead) return src;
+    }
+
+    return NULL;
+}
+
+#else
+
+// Effectively never, CF invalidates non-repeating timers after they fire
+#define REACTOR_CF_IDLE (1.0e10)
+
+static struct {
+    reactor_source *sources;
+    pthread_mutex_t lock; // the source list
+    CFRunLoopRef loop;    // of the thread that first used the reactor
+} reactor = { NULL, PTHREAD_MUTEX_INITIALIZER, NULL };
+
+static CFRunLoopRef reactor_loop(void);
+static void reactor_socket_callback(CFSocketRef s,
+                                    CFSocketCallBackType callbackType,
+                                    CFDataRef address,
+                                    const void *data,
+                                    void *info);
+static void reactor_timer_callback(CFRunLoopTimerRef timer, void *info);
+
+int
+reactor_add_fd(int fd, reactor_fd_fn fn, void *fn_arg)
+{
+    reactor_source *src;
+    CFSocketContext context;
+    CFOptionFlags flags;
+
+    src = malloc(sizeof(*src));
+    if (!src)
+    {
+        U_NOMEM();
+        return -1;
+    }
+
+    bzero(src, sizeof(*src));
+    src->fd = fd;
+    src->fn = fn;
+    src->fn_arg = fn_arg;
+
+    bzero(&context, sizeof(context));
+    context.info = src;
+
+    src->sock = CFSocketCreateWithNative(kCFAllocatorDefault, fd, kCFSocketReadCallBack,
+                                         reactor_socket_callback, &context);
+    if (!src->sock)
+    {
+        ERR("Failed to obtain socket reference!\n");
+        free(src);
+        return -1;
+    }
+
+    // the fd belongs to the caller
+    flags = CFSocketGetSocketFlags(src->sock);
+    CFSocketSetSocketFlags(src->sock, flags & ~kCFSocketCloseOnInvalidate);
+
+    src->rls = CFSocketCreateRunLoopSource(NULL, src->sock, 10);
+    CFRunLoopAddSource(reactor_loop(), src->rls, kCFRunLoopDefaultMode);
+
+    pthread_mutex_lock(&reactor.lock);
+    src->next = reactor.sources;
+    reactor.sources = src;
+    pthread_mutex_unlock(&reactor.lock);
+
+    return 0;
+}
+
+int
+reactor_remove_fd(int fd)
+{
+    reactor_source **pp, *src;
+
+    pthread_mutex_lock(&reactor.lock);
+
+    for (pp = &reactor.sources; (src = *pp); pp = &src->next)
+    {
+        if (src->fd == fd) break;
+    }
+
+    if (src) *pp = src->next;
+
+    pthread_mutex_unlock(&reactor.lock);
+
+    if (!src) return -1;
+
+    CFRunLoopSourceInvalidate(src->rls);
+    CFRelease(src->rls);
+    CFSocketInvalidate(src->sock);
+    CFRelease(src->sock);
+    free(src);
+
+    return 0;
+}
+
+void
+reactor_timer_init(reactor_timer *t, reactor_timer_fn fn, void *fn_arg)
+{
+    CFRunLoopTimerContext context;
+
+    bzero(t, sizeof(*t));
+
+    t->fn = fn;
+    t->fn_arg = fn_arg;
+
+    bzero(&context, sizeof(context));
+    context.info = t;
+
+    // A repeating timer with an enormous interval stays valid forever and is
+    // armed/disarmed simply by moving its next fire date
+    t->ref = CFRunLoopTimerCreate(kCFAllocatorDefault,
+                                  CFAbsoluteTimeGetCurrent() + REACTOR_CF_IDLE,
+                                  REACTOR_CF_IDLE, 0, 0,
+                                  reactor_timer_callback, &context);
+    if (!t->ref)
+    {
+        ERR("Failed to create timer\n");
+        return;
+    }
+
+    CFRunLoopAddTimer(reactor_loop(), t->ref, kCFRunLoopDefaultMode);
+}
+
+void
+reactor_timer_arm(reactor_timer *t, UInt32 usec)
+{
+    if (!t->ref) return;
+
+    CFRunLoopTimerSetNextFireDate(t->ref, CFAbsoluteTimeGetCurrent() + usec / 1000000.0);
+    t->armed = 1;
+}
+
+void
+reactor_timer_cancel(reactor_timer *t)
+{
+    if (!t->ref  ||  !t->armed) return;
+
+    CFRunLoopTimerSetNextFireDate(t->ref, CFAbsoluteTimeGetCurrent() + REACTOR_CF_IDLE);
+    t->armed = 0;
+}
+
+void
+reactor_timer_deinit(reactor_timer *t)
+{
+    if (!t->ref) return;
+
+    CFRunLoopTimerInvalidate(t->ref);
+    CFRelease(t->ref);
+    t->ref = NULL;
+    t->armed = 0;
+}
+
+void
+reactor_run(void)
+{
+    reactor_loop();
+    CFRunLoopRun();
+}
+
+void
+reactor_stop(void)
+{
+    if (reactor.loop) CFRunLoopStop(reactor.loop);
+}
+
+void
+reactor_wakeup(void)
+{
+    if (reactor.loop) CFRunLoopWakeUp(reactor.loop);
+}
+
+// Sources and timers go on the run loop of the thread that runs the reactor,
+// whichever thread adds them. That thread is the first one in here.
+CFRunLoopRef
+reactor_loop(void)
+{
+    pthread_mutex_lock(&reactor.lock);
+    if (!reactor.loop) reactor.loop = CFRunLoopGetCurrent();
+    pthread_mutex_unlock(&reactor.lock);
+
+    return reactor.loop;
+}
+
+void
+reactor_socket_callback(CFSocketRef s,
+                        CFSocketCallBackType callbackType,
+                        CFDataRef address,
+                        const void *data,
+                        void *info)
+{
+    reactor_source *src;
+
+    src = info;
+
+    src->fn(src->fd, src->fn_arg);
+}
+
+void
+reactor_timer_callback(CFRunLoopTimerRef timer, void *info)
+{
+    reactor_timer *t;
+
+    t = info;
+
+    // park the timer again before the callback gets a chance to re-arm it
+    CFRunLoopTimerSetNextFireDate(t->ref, CFAbsoluteTimeGetCurrent() + REACTOR_CF_IDLE);
+    t->armed = 0;
+
+    t->fn(t->fn_arg);
+}
+
+#endif
@@ -0,0 +1,53 @@
+/* Copyright (C) 2007 xyster.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+
+#ifndef __REACTOR_H
+#define __REACTOR_H
+
+/* The reactor multiplexes every fd source and timer of the process. On Linux
+ * it is a native epoll loop, elsewhere it sits on top of the current
+ * CFRunLoop so that IOKit notification sources keep working alongside it.
+ *
+ * One thread runs the reactor, on Mac OS X the first one to use it, and
+ * every callback runs on that thread. Fds may be added and timers armed or cancelled from
+ * any thread, the reactor wakes up if its next deadline moves. A timer is
+ * deinitialized, or an fd removed for good, on the reactor thread (or while
+ * it isn't running) so that its callback can't be halfway through.
+ */
+
+typedef void (*reactor_fd_fn)(int fd, void *arg);
+typedef void (*reactor_timer_fn)(void *arg);
+
+// Timers are owned (and usually embedded) by the caller, the reactor never
+// allocates or frees them.
+typedef struct reactor_timer
+{
+    reactor_timer_fn fn;
+    void *fn_arg;
+    int armed;
+#ifdef __linux__
+    UInt64 deadline; // CLOCK_MONOTONIC in ns
+    struct reactor_timer *next;
+#else
+    CFRunLoopTimerRef ref;
+#endif
+} reactor_timer;
+
+int  reactor_add_fd(int fd, reactor_fd_fn fn, void *fn_arg);
+int  reactor_remove_fd(int fd);
+
+void reactor_timer_init(reactor_timer *t, reactor_timer_fn fn, void *fn_arg);
+void reactor_timer_arm(reactor_timer *t, UInt32 usec);
+void reactor_timer_cancel(reactor_timer *t);
+void reactor_timer_deinit(reactor_timer *t);
+
+void reactor_run(void);
+void reactor_stop(void);   // safe to call from a signal handler
+void reactor_wakeup(void); // safe to call from a signal handler or another thread
+
+#endif
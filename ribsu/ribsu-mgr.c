@@ -0,0 +1,273 @@
+/* Copyright (C) 2007 xyster.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+
+#include "platform.h"
+
+#include "debug.h"
+#include "ribsu-util.h"
+#include "tty.h"
+#include "ribsu.h"
+#include "ribsu-mgr.h"
+
+#define MODULE_NAME ribsu_mgr
+DBG_MODULE_DEFINE();
+
+typedef struct mgr_dev
+{
+    UInt32 id;
+    char name[TTY_MAX_NAME];
+    char serial[TTY_MAX_SERIAL];
+    ribsu_ctx ribsu;
+    struct mgr_ctx *mgr;
+} mgr_dev;
+
+typedef struct mgr_ctx
+{
+    mgr_dev *dev[MGR_MAX_DEVICES]; // each on its own, ribsu_ctx is big
+    UInt32 nof_devs;
+    mgr_callback_fn callback_fn;
+    void *callback_arg;
+} mgr_ctx;
+
+static void mgr_read_callback(void *ctx0, buffer *buf);
+
+int
+mgr_create(void **ctx0)
+{
+    mgr_ctx *ctx;
+
+    *ctx0 = NULL;
+
+    ctx = malloc(sizeof(*ctx));
+    if (!ctx)
+    {
+        U_NOMEM();
+        return -1;
+    }
+    bzero(ctx, sizeof(*ctx));
+
+    *ctx0 = ctx;
+
+    return 0;
+}
+
+// Open every USB-UIRT that isn't open yet, returns how many were
+int
+mgr_scan(void *ctx0)
+{
+    mgr_ctx *ctx;
+    tty_dev_info *devs;
+    UInt32 i, j;
+    int n, added;
+
+    ctx = ctx0;
+
+    devs = malloc(MGR_MAX_DEVICES * sizeof(*devs));
+    if (!devs)
+    {
+        U_NOMEM();
+        return 0;
+    }
+
+    n = tty_find_devices(devs, MGR_MAX_DEVICES);
+    DBG("Found %d devices\n", n);
+
+    added = 0;
+    for (i = 0; i < (UInt32)n; i++)
+    {
+        for (j = 0; j < ctx->nof_devs  &&  strcmp(ctx->dev[j]->name, devs[i].name); j++);
+        if (j < ctx->nof_devs) continue;
+
+        if (mgr_add(ctx, devs[i].name, devs[i].serial) >= 0) added++;
+    }
+
+    free(devs);
+
+    return added;
+}
+
+// Open the device at name, serial may be NULL. Returns its id, -1 if it
+// can't be opened.
+int
+mgr_add(void *ctx0, const char *name, const char *serial)
+{
+    mgr_ctx *ctx;
+    mgr_dev *dev;
+    ribsu_opts opts;
+
+    ctx = ctx0;
+
+    if (ctx->nof_devs == MGR_MAX_DEVICES)
+    {
+        ERR("Already managing %u devices, not adding %s\n", (unsigned)ctx->nof_devs, name);
+        return -1;
+    }
+
+    dev = malloc(sizeof(*dev));
+    if (!dev)
+    {
+        U_NOMEM();
+        return -1;
+    }
+    bzero(dev, sizeof(*dev));
+
+    bzero(&opts, sizeof(opts));
+    opts.use_tty = 1;
+    opts.locking = 1;
+    snprintf(opts.tty_dev_name, sizeof(opts.tty_dev_name), "%s", name);
+
+    if (ribsu_init(&dev->ribsu, &opts))
+    {
+        ERR("Failed to open %s\n", name);
+        free(dev);
+        return -1;
+    }
+
+    dev->id = ctx->nof_devs;
+    dev->mgr = ctx;
+    snprintf(dev->name, sizeof(dev->name), "%s", name);
+    snprintf(dev->serial, sizeof(dev->serial), "%s", serial ? serial : "");
+
+    ribsu_set_callback(&dev->ribsu, mgr_read_callback, dev);
+
+    // whole before it can be looked up
+    ctx->dev[ctx->nof_devs] = dev;
+    U_BARRIER();
+    ctx->nof_devs++;
+
+    DBG("Device %u is %s serial %s\n", (unsigned)dev->id, dev->name, dev->serial);
+
+    return dev->id;
+}
+
+UInt32
+mgr_count(void *ctx0)
+{
+    mgr_ctx *ctx;
+
+    ctx = ctx0;
+
+    return ctx->nof_devs;
+}
+
+// NULL if there is no such device
+ribsu_ctx *
+mgr_device(void *ctx0, UInt32 id)
+{
+    mgr_ctx *ctx;
+
+    ctx = ctx0;
+
+    return (id < ctx->nof_devs ? &ctx->dev[id]->ribsu : NULL);
+}
+
+const char *
+mgr_serial(void *ctx0, UInt32 id)
+{
+    mgr_ctx *ctx;
+
+    ctx = ctx0;
+
+    return (id < ctx->nof_devs ? ctx->dev[id]->serial : NULL);
+}
+
+// The id of the device with a serial number, -1 if there is none
+int
+mgr_lookup(void *ctx0, const char *serial)
+{
+    mgr_ctx *ctx;
+    UInt32 i;
+
+    ctx = ctx0;
+
+    if (!serial[0]) return -1;
+
+    for (i = 0; i < ctx->nof_devs; i++)
+    {
+        if (!strcmp(ctx->dev[i]->serial, serial)) return i;
+    }
+
+    return -1;
+}
+
+// What any device sends, tagged with its id
+int
+mgr_set_callback(void *ctx0, mgr_callback_fn fn, void *fn_arg)
+{
+    mgr_ctx *ctx;
+
+    ctx = ctx0;
+
+    ctx->callback_fn = fn;
+    ctx->callback_arg = fn_arg;
+
+    return 0;
+}
+
+int
+mgr_send(void *ctx0, UInt32 id, buffer *buf, ribsu_done_fn fn, void *fn_arg)
+{
+    ribsu_ctx *ribsu;
+
+    ribsu = mgr_device(ctx0, id);
+    if (!ribsu)
+    {
+        ERR("No device %u\n", (unsigned)id);
+        return -1;
+    }
+
+    return ribsu_send_async(ribsu, buf, fn, fn_arg);
+}
+
+int
+mgr_send_serial(void *ctx0, const char *serial, buffer *buf, ribsu_done_fn fn, void *fn_arg)
+{
+    int id;
+
+    id = mgr_lookup(ctx0, serial);
+    if (id < 0)
+    {
+        ERR("No device with serial %s\n", serial);
+        return -1;
+    }
+
+    return mgr_send(ctx0, id, buf, fn, fn_arg);
+}
+
+void
+mgr_shutdown(void *ctx0)
+{
+    mgr_ctx *ctx;
+    UInt32 i;
+
+    ctx = ctx0;
+    if (!ctx) return;
+
+    for (i = 0; i < ctx->nof_devs; i++)
+    {
+        ribsu_deinit(&ctx->dev[i]->ribsu);
+        free(ctx->dev[i]);
+    }
+
+    free(ctx);
+}
+
+void
+mgr_read_callback(void *ctx0, buffer *buf)
+{
+    mgr_dev *dev;
+    mgr_ctx *ctx;
+
+    dev = ctx0;
+    ctx = dev->mgr;
+
+    if (ctx->callback_fn)
+    {
+        ctx->callback_fn(ctx->callback_arg, dev->id, buf);
+    }
+}
@@ -0,0 +1,43 @@
+/* Copyright (C) 2007 xyster.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+
+#ifndef __RIBSU_MGR_H
+#define __RIBSU_MGR_H
+
+#include "tty.h"
+#include "ribsu.h"
+
+/* Many USB-UIRTs in one process. Every device gets a ribsu_ctx of its own,
+ * with its own state machine, queue and deadline, and they all share the
+ * one reactor. Nothing is shared between devices, so a slow or dead one
+ * holds up no other. Devices are opened through the TTY driver, and a
+ * device is known by an id, its index in the order it was added, or by its
+ * USB serial number.
+ *
+ * Devices are opened with locking, so any thread may send to one or look
+ * one up, a worker thread per device if need be. Adding devices and the
+ * shutdown are for the reactor thread.
+ */
+
+#define MGR_MAX_DEVICES (64)
+
+typedef void (*mgr_callback_fn)(void *, UInt32 id, buffer *);
+
+int         mgr_create(void **ctx);
+int         mgr_scan(void *ctx);
+int         mgr_add(void *ctx, const char *name, const char *serial);
+UInt32      mgr_count(void *ctx);
+ribsu_ctx  *mgr_device(void *ctx, UInt32 id);
+const char *mgr_serial(void *ctx, UInt32 id);
+int         mgr_lookup(void *ctx, const char *serial);
+int         mgr_set_callback(void *ctx, mgr_callback_fn fn, void *fn_arg);
+int         mgr_send(void *ctx, UInt32 id, buffer *buf, ribsu_done_fn fn, void *fn_arg);
+int         mgr_send_serial(void *ctx, const char *serial, buffer *buf, ribsu_done_fn fn, void *fn_arg);
+void        mgr_shutdown(void *ctx);
+
+#endif
@@ -8,7 +8,19 @@
 
 #include <stdio.h>
 #include <unistd.h>
-#include <CoreFoundation/CoreFoundation.h>
+#include <string.h>
+#include <time.h>
+#include "platform.h"
+#ifdef __APPLE__
+#include <pthread.h>
+#include <mach/mach_time.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "debug.h"
 #include "ribsu-util.h"
@@ -16,16 +28,16 @@
 #define MODULE_NAME ribsu_util
 DBG_MODULE_DEFINE();
 
+volatile UInt32 u_alloc_failures;
+
+static UInt32 hist_index(UInt64 v);
+static UInt64 hist_value(UInt32 i);
+
 int
-add_fd_source(int fd, FILE **cfp, CFSocketCallBack callback, void *callback_arg)
+add_fd_source(int fd, FILE **cfp, reactor_fd_fn callback, void *callback_arg)
 {
-    CFSocketRef sockRef;
-    CFRunLoopSourceRef runLoopSource;
     FILE *fp;
-    CFSocketContext context;
     
-    /* Create the CF socket
-        */
     fp = fdopen(fd, "r");
     if (!fp)
     {
@@ -33,27 +45,11 @@ add_fd_source(int fd, FILE **cfp, CFSocketCallBack callback, void *callback_arg)
         return -1;
     }
 
-    bzero(&context, sizeof(context));
-    if (callback_arg)
+    if (reactor_add_fd(fd, callback, callback_arg ? callback_arg : fp))
     {
-        context.info = callback_arg;
-    } else
-    {
-        context.info = fp;
-    }
-    sockRef = CFSocketCreateWithNative(kCFAllocatorDefault, fd, kCFSocketReadCallBack, callback, &context);
-    
-    if (!sockRef)
-    {
-        ERR("Failed to obtain socket reference!\n");
+        ERR("Failed to add fd source!\n");
         return -1;
     }
-    
-    /* Add the CF socket as a source
-        */
-    runLoopSource = CFSocketCreateRunLoopSource(NULL, sockRef, 10);
-    CFRunLoopAddSource(CFRunLoopGetCurrent(), runLoopSource, 
-                       kCFRunLoopDefaultMode);
 
     if (cfp) *cfp = fp;
     
@@ -67,7 +63,11 @@ buf_alloc(UInt32 max)
     buffer *buf;
     
     buf = malloc(sizeof(*buf) + max);
-    if (!buf) return buf;
+    if (!buf)
+    {
+        U_ATOMIC_INC(&u_alloc_failures);
+        return buf;
+    }
     
     buf->max = max;
     buf->len = 0;
@@ -82,6 +82,7 @@ buf_init(buffer *buf, UInt32 max)
     buf->buf = malloc(max);
     if (!buf->buf)
     {
+        U_ATOMIC_INC(&u_alloc_failures);
         return NULL;
     }
     
@@ -170,63 +171,779 @@ buf_free(buffer *buf)
     }
 }
 
-void 
+ring *
+ring_attach(ring *r, UInt32 size, UInt8 *buf, UInt32 limit)
+{
+    // size must be a power of 2
+    if (size & (size - 1)) return NULL;
+    
+    r->size = size;
+    r->head = r->tail = 0;
+    r->limit = limit;
+    r->buf = r->lcl = buf;
+    
+    return r;
+}
+
+int
+ring_append(ring *r, buffer *src)
+{
+    UInt32 len, size, idx, n;
+    UInt8 *buf;
+    
+    len = RING_LEN(r) + src->len;
+    
+    if (len > r->size)
+    {
+        // grow rather than drop, up to the limit
+        for (size = r->size; size < len; size <<= 1);
+        
+        if (size > r->limit)
+        {
+            return -1;
+        }
+        
+        buf = malloc(size);
+        if (!buf)
+        {
+            U_ATOMIC_INC(&u_alloc_failures);
+            return -1;
+        }
+        
+        n = ring_peek(r, 0, buf, RING_LEN(r));
+        
+        if (r->buf != r->lcl)
+        {
+            free(r->buf);
+        }
+        
+        r->buf = buf;
+        r->size = size;
+        r->head = 0;
+        r->tail = n;
+    }
+    
+    idx = r->tail & (r->size - 1);
+    n = r->size - idx;
+    if (n > src->len) n = src->len;
+    
+    bcopy(src->buf, &r->buf[idx], n);
+    if (n < src->len)
+    {
+        bcopy(&src->buf[n], r->buf, src->len - n);
+    }
+    
+    r->tail += src->len;
+    
+    return 0;
+}
+
+UInt32
+ring_peek(ring *r, UInt32 off, UInt8 *d, UInt32 len)
+{
+    UInt32 idx, n;
+    
+    if (off >= RING_LEN(r)) return 0;
+    
+    if (len > RING_LEN(r) - off) len = RING_LEN(r) - off;
+    
+    idx = (r->head + off) & (r->size - 1);
+    n = r->size - idx;
+    if (n > len) n = len;
+    
+    bcopy(&r->buf[idx], d, n);
+    if (n < len)
+    {
+        bcopy(r->buf, &d[n], len - n);
+    }
+    
+    return len;
+}
+
+UInt32
+ring_read(ring *r, UInt8 *d, UInt32 len)
+{
+    len = ring_peek(r, 0, d, len);
+    r->head += len;
+    
+    return len;
+}
+
+// Pointer to byte off, and how many bytes from there on are contiguous
+UInt8 *
+ring_contig(ring *r, UInt32 off, UInt32 *len)
+{
+    UInt32 idx;
+    
+    idx = (r->head + off) & (r->size - 1);
+    
+    *len = r->size - idx;
+    if (*len > RING_LEN(r) - off) *len = RING_LEN(r) - off;
+    
+    return &r->buf[idx];
+}
+
+void
+ring_consume(ring *r, UInt32 len)
+{
+    if (len > RING_LEN(r)) len = RING_LEN(r);
+    
+    r->head += len;
+}
+
+void
+ring_reset(ring *r)
+{
+    r->head = r->tail = 0;
+}
+
+void
+ring_free(ring *r)
+{
+    if (r->buf != r->lcl)
+    {
+        free(r->buf);
+        r->buf = r->lcl;
+    }
+}
+
+// Make room for one more pair and for v, widening the arena if v needs it
+int
+ps_grow(pstore *ps, UInt32 v)
+{
+    UInt32 max, i, n;
+    int wide;
+    void *arena;
+    
+    max = ps->max;
+    if (ps->nof_pulses >= max  ||  ps->nof_spaces >= max)
+    {
+        max = max ? 2 * max : PS_MIN;
+    }
+    
+    wide = ps->wide  ||  v > 0xffff;
+    
+    if (max > PS_LIMIT)
+    {
+        DBG("pulse store limit of %d pairs reached, dropping\n", PS_LIMIT);
+        return -1;
+    }
+    
+    if (wide == ps->wide)
+    {
+        arena = realloc(ps->arena, max * 2 * (wide ? sizeof(UInt32) : sizeof(UInt16)));
+        if (!arena)
+        {
+            U_NOMEM();
+            return -1;
+        }
+    } else
+    {
+        arena = malloc(max * 2 * sizeof(UInt32));
+        if (!arena)
+        {
+            U_NOMEM();
+            return -1;
+        }
+        
+        n = 2 * (ps->nof_pulses > ps->nof_spaces ? ps->nof_pulses : ps->nof_spaces);
+        for (i = 0; i < n; i++)
+        {
+            ((UInt32 *)arena)[i] = ((UInt16 *)ps->arena)[i];
+        }
+        
+        free(ps->arena);
+    }
+    
+    ps->arena = arena;
+    ps->max = max;
+    ps->wide = wide;
+    
+    return 0;
+}
+
+// Empty the store for the next frame, the arena is kept
+void
+ps_reset(pstore *ps)
+{
+    ps->nof_pulses = 0;
+    ps->nof_spaces = 0;
+}
+
+void
+ps_free(pstore *ps)
+{
+    free(ps->arena);
+    bzero(ps, sizeof(*ps));
+}
+
+static lru_entry *lru_find(lru *c, UInt32 hash, UInt32 tag, buffer *key);
+static void lru_unlink(lru *c, UInt16 i);
+static void lru_push(lru *c, UInt16 i);
+static void lru_evict(lru *c);
+
+#define LRU_E(c, i) (&(c)->e[(i) - 1])
+
+// Copy the value cached for tag and key to val and make it the most recent.
+// Returns NULL on a miss, or if val is too small for the value.
+buffer *
+lru_get(lru *c, UInt32 tag, buffer *key, buffer *val)
+{
+    lru_entry *e;
+
+    e = lru_find(c, u_hash(key->buf, key->len, tag), tag, key);
+    if (!e  ||  e->val_len > val->max)
+    {
+        c->misses++;
+        return NULL;
+    }
+
+    c->hits++;
+
+    lru_unlink(c, e - c->e + 1);
+    lru_push(c, e - c->e + 1);
+
+    bcopy(e->data + e->key_len, val->buf, e->val_len);
+    val->len = e->val_len;
+
+    return val;
+}
+
+// Cache val for tag and key, replacing what was there and pushing out the
+// least recently used entry if full
+int
+lru_put(lru *c, UInt32 tag, buffer *key, buffer *val)
+{
+    lru_entry *e;
+    UInt32 hash;
+    UInt16 i, *b;
+    UInt8 *data;
+
+    data = malloc(key->len + val->len);
+    if (!data)
+    {
+        U_NOMEM();
+        return -1;
+    }
+    bcopy(key->buf, data, key->len);
+    bcopy(val->buf, data + key->len, val->len);
+
+    hash = u_hash(key->buf, key->len, tag);
+
+    e = lru_find(c, hash, tag, key);
+    if (e)
+    {
+        i = e - c->e + 1;
+        lru_unlink(c, i);
+        free(e->data);
+    } else
+    {
+        if (c->nof == LRU_MAX) lru_evict(c);
+
+        // the free entries are the ones past nof, eviction keeps it so
+        i = ++c->nof;
+        e = LRU_E(c, i);
+
+        b = &c->bucket[hash & (LRU_BUCKETS - 1)];
+        e->chain = *b;
+        *b = i;
+    }
+
+    e->hash = hash;
+    e->tag = tag;
+    e->key_len = key->len;
+    e->val_len = val->len;
+    e->data = data;
+
+    lru_push(c, i);
+
+    return 0;
+}
+
+void
+lru_free(lru *c)
+{
+    UInt32 i;
+
+    for (i = 0; i < c->nof; i++)
+    {
+        free(c->e[i].data);
+    }
+
+    bzero(c, sizeof(*c));
+}
+
+lru_entry *
+lru_find(lru *c, UInt32 hash, UInt32 tag, buffer *key)
+{
+    lru_entry *e;
+    UInt16 i;
+
+    for (i = c->bucket[hash & (LRU_BUCKETS - 1)]; i; i = e->chain)
+    {
+        e = LRU_E(c, i);
+        if (e->hash == hash  &&  e->tag == tag  &&  e->key_len == key->len  &&
+            !memcmp(e->data, key->buf, key->len))
+        {
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+void
+lru_unlink(lru *c, UInt16 i)
+{
+    lru_entry *e;
+
+    e = LRU_E(c, i);
+
+    if (e->prev)
+    {
+        LRU_E(c, e->prev)->next = e->next;
+    } else
+    {
+        c->head = e->next;
+    }
+
+    if (e->next)
+    {
+        LRU_E(c, e->next)->prev = e->prev;
+    } else
+    {
+        c->tail = e->prev;
+    }
+
+    e->prev = e->next = 0;
+}
+
+void
+lru_push(lru *c, UInt16 i)
+{
+    lru_entry *e;
+
+    e = LRU_E(c, i);
+    e->prev = 0;
+    e->next = c->head;
+
+    if (c->head) LRU_E(c, c->head)->prev = i;
+    c->head = i;
+    if (!c->tail) c->tail = i;
+}
+
+// Drop the least recently used entry and move the last one into its slot so
+// the entries in use stay packed
+void
+lru_evict(lru *c)
+{
+    lru_entry *e;
+    UInt16 i, last, *p;
+
+    i = c->tail;
+    e = LRU_E(c, i);
+
+    lru_unlink(c, i);
+    for (p = &c->bucket[e->hash & (LRU_BUCKETS - 1)]; *p != i; p = &LRU_E(c, *p)->chain);
+    *p = e->chain;
+    free(e->data);
+
+    c->evictions++;
+
+    last = c->nof--;
+    if (i == last) return;
+
+    // whatever points at last points at i from now on
+    *e = *LRU_E(c, last);
+    if (e->prev)
+    {
+        LRU_E(c, e->prev)->next = i;
+    } else
+    {
+        c->head = i;
+    }
+
+    if (e->next)
+    {
+        LRU_E(c, e->next)->prev = i;
+    } else
+    {
+        c->tail = i;
+    }
+    for (p = &c->bucket[e->hash & (LRU_BUCKETS - 1)]; *p != last; p = &LRU_E(c, *p)->chain);
+    *p = i;
+}
+
+// Nibble to upper case hex digit and back, 0xff marks a non hex character.
+// The nibbles are stored inverted so that every character left out reads
+// back as 0xff.
+#define U_HEX_NOT(v) ((UInt8)~(v))
+
+static const UInt8 u_hex_digit[16] = "0123456789ABCDEF";
+
+static const UInt8 u_hex_val[256] = {
+    ['0'] = U_HEX_NOT(0), U_HEX_NOT(1), U_HEX_NOT(2), U_HEX_NOT(3), U_HEX_NOT(4),
+            U_HEX_NOT(5), U_HEX_NOT(6), U_HEX_NOT(7), U_HEX_NOT(8), U_HEX_NOT(9),
+    ['A'] = U_HEX_NOT(10), U_HEX_NOT(11), U_HEX_NOT(12), U_HEX_NOT(13), U_HEX_NOT(14), U_HEX_NOT(15),
+    ['a'] = U_HEX_NOT(10), U_HEX_NOT(11), U_HEX_NOT(12), U_HEX_NOT(13), U_HEX_NOT(14), U_HEX_NOT(15)
+};
+
+static UInt32 u_buf2hex_simd(UInt8 *d, UInt8 *s, UInt32 len);
+static UInt32 u_hex2buf_simd(UInt8 *d, UInt8 *s, UInt32 len);
+
+// Encode buf as upper case hex into hex and NUL terminate it. Returns -1,
+// leaving as much as fits, if hex is too small.
+int 
 u_buf2hex(buffer *buf, buffer *hex)
 {
-    UInt32 n;
+    UInt32 n, len;
     UInt8 *hexb;
+    int ret;
 
-    hexb = hex->buf;
+    if (!hex->max) return -1;
     
-    for (n = 0; n < buf->len; n++)
+    ret = 0;
+    len = buf->len;
+    if (len > (hex->max - 1) / 2)
     {
-        sprintf((char *)hexb, "%02X", (unsigned)buf->buf[n]);
-        hexb += 2;
+        len = (hex->max - 1) / 2;
+        ret = -1;
+    }
+    
+    n = u_buf2hex_simd(hex->buf, buf->buf, len);
+    
+    hexb = hex->buf + 2 * n;
+    for (; n < len; n++)
+    {
+        *hexb++ = u_hex_digit[buf->buf[n] >> 4];
+        *hexb++ = u_hex_digit[buf->buf[n] & 0xf];
     }
     
     *hexb = '\0';
     hex->len = hexb - hex->buf;
+    
+    return ret;
 }
 
-void 
+// Decode hex digit pairs into buf, stopping at a NUL or hex->len. Spaces
+// between pairs are skipped. Returns -1 on a non hex character, a dangling
+// digit, or if buf is too small.
+int 
 u_hex2buf(buffer *hex, buffer *buf)
 {
-    UInt32 n, l;
-    UInt8 *bufb;
+    UInt32 n, l, len, m;
+    UInt8 *s, *e, h, v;
+    
+    s = hex->buf;
+    e = memchr(s, '\0', hex->len);
+    len = e ? (UInt32)(e - s) : hex->len;
     
     n = l = 0;
-    bufb = buf->buf;
     
-    while (hex->buf[n])
+    while (n < len)
     {
-        if (hex->buf[n] == ' ') 
+        if (s[n] == ' ') 
         {
             n++;
             continue;
         }
         
-        *bufb++ = (u_hex2val(hex->buf[n]) << 4) | u_hex2val(hex->buf[n+1]);
-        l++;
+        // whole runs of digits go to the vector kernel, which leaves alone
+        // anything it can't vouch for
+        m = (len - n) / 2;
+        if (m > buf->max - l) m = buf->max - l;
+        m = u_hex2buf_simd(buf->buf + l, s + n, m);
+        n += 2 * m;
+        l += m;
+        if (n >= len  ||  s[n] == ' ') continue;
+        
+        if (n + 1 >= len) return -1;
+        if (l >= buf->max) return -1;
+        
+        h = U_HEX_NOT(u_hex_val[s[n]]);
+        v = U_HEX_NOT(u_hex_val[s[n + 1]]);
+        if ((h | v) & 0xf0) return -1;
+        
+        buf->buf[l++] = (h << 4) | v;
         n += 2;
     }
     
     buf->len = l;
+    
+    return 0;
 }
 
 UInt8 
 u_hex2val(UInt8 hex)
 {
-    if (hex >= '0'  &&  hex <= '9')
+    return (u_hex_val[hex] ? U_HEX_NOT(u_hex_val[hex]) : 0);
+}
+
+// FNV-1a style, but a 32 bit word per multiply rather than a byte since
+// keys (whole commands) run to hundreds of bytes
+UInt32
+u_hash(UInt8 *d, UInt32 len, UInt32 seed)
+{
+    UInt32 h, w, i;
+
+    h = 2166136261u ^ seed;
+    for (i = 0; i + 4 <= len; i += 4)
     {
-        return hex - '0';
-    } else if (hex >= 'A'  &&  hex <= 'F')
+        memcpy(&w, d + i, sizeof(w));
+        h = (h ^ w) * 16777619u;
+        h ^= h >> 15;
+    }
+    for (; i < len; i++)
     {
-        return hex - 'A' + 10;
-    } else if (hex >= 'a'  &&  hex <= 'f')
+        h = (h ^ d[i]) * 16777619u;
+    }
+
+    return h ^ len;
+}
+
+#ifdef __APPLE__
+// Looked up once for every thread
+static pthread_once_t u_timebase_once = PTHREAD_ONCE_INIT;
+static mach_timebase_info_data_t u_timebase;
+
+static void
+u_timebase_init(void)
+{
+    mach_timebase_info(&u_timebase);
+}
+#endif
+
+// Monotonic ns
+UInt64
+u_now(void)
+{
+#ifdef __APPLE__
+    pthread_once(&u_timebase_once, u_timebase_init);
+
+    return mach_absolute_time() * u_timebase.numer / u_timebase.denom;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (UInt64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+void
+hist_add(hist *h, UInt64 v)
+{
+    h->count++;
+    h->sum += v;
+    if (v > h->max) h->max = v;
+    h->b[hist_index(v)]++;
+}
+
+// The value permille of the samples are at or below, to within a bucket
+UInt64
+hist_quantile(hist *h, UInt32 permille)
+{
+    UInt64 want, seen, v;
+    UInt32 i;
+
+    if (!h->count) return 0;
+
+    want = ((UInt64)h->count * permille + 999) / 1000;
+    if (!want) want = 1;
+
+    for (i = 0, seen = 0; i < HIST_BUCKETS; i++)
     {
-        return hex - 'a' + 10;
-    } else
+        seen += h->b[i];
+        if (seen >= want) break;
+    }
+
+    // the top of the bucket, but never past what was seen
+    v = (i + 1 < HIST_BUCKETS ? hist_value(i + 1) - 1 : h->max);
+    return v < h->max ? v : h->max;
+}
+
+// Values below 2 * HIST_SUB get a bucket each, above that a power of 2 is
+// split into HIST_SUB buckets by the 3 bits under the top one
+UInt32
+hist_index(UInt64 v)
+{
+    UInt32 e;
+
+    if (v < HIST_SUB) return v;
+
+    e = 63 - __builtin_clzll(v);
+
+    return (e - 2) * HIST_SUB + ((v >> (e - 3)) & (HIST_SUB - 1));
+}
+
+// Smallest value of bucket i
+UInt64
+hist_value(UInt32 i)
+{
+    if (i < HIST_SUB) return i;
+
+    return (UInt64)(HIST_SUB + i % HIST_SUB) << (i / HIST_SUB - 1);
+}
+
+#if defined(__AVX2__)  ||  defined(__SSE2__)
+
+// ASCII for 16 nibbles, '0' + n plus the gap up to 'A' for n > 9
+static inline __m128i
+u_nib2hex_128(__m128i n)
+{
+    __m128i gap;
+    
+    gap = _mm_and_si128(_mm_cmpgt_epi8(n, _mm_set1_epi8(9)), _mm_set1_epi8('A' - '9' - 1));
+    
+    return _mm_add_epi8(_mm_add_epi8(n, _mm_set1_epi8('0')), gap);
+}
+
+// Values of 16 hex characters, or 0 if any of them isn't a hex digit
+static inline int
+u_hex2nib_128(__m128i c, __m128i *v)
+{
+    __m128i lc, dig, alpha;
+    
+    // only letters may be folded to lower case, digits sit in the same
+    // column as a handful of control characters
+    lc = _mm_or_si128(c, _mm_set1_epi8(0x20));
+    dig = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+                        _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+    alpha = _mm_and_si128(_mm_cmpgt_epi8(lc, _mm_set1_epi8('a' - 1)),
+                          _mm_cmplt_epi8(lc, _mm_set1_epi8('f' + 1)));
+    
+    if (_mm_movemask_epi8(_mm_or_si128(dig, alpha)) != 0xffff) return 0;
+    
+    *v = _mm_or_si128(_mm_and_si128(dig, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+                      _mm_and_si128(alpha, _mm_sub_epi8(lc, _mm_set1_epi8('a' - 10))));
+    
+    return 1;
+}
+
+// Fold 8 digit pairs, high nibble first, into 16 bit lanes of byte values
+static inline __m128i
+u_nib2byte_128(__m128i v)
+{
+    return _mm_or_si128(_mm_and_si128(_mm_slli_epi16(v, 4), _mm_set1_epi16(0x00f0)),
+                        _mm_srli_epi16(v, 8));
+}
+
+#endif
+
+// Vector kernels for the hex conversions, they return how many bytes they
+// took care of and leave the rest to the scalar loops
+#if defined(__AVX2__)
+
+UInt32
+u_buf2hex_simd(UInt8 *d, UInt8 *s, UInt32 len)
+{
+    __m256i v, hi, lo, gap, nine, zero, mask;
+    UInt32 n;
+    
+    mask = _mm256_set1_epi8(0x0f);
+    nine = _mm256_set1_epi8(9);
+    zero = _mm256_set1_epi8('0');
+    gap = _mm256_set1_epi8('A' - '9' - 1);
+    
+    for (n = 0; n + 32 <= len; n += 32)
+    {
+        // unpack works within 128 bit lanes, so pre-swap the middle quads
+        v = _mm256_permute4x64_epi64(_mm256_loadu_si256((__m256i *)(s + n)), 0xd8);
+        hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), mask);
+        lo = _mm256_and_si256(v, mask);
+        hi = _mm256_add_epi8(_mm256_add_epi8(hi, zero),
+                             _mm256_and_si256(_mm256_cmpgt_epi8(hi, nine), gap));
+        lo = _mm256_add_epi8(_mm256_add_epi8(lo, zero),
+                             _mm256_and_si256(_mm256_cmpgt_epi8(lo, nine), gap));
+        _mm256_storeu_si256((__m256i *)(d + 2 * n), _mm256_unpacklo_epi8(hi, lo));
+        _mm256_storeu_si256((__m256i *)(d + 2 * n + 32), _mm256_unpackhi_epi8(hi, lo));
+    }
+    
+    return n;
+}
+
+UInt32
+u_hex2buf_simd(UInt8 *d, UInt8 *s, UInt32 len)
+{
+    __m128i a, b, c, e;
+    __m256i v;
+    UInt32 n;
+    
+    for (n = 0; n + 32 <= len; n += 32)
+    {
+        if (!u_hex2nib_128(_mm_loadu_si128((__m128i *)(s + 2 * n)), &a)  ||
+            !u_hex2nib_128(_mm_loadu_si128((__m128i *)(s + 2 * n + 16)), &b)  ||
+            !u_hex2nib_128(_mm_loadu_si128((__m128i *)(s + 2 * n + 32)), &c)  ||
+            !u_hex2nib_128(_mm_loadu_si128((__m128i *)(s + 2 * n + 48)), &e))
+        {
+            break;
+        }
+        
+        // pack works within 128 bit lanes, pairing the blocks up as a:c and
+        // b:e leaves the result in order
+        v = _mm256_packus_epi16(
+                _mm256_inserti128_si256(_mm256_castsi128_si256(u_nib2byte_128(a)), u_nib2byte_128(c), 1),
+                _mm256_inserti128_si256(_mm256_castsi128_si256(u_nib2byte_128(b)), u_nib2byte_128(e), 1));
+        _mm256_storeu_si256((__m256i *)(d + n), v);
+    }
+    
+    return n;
+}
+
+#elif defined(__SSE2__)
+
+UInt32
+u_buf2hex_simd(UInt8 *d, UInt8 *s, UInt32 len)
+{
+    __m128i v, hi, lo, mask;
+    UInt32 n;
+    
+    mask = _mm_set1_epi8(0x0f);
+    
+    for (n = 0; n + 16 <= len; n += 16)
     {
-        return 0;
+        v = _mm_loadu_si128((__m128i *)(s + n));
+        hi = u_nib2hex_128(_mm_and_si128(_mm_srli_epi16(v, 4), mask));
+        lo = u_nib2hex_128(_mm_and_si128(v, mask));
+        _mm_storeu_si128((__m128i *)(d + 2 * n), _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i *)(d + 2 * n + 16), _mm_unpackhi_epi8(hi, lo));
     }
+    
+    return n;
+}
+
+UInt32
+u_hex2buf_simd(UInt8 *d, UInt8 *s, UInt32 len)
+{
+    __m128i a, b;
+    UInt32 n;
+    
+    for (n = 0; n + 16 <= len; n += 16)
+    {
+        if (!u_hex2nib_128(_mm_loadu_si128((__m128i *)(s + 2 * n)), &a)  ||
+            !u_hex2nib_128(_mm_loadu_si128((__m128i *)(s + 2 * n + 16)), &b))
+        {
+            break;
+        }
+        
+        _mm_storeu_si128((__m128i *)(d + n), _mm_packus_epi16(u_nib2byte_128(a), u_nib2byte_128(b)));
+    }
+    
+    return n;
+}
+
+#else
+
+UInt32
+u_buf2hex_simd(UInt8 *d, UInt8 *s, UInt32 len)
+{
+    return 0;
 }
+
+UInt32
+u_hex2buf_simd(UInt8 *d, UInt8 *s, UInt32 len)
+{
+    return 0;
+}
+
+#endif
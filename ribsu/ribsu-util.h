@@ -9,6 +9,8 @@
 #ifndef __RIBSU_UTIL_H
 #define __RIBSU_UTIL_H
 
+#include "reactor.h"
+
 typedef struct buffer {
     UInt32 max;
     UInt32 len;
@@ -16,7 +18,102 @@ typedef struct buffer {
     UInt8  lcl[0];
 } buffer;
 
-int add_fd_source(int fd, FILE **cfp, CFSocketCallBack callback, void *callback_arg);
+// Byte ring with free running indices, readable across the wrap without
+// compaction. Starts out on caller supplied storage and moves to the heap
+// if it has to grow.
+typedef struct ring
+{
+    UInt32 size;  // always a power of 2
+    UInt32 head;  // read index
+    UInt32 tail;  // write index
+    UInt32 limit; // never grow past this
+    UInt8  *buf;
+    UInt8  *lcl;  // caller supplied storage, not ours to free
+} ring;
+
+#define RING_LEN(r)   ((r)->tail - (r)->head)
+#define RING_AT(r, i) ((r)->buf[((r)->head + (i)) & ((r)->size - 1)])
+
+// Pulse and space durations of a frame, stored as pulse/space pairs in one
+// heap arena. Entries are 16 bit until a duration doesn't fit and the arena
+// is widened to 32 bit. The arena grows on demand, is kept across frames by
+// ps_reset() and only released by ps_free(). A zeroed pstore is empty.
+#define PS_MIN   (64)   // pairs allocated on first use
+#define PS_LIMIT (4096) // pairs, far beyond any remote
+
+typedef struct pstore
+{
+    UInt32 nof_pulses;
+    UInt32 nof_spaces;
+    UInt32 max;  // pairs the arena holds
+    int    wide; // entries are UInt32 rather than UInt16
+    void   *arena;
+} pstore;
+
+// Least recently used cache of byte strings, keyed by a byte string plus a
+// 32 bit tag. Both key and value are copied to the heap. Entries are linked
+// by 1 based index, so a zeroed lru is empty.
+#define LRU_MAX     (256) // entries, the oldest goes when a new one won't fit
+#define LRU_BUCKETS (512) // power of 2
+
+typedef struct lru_entry
+{
+    UInt32 hash;
+    UInt32 tag;
+    UInt32 key_len;
+    UInt32 val_len;
+    UInt16 prev, next; // recency, most recent first
+    UInt16 chain;      // next in the hash bucket
+    UInt8  *data;      // key followed by value
+} lru_entry;
+
+typedef struct lru
+{
+    UInt32 nof;
+    UInt16 head, tail;
+    UInt32 hits, misses, evictions;
+    UInt16 bucket[LRU_BUCKETS];
+    lru_entry e[LRU_MAX];
+} lru;
+
+// Log-linear histogram, HDR style: 8 buckets for every power of 2, so a
+// value is known to within 1/8 however large it is. A zeroed hist is empty.
+#define HIST_SUB     (8)
+#define HIST_BUCKETS (62 * HIST_SUB) // enough for any UInt64
+
+typedef struct hist
+{
+    UInt32 count;
+    UInt64 sum;
+    UInt64 max;
+    UInt32 b[HIST_BUCKETS];
+} hist;
+
+// Allocation failures of the whole process, bumped from any thread
+extern volatile UInt32 u_alloc_failures;
+
+#ifdef __APPLE__
+#include <libkern/OSAtomic.h>
+#define U_ATOMIC_INC(p)       OSAtomicIncrement32Barrier((volatile int32_t *)(p))
+#define U_ATOMIC_DEC(p)       OSAtomicDecrement32Barrier((volatile int32_t *)(p))
+#define U_ATOMIC_CAS(p, o, n) OSAtomicCompareAndSwap32Barrier((o), (n), (volatile int32_t *)(p))
+#define U_BARRIER()           OSMemoryBarrier()
+#else
+#define U_ATOMIC_INC(p)       __sync_fetch_and_add((p), 1)
+#define U_ATOMIC_DEC(p)       __sync_fetch_and_sub((p), 1)
+#define U_ATOMIC_CAS(p, o, n) __sync_bool_compare_and_swap((p), (o), (n))
+#define U_BARRIER()           __sync_synchronize()
+#endif
+
+#define U_NOMEM() do { \
+    U_ATOMIC_INC(&u_alloc_failures); \
+    ERR("No memory\n"); \
+} while (0)
+
+#define PS_PULSE(ps, i) ps_get((ps), 2 * (i))
+#define PS_SPACE(ps, i) ps_get((ps), 2 * (i) + 1)
+
+int add_fd_source(int fd, FILE **cfp, reactor_fd_fn callback, void *callback_arg);
 
 buffer *buf_alloc(UInt32 max);
 buffer *buf_init(buffer *buf, UInt32 max);
@@ -26,9 +123,76 @@ buffer *buf_append(buffer *dst, buffer *src);
 buffer *buf_slide(buffer *buf, UInt32 len);
 void    buf_free(buffer *buf);
 
-void  u_buf2hex(buffer *buf, buffer *hex);
-void  u_hex2buf(buffer *hex, buffer *buf);
+ring   *ring_attach(ring *r, UInt32 size, UInt8 *buf, UInt32 limit);
+int     ring_append(ring *r, buffer *src);
+UInt32  ring_peek(ring *r, UInt32 off, UInt8 *d, UInt32 len);
+UInt32  ring_read(ring *r, UInt8 *d, UInt32 len);
+UInt8  *ring_contig(ring *r, UInt32 off, UInt32 *len);
+void    ring_consume(ring *r, UInt32 len);
+void    ring_reset(ring *r);
+void    ring_free(ring *r);
+
+buffer *lru_get(lru *c, UInt32 tag, buffer *key, buffer *val);
+int     lru_put(lru *c, UInt32 tag, buffer *key, buffer *val);
+void    lru_free(lru *c);
+
+int     ps_grow(pstore *ps, UInt32 v);
+void    ps_reset(pstore *ps);
+void    ps_free(pstore *ps);
+
+static inline UInt32
+ps_get(pstore *ps, UInt32 i)
+{
+    return ps->wide ? ((UInt32 *)ps->arena)[i] : ((UInt16 *)ps->arena)[i];
+}
+
+static inline void
+ps_set(pstore *ps, UInt32 i, UInt32 v)
+{
+    if (ps->wide)
+    {
+        ((UInt32 *)ps->arena)[i] = v;
+    } else
+    {
+        ((UInt16 *)ps->arena)[i] = v;
+    }
+}
+
+// Record a pulse or space, returns -1 (and drops it) once PS_LIMIT is hit
+static inline int
+ps_add_pulse(pstore *ps, UInt32 v)
+{
+    if (ps->nof_pulses >= ps->max  ||  (v > 0xffff  &&  !ps->wide))
+    {
+        if (ps_grow(ps, v)) return -1;
+    }
+    
+    ps_set(ps, 2 * ps->nof_pulses++, v);
+    
+    return 0;
+}
+
+static inline int
+ps_add_space(pstore *ps, UInt32 v)
+{
+    if (ps->nof_spaces >= ps->max  ||  (v > 0xffff  &&  !ps->wide))
+    {
+        if (ps_grow(ps, v)) return -1;
+    }
+    
+    ps_set(ps, 2 * ps->nof_spaces++ + 1, v);
+    
+    return 0;
+}
+
+int   u_buf2hex(buffer *buf, buffer *hex);
+int   u_hex2buf(buffer *hex, buffer *buf);
 UInt8 u_hex2val(UInt8 hex);
+UInt32 u_hash(UInt8 *d, UInt32 len, UInt32 seed);
+UInt64 u_now(void);
+
+void   hist_add(hist *h, UInt64 v);
+UInt64 hist_quantile(hist *h, UInt32 permille);
 
 #endif
 
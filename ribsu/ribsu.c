@@ -6,10 +6,11 @@
  */
 
 
-#include <CoreFoundation/CoreFoundation.h>
+#include "platform.h"
 
 #include "debug.h"
 #include "ribsu-util.h"
+#include "capture.h"
 #include "tty.h"
 #include "uirt.h"
 #include "uirt-sm.h"
@@ -19,12 +20,31 @@
 #define MODULE_NAME ribsu
 DBG_MODULE_DEFINE();
 
+// hi.learning
+enum {
+    RIBSU_HI_IDLE,
+    RIBSU_HI_LEARNING,
+    RIBSU_HI_LEARNED, // hi.state is waiting to be picked up by ribsu_learn()
+};
+
 static void ribsu_callback(void *ctx0, buffer *buf);
+static int  ribsu_learn_frame(ribsu_ctx *ctx, buffer *buf);
+static int  ribsu_learn_match(buffer *row, buffer *buf);
+static void ribsu_replies(ribsu_ctx *ctx, buffer *out);
+static int  ribsu_drv_write(ribsu_ctx *ctx, buffer *buf);
+static int  ribsu_dispatch(ribsu_ctx *ctx);
+static void ribsu_cmd_done(ribsu_ctx *ctx, int status);
+static void ribsu_next(ribsu_ctx *ctx);
+static void ribsu_retry(ribsu_ctx *ctx);
+static void ribsu_deadline(void *arg);
+static void ribsu_lock(ribsu_ctx *ctx);
+static void ribsu_unlock(ribsu_ctx *ctx);
 
 int
 ribsu_init(ribsu_ctx *ctx, ribsu_opts *opts)
 {
     ribsu_opts o;
+    pthread_mutexattr_t attr;
     buffer tty_dev;
     UInt8 tty_dev_buf[RIBSU_TTY_MAX_NAME];
     
@@ -33,6 +53,7 @@ ribsu_init(ribsu_ctx *ctx, ribsu_opts *opts)
     bzero(ctx, sizeof(*ctx));
  
     ctx->interp = 1;
+    buf_attach(&ctx->out, sizeof(ctx->out_buf), ctx->out_buf);
     
     // if no options given, use defaults
     if (!opts)
@@ -73,6 +94,7 @@ ribsu_init(ribsu_ctx *ctx, ribsu_opts *opts)
         {
             ctx->drv_write = usb_write;
             ctx->drv_shutdown = usb_shutdown;
+            ctx->stats.driver = "usb";
             usb_set_callback(ctx->drv, ribsu_callback, ctx);
         } else
         {
@@ -100,6 +122,7 @@ ribsu_init(ribsu_ctx *ctx, ribsu_opts *opts)
         {
             ctx->drv_write = tty_write;
             ctx->drv_shutdown = tty_shutdown;
+            ctx->stats.driver = "tty";
             tty_set_callback(ctx->drv, ribsu_callback, ctx);
         } else
         {
@@ -114,6 +137,17 @@ ribsu_init(ribsu_ctx *ctx, ribsu_opts *opts)
     }
    
     usm_init(&ctx->usm);
+    reactor_timer_init(&ctx->deadline, ribsu_deadline, ctx);
+    
+    if (o.locking)
+    {
+        // callbacks send and query under it
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init(&ctx->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+        ctx->locking = 1;
+    }
     
     DBG("Init done\n");
     
@@ -123,16 +157,63 @@ ribsu_init(ribsu_ctx *ctx, ribsu_opts *opts)
 int 
 ribsu_deinit(ribsu_ctx *ctx)
 {
+    ribsu_lock(ctx);
+    
     ctx->drv_shutdown(ctx->drv);
     
+    reactor_timer_deinit(&ctx->deadline);
+    
+    cap_close(ctx->cap);
+    ctx->cap = NULL;
+    
+    usm_deinit(&ctx->usm);
+    
+    ribsu_unlock(ctx);
+    
+    if (ctx->locking)
+    {
+        pthread_mutex_destroy(&ctx->lock);
+        ctx->locking = 0;
+    }
+    
     return 0;
 }
 
+int
+ribsu_capture(ribsu_ctx *ctx, const char *path)
+{
+    int error;
+    
+    ribsu_lock(ctx);
+    
+    cap_close(ctx->cap);
+    ctx->cap = NULL;
+    
+    error = (path ? cap_open(&ctx->cap, path) : 0);
+    
+    ribsu_unlock(ctx);
+    
+    return error;
+}
+
 int 
 ribsu_set_callback(ribsu_ctx *ctx, ribsu_callback_fn fn, void *fn_arg)
 {
+    ribsu_lock(ctx);
     ctx->callback_fn = fn;
     ctx->callback_arg = fn_arg;
+    ribsu_unlock(ctx);
+    
+    return 0;
+}
+
+int
+ribsu_set_frame_callback(ribsu_ctx *ctx, ribsu_frame_fn fn, void *fn_arg)
+{
+    ribsu_lock(ctx);
+    ctx->frame_fn = fn;
+    ctx->frame_arg = fn_arg;
+    ribsu_unlock(ctx);
     
     return 0;
 }
@@ -140,38 +221,113 @@ ribsu_set_callback(ribsu_ctx *ctx, ribsu_callback_fn fn, void *fn_arg)
 int 
 ribsu_write(ribsu_ctx *ctx, buffer *buf)
 {
-    buffer *out;
+    return ribsu_send_async(ctx, buf, NULL, NULL);
+}
+
+int
+ribsu_send_async(ribsu_ctx *ctx, buffer *buf, ribsu_done_fn fn, void *fn_arg)
+{
+    ribsu_cmd *cmd;
+    buffer out;
     int error;
     
-    if (ctx->interp)
+    ribsu_lock(ctx);
+    
+    if (!ctx->interp)
     {
-        out = buf_alloc(512);
-        if (!out)
+        if (fn)
         {
-            ERR("Failed to allocate buffer\n");
-            return -1;
+            ERR("Can't tell when a command is done without interpretation\n");
+            error = -1;
+            goto out;
         }
         
-        usm_process_user(&ctx->usm, buf, out);
-    } else
+        error = ribsu_drv_write(ctx, buf);
+        goto out;
+    }
+    
+    // every interpreted command is queued, the status of one sent with
+    // ribsu_write() still has to be told apart
+    if (ctx->queue_len == RIBSU_QUEUE_MAX)
     {
-        out = buf;
+        DBG("Queue full, %uus of transmitting ahead\n", (unsigned)ctx->queue_airtime);
+        ctx->stats.queue_full++;
+        error = -1;
+        goto out;
     }
     
-    error = ctx->drv_write(ctx->drv, out);
+    cmd = &ctx->queue[(ctx->queue_head + ctx->queue_len) % RIBSU_QUEUE_MAX];
+    buf_attach(&out, sizeof(cmd->data), cmd->data);
     
-    if (ctx->interp)
+    usm_encode_user(&ctx->usm, buf, &out);
+    if (!out.len)
     {
-        buf_free(out);
+        error = -1;
+        goto out;
     }
     
+    cmd->op = buf->buf[0];
+    cmd->t_sent = 0;
+    cmd->airtime = usm_airtime(out.buf, out.len);
+    cmd->tries = 0;
+    cmd->fn = fn;
+    cmd->fn_arg = fn_arg;
+    cmd->len = out.len;
+    
+    ctx->queue_len++;
+    ctx->queue_airtime += cmd->airtime;
+    if (ctx->queue_len > ctx->stats.queue_max)
+    {
+        ctx->stats.queue_max = ctx->queue_len;
+    }
+    
+    error = 0;
+    if (ctx->queue_len > 1) goto out;
+    
+    // the device is idle, a failure is the caller's to hear about
+    error = ribsu_dispatch(ctx);
+    if (error)
+    {
+        cmd->fn = NULL;
+        ribsu_cmd_done(ctx, RIBSU_STATUS_WRITE_ERROR);
+    }
+    
+out:
+    ribsu_unlock(ctx);
+    
     return error;
 }
 
+UInt32
+ribsu_queue_space(ribsu_ctx *ctx)
+{
+    UInt32 n;
+    
+    ribsu_lock(ctx);
+    n = RIBSU_QUEUE_MAX - ctx->queue_len;
+    ribsu_unlock(ctx);
+    
+    return n;
+}
+
+UInt32
+ribsu_queue_airtime(ribsu_ctx *ctx)
+{
+    UInt32 usec;
+    
+    ribsu_lock(ctx);
+    usec = ctx->queue_airtime;
+    ribsu_unlock(ctx);
+    
+    return usec;
+}
+
 int 
 ribsu_set_default_frequency(ribsu_ctx *ctx, UInt32 frequency)
 {
+    ribsu_lock(ctx);
     usm_set_default_frequency(&ctx->usm, frequency);
+    ribsu_unlock(ctx);
     
     return 0;
 }
@@ -181,54 +337,463 @@ ribsu_toggle_interpretation(ribsu_ctx *ctx, UInt32 interp)
 {
     UInt32 old;
     
+    ribsu_lock(ctx);
     old = ctx->interp;
     ctx->interp = (interp && 1);
+    ribsu_unlock(ctx);
     
     return old;
 }
 
+void
+ribsu_get_stats(ribsu_ctx *ctx, ribsu_stats *stats)
+{
+    ribsu_lock(ctx);
+    *stats = ctx->stats;
+    usm_get_stats(&ctx->usm, &stats->usm);
+    ribsu_unlock(ctx);
+    
+    stats->alloc_failures = u_alloc_failures;
+}
+
+int
+ribsu_learn(ribsu_ctx *ctx)
+{
+    ribsu_learn_ctx *lrn;
+    UInt32 i;
+    int state;
+    
+    ribsu_lock(ctx);
+    
+    switch (ctx->hi.learning)
+    {
+        case RIBSU_HI_LEARNING:
+            state = RIBSU_LEARN_CONTINUE;
+            goto out;
+        case RIBSU_HI_LEARNED:
+            ctx->hi.learning = RIBSU_HI_IDLE;
+            state = ctx->hi.state;
+            goto out;
+        default:
+            break;
+    }
+    
+    lrn = &ctx->hi.lrn;
+    
+    lrn->nof_seq = 0;
+    lrn->best = 0;
+    for (i = 0; i < RIBSU_LEARN_TABLE_SIZE; i++)
+    {
+        lrn->count[i] = 0;
+        buf_attach(&lrn->table[i], RIBSU_LEARN_ROW_SIZE, lrn->table_buf[i]);
+    }
+    
+    ctx->hi.state = RIBSU_LEARN_CONTINUE;
+    ctx->hi.learning = RIBSU_HI_LEARNING;
+    
+    DBG("Learning\n");
+    
+    state = RIBSU_LEARN_CONTINUE;
+    
+out:
+    ribsu_unlock(ctx);
+    
+    return state;
+}
+
+int
+ribsu_parrot(ribsu_ctx *ctx, buffer *cmd)
+{
+    ribsu_learn_ctx *lrn;
+    int error;
+    
+    ribsu_lock(ctx);
+    
+    lrn = &ctx->hi.lrn;
+    
+    if (ctx->hi.learning == RIBSU_HI_LEARNING  ||  lrn->count[lrn->best] < RIBSU_LEARN_SAMPLES)
+    {
+        ERR("Nothing learned to parrot\n");
+        error = -1;
+        goto out;
+    }
+    
+    // the learned code is Pronto and needs interpreting
+    if (!ctx->interp)
+    {
+        ERR("Can't parrot without interpretation\n");
+        error = -1;
+        goto out;
+    }
+    
+    if (cmd  &&  !buf_copy(&lrn->table[lrn->best], cmd))
+    {
+        ERR("Learned code doesn't fit, need %u\n", (unsigned)lrn->table[lrn->best].len);
+        error = -1;
+        goto out;
+    }
+    
+    // resending the same Pronto is a transmit cache hit from the second time on
+    error = ribsu_write(ctx, &lrn->table[lrn->best]);
+    
+out:
+    ribsu_unlock(ctx);
+    
+    return error;
+}
+
 void 
 ribsu_callback(void *ctx0, buffer *buf)
 {
     ribsu_ctx *ctx;
     buffer *out;
+    usm_frame *f;
     
     ctx = ctx0;
     
     DMP("Got callback\n");
     
-    if (!ctx->callback_fn) return;
+    ribsu_lock(ctx);
+    
+    ctx->stats.reads++;
+    ctx->stats.bytes_in += buf->len;
+    
+    if (ctx->cap)
+    {
+        // as read, before the state machine gets to it
+        cap_record(ctx->cap, ctx->usm.mode, ctx->usm.state, buf);
+    }
+    
+    // nobody to hand the frames to, unless ribsu_learn() is waiting on them
+    if (!ctx->callback_fn  &&  !ctx->frame_fn  &&  !ctx->queue_len  &&
+        ctx->hi.learning != RIBSU_HI_LEARNING)
+    {
+        goto out;
+    }
     
     if (ctx->interp)
     {
-        out = buf_alloc(512);
-        if (!out)
-        {
-            ERR("Failed to allocate buffer\n");
-            return;
-        }
+        out = &ctx->out;
         
         usm_process_uirt(&ctx->usm, buf, out);
         do {
             if (out->len)
             {
+                if (ctx->hi.learning == RIBSU_HI_LEARNING)
+                {
+                    ctx->hi.state = ribsu_learn_frame(ctx, out);
+                    if (ctx->hi.state != RIBSU_LEARN_CONTINUE)
+                    {
+                        ctx->hi.learning = RIBSU_HI_LEARNED;
+                    }
+                }
+                
+                if (usm_last_replies(&ctx->usm))
+                {
+                    ribsu_replies(ctx, out);
+                }
+                
+                f = usm_last_frame(&ctx->usm);
+                if (f  &&  ctx->frame_fn)
+                {
+                    ctx->frame_fn(ctx->frame_arg, f);
+                }
+                
                 DMP("Propagating callback\n");
-                ctx->callback_fn(ctx->callback_arg, out);
+                if (ctx->callback_fn) ctx->callback_fn(ctx->callback_arg, out);
             }
             usm_process_uirt_more(&ctx->usm, out);
         } while (out->len);
-
-        buf_free(out);   
     } else
     {
         out = buf;
     
-        if (out->len)
+        if (out->len  &&  ctx->callback_fn)
         {
             DBG("Propagating callback\n");
             ctx->callback_fn(ctx->callback_arg, out);
         }
     
     }
+    
+out:
+    ribsu_unlock(ctx);
 }
 
+// Complete the command the device has with what it answered in out, then
+// give it the next
+void
+ribsu_replies(ribsu_ctx *ctx, buffer *out)
+{
+    ribsu_cmd *cmd;
+    UInt32 n, i;
+    int status;
+    
+    n = usm_last_replies(&ctx->usm);
+    for (i = 0; n  &&  ctx->queue_len; n--)
+    {
+        cmd = &ctx->queue[ctx->queue_head];
+        if (!cmd->t_sent) break;
+        
+        if (cmd->op == UIRT_CMD_GET_VERSION)
+        {
+            status = UIRT_STATUS_OK;
+        } else
+        {
+            for (; i < out->len  &&  out->buf[i] == UIRT_STATUS_TXING; i++);
+            status = (i < out->len ? out->buf[i++] : UIRT_STATUS_CMD_ERROR);
+        }
+        
+        // garbled on the way in, it wasn't acted on and can go again
+        if (status == UIRT_STATUS_CSUM_ERROR  &&  cmd->tries < RIBSU_RETRY_MAX)
+        {
+            ribsu_retry(ctx);
+            continue;
+        }
+        
+        DBG("Command %02X done with %02X\n", (unsigned)cmd->op, (unsigned)status);
+        ribsu_cmd_done(ctx, status);
+    }
+    
+    ribsu_next(ctx);
+}
+
+// Write the next command unless the device has one or is being given a rest
+void
+ribsu_next(ribsu_ctx *ctx)
+{
+    // the next was staged while the last was on the air
+    while (ctx->queue_len  &&  !ctx->queue[ctx->queue_head].t_sent  &&  !ctx->backoff)
+    {
+        if (!ribsu_dispatch(ctx)) break;
+        ribsu_cmd_done(ctx, RIBSU_STATUS_WRITE_ERROR);
+    }
+}
+
+// Send the oldest again after a backoff, RIBSU_BACKOFF_USEC doubled for
+// every resend so far
+void
+ribsu_retry(ribsu_ctx *ctx)
+{
+    ribsu_cmd *cmd;
+    UInt32 usec;
+    
+    cmd = &ctx->queue[ctx->queue_head];
+    
+    usec = RIBSU_BACKOFF_USEC << cmd->tries;
+    if (usec > RIBSU_BACKOFF_MAX) usec = RIBSU_BACKOFF_MAX;
+    
+    DBG("Resending %02X in %uus\n", (unsigned)cmd->op, (unsigned)usec);
+    
+    cmd->tries++;
+    cmd->t_sent = 0;
+    ctx->stats.retries++;
+    
+    ctx->backoff = 1;
+    reactor_timer_arm(&ctx->deadline, usec);
+}
+
+// The oldest wasn't answered in time, or its backoff is over
+void
+ribsu_deadline(void *arg)
+{
+    ribsu_ctx *ctx;
+    ribsu_cmd *cmd;
+    
+    ctx = arg;
+    
+    ribsu_lock(ctx);
+    
+    if (ctx->backoff)
+    {
+        ctx->backoff = 0;
+        ribsu_next(ctx);
+        goto out;
+    }
+    
+    if (!ctx->queue_len) goto out;
+    cmd = &ctx->queue[ctx->queue_head];
+    
+    LOG("No answer to %02X after %uus\n", (unsigned)cmd->op, (unsigned)(RIBSU_ANSWER_USEC + cmd->airtime));
+    ctx->stats.timeouts++;
+    
+    // stop waiting, or whatever the device sends next is taken for the answer
+    usm_command_lost(&ctx->usm);
+    
+    if (cmd->tries < RIBSU_RETRY_MAX)
+    {
+        ribsu_retry(ctx);
+        goto out;
+    }
+    
+    ctx->stats.given_up++;
+    ribsu_cmd_done(ctx, RIBSU_STATUS_NO_ANSWER);
+    ribsu_next(ctx);
+    
+out:
+    ribsu_unlock(ctx);
+}
+
+int
+ribsu_drv_write(ribsu_ctx *ctx, buffer *buf)
+{
+    int error;
+    
+    error = ctx->drv_write(ctx->drv, buf);
+    if (error)
+    {
+        ctx->stats.write_errors++;
+    } else
+    {
+        ctx->stats.writes++;
+        ctx->stats.bytes_out += buf->len;
+    }
+    
+    return error;
+}
+
+// Write the oldest queued command
+int
+ribsu_dispatch(ribsu_ctx *ctx)
+{
+    ribsu_cmd *cmd;
+    buffer out;
+    
+    cmd = &ctx->queue[ctx->queue_head];
+    buf_attach(&out, sizeof(cmd->data), cmd->data);
+    out.len = cmd->len;
+    
+    usm_command_sent(&ctx->usm, cmd->op);
+    if (ribsu_drv_write(ctx, &out))
+    {
+        usm_command_lost(&ctx->usm);
+        return -1;
+    }
+    cmd->t_sent = u_now();
+    reactor_timer_arm(&ctx->deadline, RIBSU_ANSWER_USEC + cmd->airtime);
+    
+    return 0;
+}
+
+// Take the oldest command off the queue and tell whoever sent it
+void
+ribsu_cmd_done(ribsu_ctx *ctx, int status)
+{
+    ribsu_cmd *cmd;
+    ribsu_done_fn fn;
+    void *fn_arg;
+    UInt64 latency;
+    
+    cmd = &ctx->queue[ctx->queue_head];
+    fn = cmd->fn;
+    fn_arg = cmd->fn_arg;
+    latency = (cmd->t_sent ? u_now() - cmd->t_sent : 0);
+    
+    reactor_timer_cancel(&ctx->deadline);
+    ctx->queue_airtime -= cmd->airtime;
+    ctx->queue_head = (ctx->queue_head + 1) % RIBSU_QUEUE_MAX;
+    ctx->queue_len--;
+    
+    // the slot is free first, fn may well send the next one
+    if (fn) fn(fn_arg, status, latency);
+}
+
+void
+ribsu_lock(ribsu_ctx *ctx)
+{
+    if (ctx->locking) pthread_mutex_lock(&ctx->lock);
+}
+
+void
+ribsu_unlock(ribsu_ctx *ctx)
+{
+    if (ctx->locking) pthread_mutex_unlock(&ctx->lock);
+}
+
+// Average a received code into the row of the sequence it matches, or give
+// it a new row
+int
+ribsu_learn_frame(ribsu_ctx *ctx, buffer *buf)
+{
+    ribsu_learn_ctx *lrn;
+    buffer *row;
+    UInt32 i, w, n, c, *sum;
+    
+    lrn = &ctx->hi.lrn;
+    
+    // Pronto is a header of 4 words and then pulse/space pairs
+    if (buf->len < 8  ||  (buf->len & 1)  ||  buf->len > RIBSU_LEARN_ROW_SIZE)
+    {
+        DBG("%u bytes isn't a learnable code, ignoring\n", (unsigned)buf->len);
+        return RIBSU_LEARN_CONTINUE;
+    }
+    
+    for (i = 0; i < lrn->nof_seq; i++)
+    {
+        if (ribsu_learn_match(&lrn->table[i], buf)) break;
+    }
+    
+    if (i == lrn->nof_seq)
+    {
+        if (lrn->nof_seq == RIBSU_LEARN_TABLE_SIZE)
+        {
+            ERR("More than %d different sequences, giving up\n", RIBSU_LEARN_TABLE_SIZE);
+            return RIBSU_LEARN_ERROR_TOO_MANY_SEQUENCES;
+        }
+        
+        lrn->nof_seq++;
+        lrn->count[i] = 0;
+        bzero(lrn->sum[i], sizeof(lrn->sum[i]));
+    }
+    
+    row = &lrn->table[i];
+    sum = lrn->sum[i];
+    c = ++lrn->count[i];
+    n = buf->len / 2;
+    
+    for (w = 0; w < n; w++)
+    {
+        sum[w] += (UInt32)buf->buf[2 * w] << 8 | buf->buf[2 * w + 1];
+        
+        // rounded average
+        row->buf[2 * w] = ((sum[w] + c / 2) / c) >> 8;
+        row->buf[2 * w + 1] = ((sum[w] + c / 2) / c) & 0xff;
+    }
+    row->len = buf->len;
+    
+    DBG("sequence %u, capture %u\n", (unsigned)i, (unsigned)c);
+    
+    if (c < RIBSU_LEARN_SAMPLES) return RIBSU_LEARN_CONTINUE;
+    
+    lrn->best = i;
+    
+    return RIBSU_LEARN_DONE;
+}
+
+// Same length and header, every duration within a quarter (plus a couple of
+// carrier cycles) of the average so far
+int
+ribsu_learn_match(buffer *row, buffer *buf)
+{
+    UInt32 w, a, b, d;
+    
+    if (row->len != buf->len) return 0;
+    
+    for (w = 0; w < buf->len / 2; w++)
+    {
+        a = (UInt32)row->buf[2 * w] << 8 | row->buf[2 * w + 1];
+        b = (UInt32)buf->buf[2 * w] << 8 | buf->buf[2 * w + 1];
+        
+        // the format and burst pair counts have to be exact
+        if (w == 0  ||  w == 2  ||  w == 3)
+        {
+            if (a != b) return 0;
+            continue;
+        }
+        
+        d = (a > b ? a - b : b - a);
+        if (d > a / 4 + 2) return 0;
+    }
+    
+    return 1;
+}
@@ -9,20 +9,45 @@
 #ifndef __RIBSU_H
 #define __RIBSU_H
 
+#include <pthread.h>
+
 #include "debug.h"
+#include "reactor.h"
 #include "uirt-sm.h"
 
 DBG_MODULE_OTHER(uirt_raw);
 DBG_MODULE_OTHER(uirt_raw2);
 DBG_MODULE_OTHER(uirt_pronto);
+DBG_MODULE_OTHER(uirt_proto);
+DBG_MODULE_OTHER(uirt_lib);
+DBG_MODULE_OTHER(uirt_pack);
 DBG_MODULE_OTHER(uirt_sm);
 DBG_MODULE_OTHER(usb);
 DBG_MODULE_OTHER(tty);
 DBG_MODULE_OTHER(ribsu);
+DBG_MODULE_OTHER(reactor);
+DBG_MODULE_OTHER(uirt_emu);
+DBG_MODULE_OTHER(capture);
+DBG_MODULE_OTHER(ribsu_mgr);
 
 #define RIBSU_TTY_MAX_NAME 64
+#define RIBSU_OUT_MAX      4096 // decoded output per received frame
+#define RIBSU_QUEUE_MAX    8    // commands for the device, the one it has included
+#define RIBSU_CMD_MAX      512  // a command as it goes to the device
+
+#define RIBSU_ANSWER_USEC  50000  // the device answers within this of the airtime
+#define RIBSU_RETRY_MAX    3      // resends of a command not answered or garbled
+#define RIBSU_BACKOFF_USEC 10000  // wait before the first resend, doubled for each
+#define RIBSU_BACKOFF_MAX  160000
+
+#define RIBSU_STATUS_WRITE_ERROR (-1) // the command never made it to the device
+#define RIBSU_STATUS_NO_ANSWER   (-2) // nor was it answered after all the resends
 
 typedef void (*ribsu_callback_fn)(void *, buffer *);
+typedef void (*ribsu_frame_fn)(void *, usm_frame *);
+// status is the device's UIRT_STATUS_*, UIRT_STATUS_OK for a version
+// reply, or a RIBSU_STATUS_*. latency is from the write to the answer.
+typedef void (*ribsu_done_fn)(void *, int status, UInt64 latency_ns);
 
 typedef struct ribsu_opts
 {
@@ -30,6 +55,7 @@ typedef struct ribsu_opts
     int use_tty;
     UInt16 vid, pid;
     char tty_dev_name[RIBSU_TTY_MAX_NAME];
+    int locking; // any thread may call in, see below
 } ribsu_opts;
 
 #define RIBSU_LEARN_ERROR_TOO_MANY_SEQUENCES (-1)
@@ -39,25 +65,79 @@ typedef struct ribsu_opts
 
 #define RIBSU_LEARN_TABLE_SIZE 5
 #define RIBSU_LEARN_ROW_SIZE   512
+#define RIBSU_LEARN_SAMPLES    3 // captures of a sequence averaged into the learned code
 
+// Every distinct sequence seen while learning (a code and its repeat frame
+// are two) gets a row, captures that match a row within tolerance are
+// averaged into it
 typedef struct ribsu_learn_ctx
 {
     UInt32 nof_seq;
+    UInt32 best; // row of the learned code once done
     UInt32 count[RIBSU_LEARN_TABLE_SIZE];
-    buffer table[RIBSU_LEARN_TABLE_SIZE];
+    buffer table[RIBSU_LEARN_TABLE_SIZE]; // average of the captures in Pronto
     UInt8 table_buf[RIBSU_LEARN_TABLE_SIZE][RIBSU_LEARN_ROW_SIZE];
+    UInt32 sum[RIBSU_LEARN_TABLE_SIZE][RIBSU_LEARN_ROW_SIZE / 2]; // per Pronto word
 } ribsu_learn_ctx;
 
+// A command for the device. The device can't take a command while it is
+// still transmitting the last one, so only the oldest is ever out. The
+// others wait their turn already encoded and are written the moment it's
+// answered.
+typedef struct ribsu_cmd
+{
+    UInt8 op;       // UIRT_CMD_*, or the pseudo ones usm takes
+    UInt64 t_sent;  // u_now() of the write, 0 while it waits
+    UInt32 airtime; // us the device spends transmitting it
+    UInt32 tries;   // resends so far
+    ribsu_done_fn fn;
+    void *fn_arg;
+    UInt32 len;
+    UInt8 data[RIBSU_CMD_MAX];
+} ribsu_cmd;
+
+// The driver side of the counters, usm has the rest
+typedef struct ribsu_stats
+{
+    const char *driver;    // "usb" or "tty"
+    UInt32 reads;          // deliveries from the driver
+    UInt32 bytes_in;
+    UInt32 writes;
+    UInt32 bytes_out;
+    UInt32 write_errors;
+    UInt32 queue_full;     // sends turned away
+    UInt32 queue_max;      // deepest the queue has been
+    UInt32 timeouts;       // commands not answered in time
+    UInt32 retries;        // resends after a timeout or checksum error
+    UInt32 given_up;       // commands failed after RIBSU_RETRY_MAX resends
+    UInt32 alloc_failures; // of the whole process
+    usm_stats usm;
+} ribsu_stats;
+
 typedef struct ribsu_ctx
 {
     // low-level state
     usm_ctx usm;
     ribsu_callback_fn callback_fn;
     void *callback_arg;
+    ribsu_frame_fn frame_fn;
+    void *frame_arg;
     void *drv;
     int  (*drv_write)(void *ctx, buffer *buf);
     void (*drv_shutdown)(void *ctx);
     UInt32 interp : 1;
+    UInt32 locking : 1;
+    pthread_mutex_t lock; // recursive, only with locking
+    buffer out;
+    UInt8 out_buf[RIBSU_OUT_MAX]; // receive path output, reused for every frame
+    void *cap; // recording of the device input, NULL when not recording
+    ribsu_cmd queue[RIBSU_QUEUE_MAX]; // ring, oldest at queue_head
+    UInt32 queue_head;
+    UInt32 queue_len;
+    UInt32 queue_airtime; // us of transmitting in the queue
+    reactor_timer deadline; // for the answer to the oldest, or the backoff
+    int backoff;            // before resending it
+    ribsu_stats stats; // all but the usm part
     
     // high-level state (in a struct in case this is broken out later)
     struct {
@@ -67,16 +147,46 @@ typedef struct ribsu_ctx
     } hi;
 } ribsu_ctx;
 
+/* Threads. Everything a context has is in it, nothing is shared with other
+ * contexts, so different devices can be driven from different threads as
+ * they please. The driver, the deadline and every callback (buffer, frame
+ * and done) run on the reactor thread.
+ *
+ * Without locking a context belongs to the reactor thread, and is only
+ * called from its callbacks or before the reactor runs. With
+ * ribsu_opts.locking every call but ribsu_init() and ribsu_deinit() may come
+ * from any thread, and the context lock is held over its callbacks, which
+ * are free to call back in. ribsu_deinit() is still for the reactor thread,
+ * or after it stops, so that no callback is left halfway through.
+ */
+
 // "low-level" API
 int ribsu_init(ribsu_ctx *ctx, ribsu_opts *opts);
 int ribsu_deinit(ribsu_ctx *ctx);
 int ribsu_set_callback(ribsu_ctx *ctx, ribsu_callback_fn fn, void *fn_arg);
+// Received frames as the decoder has them, called before the buffer callback
+// and only while interpreting
+int ribsu_set_frame_callback(ribsu_ctx *ctx, ribsu_frame_fn fn, void *fn_arg);
 int ribsu_write(ribsu_ctx *ctx, buffer *buf);
+// As ribsu_write(), then fn is called from the read callback once the device
+// answers. Needs interpretation. Up to RIBSU_QUEUE_MAX commands are held and
+// go to the device one at a time, a send past that fails until an earlier
+// one is done. fn may send the next one.
+int ribsu_send_async(ribsu_ctx *ctx, buffer *buf, ribsu_done_fn fn, void *fn_arg);
+// Sends that would be taken now
+UInt32 ribsu_queue_space(ribsu_ctx *ctx);
+// us until the device is through transmitting what is queued, at best
+UInt32 ribsu_queue_airtime(ribsu_ctx *ctx);
 int ribsu_set_default_frequency(ribsu_ctx *ctx, UInt32 frequency);
 UInt32 ribsu_toggle_interpretation(ribsu_ctx *ctx, UInt32 interp);
+void ribsu_get_stats(ribsu_ctx *ctx, ribsu_stats *stats);
+// Record everything the device sends to path (see capture.h), NULL stops
+int ribsu_capture(ribsu_ctx *ctx, const char *path);
 
 // "high-level" API
+// Start learning, then poll for RIBSU_LEARN_DONE or an error as codes come in
 int ribsu_learn(ribsu_ctx *ctx);
+// Transmit the learned code, its Pronto is also copied to cmd if given
 int ribsu_parrot(ribsu_ctx *ctx, buffer *cmd);
 
 #endif
@@ -12,14 +12,27 @@
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <errno.h>
+#include <poll.h>
 #include <paths.h>
-#include <termios.h>
 #include <sysexits.h>
 #include <sys/param.h>
 #include <sys/select.h>
 #include <sys/time.h>
 #include <time.h>
 
+#ifdef __linux__
+
+// termios2 lives in the kernel headers, which can't be mixed with <termios.h>
+#include <dirent.h>
+#include <asm/termbits.h>
+#include <linux/serial.h>
+
+#include "platform.h"
+
+#else
+
+#include <termios.h>
+
 #ifdef __MWERKS__
 #define __CF_USE_FRAMEWORK_INCLUDES__
 #endif
@@ -30,6 +43,8 @@
 #include <IOKit/serial/IOSerialKeys.h>
 #include <IOKit/IOBSD.h>
 
+#endif
+
 #include "debug.h"
 #include "ribsu-util.h"
 #include "tty.h"
@@ -37,28 +52,142 @@
 #define MODULE_NAME tty
 DBG_MODULE_DEFINE();
 
+// Enough for a few ms of input at 312500 baud
+#define TTY_RX_MAX (2048)
+
+#ifdef __linux__
+typedef struct termios2 tty_attrs;
+#else
+typedef struct termios tty_attrs;
+#endif
+
 typedef struct tty_ctx
 {
     int fd;
-    FILE *fp;
+    tty_attrs orig; // as the port was before we opened it, put back on close
     void (*callback_fn)(void *, buffer *);
     void *callback_arg;  
+    buffer rx;
+    UInt8 rx_buf[TTY_RX_MAX]; // read straight into here, no per-read allocation
 } tty_ctx;
 
-// Hold the original termios attributes so we can reset them
-static struct termios gOriginalTTYAttrs;
+// The only rate USB-UIRT talks at
+#define TTY_BAUD (312500)
 
 // Function prototypes
-static void tty_read_callback(CFSocketRef s, 
-                              CFSocketCallBackType callbackType, 
-                              CFDataRef address, 
-                              const void *data, 
-                              void *info);
+static void tty_read_callback(int fd, void *info);
+#ifdef __linux__
+static int tty_usb_id(const char *name, UInt32 *vid, UInt32 *pid);
+static int tty_usb_attr(const char *name, const char *attr, char *val, UInt32 max);
+static int tty_cmp(const void *a, const void *b);
+#else
 static kern_return_t FindModems(io_iterator_t *matchingServices);
 static kern_return_t GetModemPath(io_iterator_t serialPortIterator, buffer *dev_name);
-static int OpenSerialPort(const char *bsdPath);
-static void CloseSerialPort(int fileDescriptor);
+static int GetModemPaths(io_iterator_t serialPortIterator, tty_dev_info *devs, UInt32 max);
+#endif
+static int OpenSerialPort(const char *bsdPath, tty_attrs *orig);
+static void CloseSerialPort(int fileDescriptor, tty_attrs *orig);
+
+
+#ifdef __linux__
+
+#define TTY_UIRT_VID (0x0403)
+#define TTY_UIRT_PID (0xf850)
+
+// Pick the lowest numbered /dev/ttyUSB* that is a USB-UIRT. Nothing else is
+// opened on a guess, a differently branded one has to be named.
+int 
+tty_find_device(buffer *dev_name)
+{
+    DIR *dir;
+    struct dirent *de;
+    unsigned n, best;
+    UInt32 vid, pid;
+    
+    dir = opendir("/dev");
+    if (!dir)
+    {
+        ERR("Failed to open /dev - %s(%d).\n", strerror(errno), errno);
+        return -1;
+    }
+    
+    best = ~0u;
+    
+    while ((de = readdir(dir)))
+    {
+        if (sscanf(de->d_name, "ttyUSB%u", &n) != 1) continue;
+        
+        if (tty_usb_id(de->d_name, &vid, &pid)) continue;
+        
+        DBG("%s is %04X/%04X\n", de->d_name, (unsigned)vid, (unsigned)pid);
+        
+        if (vid == TTY_UIRT_VID  &&  pid == TTY_UIRT_PID  &&  n < best) best = n;
+    }
+    
+    closedir(dir);
+    
+    if (best == ~0u) return -1;
+    
+    dev_name->len = snprintf((char *)dev_name->buf, dev_name->max, "/dev/ttyUSB%u", best);
+    
+    return 0;
+}
+
+// Every /dev/ttyUSB* that is a USB-UIRT, in number order. Returns how many,
+// no more than max.
+int
+tty_find_devices(tty_dev_info *devs, UInt32 max)
+{
+    DIR *dir;
+    struct dirent *de;
+    unsigned n, *num;
+    UInt32 vid, pid, count, i;
+    
+    num = malloc(max * sizeof(*num));
+    if (!num)
+    {
+        U_NOMEM();
+        return 0;
+    }
+    
+    dir = opendir("/dev");
+    if (!dir)
+    {
+        ERR("Failed to open /dev - %s(%d).\n", strerror(errno), errno);
+        free(num);
+        return 0;
+    }
+    
+    count = 0;
+    while ((de = readdir(dir))  &&  count < max)
+    {
+        if (sscanf(de->d_name, "ttyUSB%u", &n) != 1) continue;
+        if (tty_usb_id(de->d_name, &vid, &pid)) continue;
+        if (vid != TTY_UIRT_VID  ||  pid != TTY_UIRT_PID) continue;
+        
+        num[count++] = n;
+    }
+    
+    closedir(dir);
+    
+    qsort(num, count, sizeof(*num), tty_cmp);
+    
+    for (i = 0; i < count; i++)
+    {
+        snprintf(devs[i].name, sizeof(devs[i].name), "/dev/ttyUSB%u", num[i]);
+        if (tty_usb_attr(devs[i].name + 5, "serial", devs[i].serial, sizeof(devs[i].serial)))
+        {
+            devs[i].serial[0] = '\0';
+        }
+        DBG("%s serial %s\n", devs[i].name, devs[i].serial);
+    }
+    
+    free(num);
+    
+    return count;
+}
 
+#else
 
 int 
 tty_find_device(buffer *dev_name)
@@ -84,6 +213,26 @@ tty_find_device(buffer *dev_name)
     return 0;
 }
 
+int
+tty_find_devices(tty_dev_info *devs, UInt32 max)
+{
+    io_iterator_t serialPortIterator;
+    int count;
+    
+    if (FindModems(&serialPortIterator) != KERN_SUCCESS)
+    {
+        return 0;
+    }
+    
+    count = GetModemPaths(serialPortIterator, devs, max);
+    
+    IOObjectRelease(serialPortIterator);
+    
+    return count;
+}
+
+#endif
+
 int 
 tty_add_source(void **ctx0, buffer *dev_name)
 {
@@ -95,12 +244,15 @@ tty_add_source(void **ctx0, buffer *dev_name)
     ctx = malloc(sizeof(*ctx));
     if (!ctx)
     {
-        ERR("No memory\n");
+        U_NOMEM();
         error = -1;
         goto out;
     }
+    bzero(ctx, sizeof(*ctx));
     
-    ctx->fd = OpenSerialPort((char *)dev_name->buf);
+    buf_attach(&ctx->rx, sizeof(ctx->rx_buf), ctx->rx_buf);
+    
+    ctx->fd = OpenSerialPort((char *)dev_name->buf, &ctx->orig);
     if (ctx->fd < 0)
     {
         ERR("Failed to open device %s\n", dev_name->buf);
@@ -108,7 +260,12 @@ tty_add_source(void **ctx0, buffer *dev_name)
         goto out;
     }
     
-    add_fd_source(ctx->fd, &ctx->fp, tty_read_callback, ctx);
+    if (reactor_add_fd(ctx->fd, tty_read_callback, ctx))
+    {
+        CloseSerialPort(ctx->fd, &ctx->orig);
+        error = -1;
+        goto out;
+    }
     
     *ctx0 = ctx;
     
@@ -138,34 +295,44 @@ tty_set_callback(void *ctx0, void (*fn)(void *, buffer *), void *fn_arg)
 }
 
 void 
-tty_read_callback(CFSocketRef s, 
-                  CFSocketCallBackType callbackType, 
-                  CFDataRef address, 
-                  const void *data, 
-                  void *info)
+tty_read_callback(int fd, void *info)
 {
     tty_ctx *ctx;
-    buffer *raw;
     int n;
     
-    raw = buf_alloc(512);
-    
+    (void)fd;
     ctx = info;
     
-    n = fread(raw->buf, 1, raw->max, ctx->fp);
-    if (n < 1)
+    ctx->rx.len = 0;
+    
+    // One read per wakeup, unless it filled the buffer and there may be more
+    for (;;)
     {
-        ERR("Failed to read from device\n");
-        return;
+        n = read(ctx->fd, &ctx->rx.buf[ctx->rx.len], ctx->rx.max - ctx->rx.len);
+        if (n < 0  &&  errno == EINTR) continue;
+        if (n <= 0) break;
+        
+        ctx->rx.len += n;
+        if (ctx->rx.len < ctx->rx.max) break;
+        
+        if (ctx->callback_fn)
+        {
+            ctx->callback_fn(ctx->callback_arg, &ctx->rx);
+        }
+        ctx->rx.len = 0;
     }
-    raw->len = n;
     
-    if (ctx->callback_fn)
+    if (n == 0  ||  (n < 0  &&  errno != EAGAIN))
     {
-        ctx->callback_fn(ctx->callback_arg, raw);
+        // the device went away, stop polling a dead fd
+        ERR("Failed to read from device\n");
+        reactor_remove_fd(ctx->fd);
     }
     
-    buf_free(raw);
+    if (ctx->rx.len  &&  ctx->callback_fn)
+    {
+        ctx->callback_fn(ctx->callback_arg, &ctx->rx);
+    }
 }
 
 int
@@ -181,7 +348,16 @@ tty_write(void *ctx0, buffer *buf)
         n = write(ctx->fd, &buf->buf[sent], buf->len - sent);
         if (n < 0)
         {
-           return -1;
+            struct pollfd pfd;
+            
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN) return -1;
+            
+            // the fd is non-blocking, wait for the device to drain a bit
+            pfd.fd = ctx->fd;
+            pfd.events = POLLOUT;
+            if (poll(&pfd, 1, 1000) < 1) return -1;
+            continue;
         }
         sent += n;
     } while ((UInt32)sent < buf->len);
@@ -196,14 +372,197 @@ tty_shutdown(void *ctx0)
     
     ctx = ctx0;
     
-    CloseSerialPort(ctx->fd);
+    reactor_remove_fd(ctx->fd);
     
-    fclose(ctx->fp);
+    CloseSerialPort(ctx->fd, &ctx->orig);
     
     free(ctx);
 }
 
 
+#ifdef __linux__
+
+// Read the USB VID/PID of the device behind a ttyUSB node out of sysfs
+static int 
+tty_usb_id(const char *name, UInt32 *vid, UInt32 *pid)
+{
+    char val[16];
+    
+    if (tty_usb_attr(name, "idVendor", val, sizeof(val))) return -1;
+    *vid = strtoul(val, NULL, 16);
+    
+    if (tty_usb_attr(name, "idProduct", val, sizeof(val))) return -1;
+    *pid = strtoul(val, NULL, 16);
+    
+    return 0;
+}
+
+// An attribute of the USB device behind a ttyUSB node, one line of sysfs
+static int
+tty_usb_attr(const char *name, const char *attr, char *val, UInt32 max)
+{
+    char path[MAXPATHLEN];
+    FILE *fp;
+    size_t n;
+    
+    // device is .../<usb device>/<interface>/ttyUSBn, and the attributes sit
+    // on the usb device
+    snprintf(path, sizeof(path), "/sys/class/tty/%s/device/../../%s", name, attr);
+    fp = fopen(path, "r");
+    if (!fp) return -1;
+    
+    if (!fgets(val, max, fp)) val[0] = '\0';
+    fclose(fp);
+    
+    n = strlen(val);
+    if (n  &&  val[n - 1] == '\n') val[n - 1] = '\0';
+    
+    return 0;
+}
+
+static int
+tty_cmp(const void *a, const void *b)
+{
+    unsigned x, y;
+    
+    x = *(const unsigned *)a;
+    y = *(const unsigned *)b;
+    
+    return (x > y) - (x < y);
+}
+
+// Given the path to a serial device, open the device and configure it.
+// Return the file descriptor associated with the device.
+static int OpenSerialPort(const char *bsdPath, tty_attrs *orig)
+{
+    int 		fileDescriptor = -1;
+    int 		handshake;
+    struct termios2	options;
+    struct serial_struct serial;
+    
+    fileDescriptor = open(bsdPath, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (fileDescriptor == -1)
+    {
+        ERR("Error opening serial port %s - %s(%d).\n",
+            bsdPath, strerror(errno), errno);
+        goto error;
+    }
+
+    if (ioctl(fileDescriptor, TIOCEXCL) == -1)
+    {
+        ERR("Error setting TIOCEXCL on %s - %s(%d).\n",
+            bsdPath, strerror(errno), errno);
+        goto error;
+    }
+    
+    if (ioctl(fileDescriptor, TCGETS2, orig) == -1)
+    {
+        ERR("Error getting tty attributes %s - %s(%d).\n",
+            bsdPath, strerror(errno), errno);
+        goto error;
+    }
+
+    options = *orig;
+    
+    DBG("Current input baud rate is %d\n", (int)options.c_ispeed);
+    DBG("Current output baud rate is %d\n", (int)options.c_ospeed);
+    
+    // The equivalent of cfmakeraw(), termios2 has no helper for it
+    options.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON | IXOFF);
+    options.c_oflag &= ~OPOST;
+    options.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+    options.c_cc[VMIN] = 1;
+    options.c_cc[VTIME] = 10;
+    
+    // 8N1 with RTS/CTS flow control, and the real 312500 rate via BOTHER 
+    // instead of relying on a driver to alias one of the Bxxx constants
+    options.c_cflag &= ~(CSIZE | PARENB | CSTOPB | CBAUD | (CBAUD << IBSHIFT));
+    options.c_cflag |= CS8 | CREAD | CLOCAL | CRTSCTS | BOTHER | (BOTHER << IBSHIFT);
+    options.c_ispeed = TTY_BAUD;
+    options.c_ospeed = TTY_BAUD;
+    
+    if (ioctl(fileDescriptor, TCSETS2, &options) == -1)
+    {
+        ERR("Error setting tty attributes %s - %s(%d).\n",
+            bsdPath, strerror(errno), errno);
+        goto error;
+    }
+    
+    // read back what the driver actually did with the rate
+    if (ioctl(fileDescriptor, TCGETS2, &options) == 0)
+    {
+        DBG("Input baud rate changed to %d\n", (int)options.c_ispeed);
+        DBG("Output baud rate changed to %d\n", (int)options.c_ospeed);
+    }
+    
+    // Ask the driver not to batch up input (ftdi_sio drops its latency
+    // timer to 1ms). Not every tty supports this, pseudo-terminals don't.
+    if (ioctl(fileDescriptor, TIOCGSERIAL, &serial) == 0)
+    {
+        serial.flags |= ASYNC_LOW_LATENCY;
+        if (ioctl(fileDescriptor, TIOCSSERIAL, &serial) == -1)
+        {
+            DBG("Error setting low latency %s - %s(%d).\n",
+                bsdPath, strerror(errno), errno);
+        }
+    } else
+    {
+        DBG("No serial info for %s - %s(%d).\n",
+            bsdPath, strerror(errno), errno);
+    }
+    
+    // Clear DTR and assert RTS, same as the direct USB path does
+    handshake = TIOCM_DTR;
+    if (ioctl(fileDescriptor, TIOCMBIC, &handshake) == -1)
+    {
+        DBG("Error clearing DTR %s - %s(%d).\n",
+            bsdPath, strerror(errno), errno);
+    }
+    
+    handshake = TIOCM_RTS;
+    if (ioctl(fileDescriptor, TIOCMBIS, &handshake) == -1)
+    {
+        DBG("Error asserting RTS %s - %s(%d).\n",
+            bsdPath, strerror(errno), errno);
+    }
+    
+    // Drop anything that was queued up before we got here
+    ioctl(fileDescriptor, TCFLSH, TCIOFLUSH);
+    
+    // Success
+    return fileDescriptor;
+    
+    // Failure path
+error:
+    if (fileDescriptor != -1)
+    {
+        close(fileDescriptor);
+    }
+    
+    return -1;
+}
+
+// Given the file descriptor for a serial device, close that device.
+void CloseSerialPort(int fileDescriptor, tty_attrs *orig)
+{
+    // Block until all written output has been sent, i.e. tcdrain()
+    if (ioctl(fileDescriptor, TCSBRK, 1) == -1)
+    {
+        ERR("Error waiting for drain - %s(%d).\n",
+            strerror(errno), errno);
+    }
+    
+    if (ioctl(fileDescriptor, TCSETS2, orig) == -1)
+    {
+        ERR("Error resetting tty attributes - %s(%d).\n",
+            strerror(errno), errno);
+    }
+
+    close(fileDescriptor);
+}
+
+#else
+
 // Returns an iterator across all known modems. Caller is responsible for
 // releasing the iterator when iteration is complete.
 static kern_return_t FindModems(io_iterator_t *matchingServices)
@@ -351,9 +710,48 @@ static kern_return_t GetModemPath(io_iterator_t serialPortIterator, buffer *dev_
     return kernResult;
 }
 
+// Given an iterator across a set of modems, the BSD paths of all the USB
+// serial ones. The FTDI driver names a port after the serial number of its
+// device, cu.usbserial-<serial>.
+static int GetModemPaths(io_iterator_t serialPortIterator, tty_dev_info *devs, UInt32 max)
+{
+    io_object_t		modemService;
+    CFTypeRef		bsdPathAsCFString;
+    const char		*serial;
+    UInt32		count = 0;
+    
+    while (count < max  &&  (modemService = IOIteratorNext(serialPortIterator)))
+    {
+        bsdPathAsCFString = IORegistryEntryCreateCFProperty(modemService,
+                                                            CFSTR(kIOCalloutDeviceKey),
+                                                            kCFAllocatorDefault,
+                                                            0);
+        if (bsdPathAsCFString)
+        {
+            if (CFStringGetCString(bsdPathAsCFString,
+                                   devs[count].name,
+                                   sizeof(devs[count].name),
+                                   kCFStringEncodingASCII)  &&
+                strstr(devs[count].name, "usbserial"))
+            {
+                serial = strstr(devs[count].name, "usbserial-");
+                snprintf(devs[count].serial, sizeof(devs[count].serial), "%s",
+                         serial ? serial + strlen("usbserial-") : "");
+                DBG("%s serial %s\n", devs[count].name, devs[count].serial);
+                count++;
+            }
+            CFRelease(bsdPathAsCFString);
+        }
+        
+        (void) IOObjectRelease(modemService);
+    }
+    
+    return count;
+}
+
 // Given the path to a serial device, open the device and configure it.
 // Return the file descriptor associated with the device.
-static int OpenSerialPort(const char *bsdPath)
+static int OpenSerialPort(const char *bsdPath, tty_attrs *orig)
 {
     int 		fileDescriptor = -1;
     int 		handshake;
@@ -395,7 +793,7 @@ static int OpenSerialPort(const char *bsdPath)
     */
     
     // Get the current options and save them so we can restore the default settings later.
-    if (tcgetattr(fileDescriptor, &gOriginalTTYAttrs) == -1)
+    if (tcgetattr(fileDescriptor, orig) == -1)
     {
         ERR("Error getting tty attributes %s - %s(%d).\n",
             bsdPath, strerror(errno), errno);
@@ -407,7 +805,7 @@ static int OpenSerialPort(const char *bsdPath)
     // changes will not become effective without the tcsetattr() call.
     // See tcsetattr(4) ("man 4 tcsetattr") for details.
     
-    options = gOriginalTTYAttrs;
+    options = *orig;
     
     // Print the current input and output baud rates.
     // See tcsetattr(4) ("man 4 tcsetattr") for details.
@@ -493,7 +891,7 @@ error:
 }
 
 // Given the file descriptor for a serial device, close that device.
-void CloseSerialPort(int fileDescriptor)
+void CloseSerialPort(int fileDescriptor, tty_attrs *orig)
 {
     // Block until all written output has been sent from the device.
     // Note that this call is simply passed on to the serial device driver.
@@ -507,7 +905,7 @@ void CloseSerialPort(int fileDescriptor)
     // Traditionally it is good practice to reset a serial port back to
     // the state in which you found it. This is why the original termios struct
     // was saved.
-    if (tcsetattr(fileDescriptor, TCSANOW, &gOriginalTTYAttrs) == -1)
+    if (tcsetattr(fileDescriptor, TCSANOW, orig) == -1)
     {
         ERR("Error resetting tty attributes - %s(%d).\n",
             strerror(errno), errno);
@@ -516,3 +914,4 @@ void CloseSerialPort(int fileDescriptor)
     close(fileDescriptor);
 }
 
+#endif
@@ -9,7 +9,18 @@
 #ifndef __TTY_H
 #define __TTY_H
 
+#define TTY_MAX_NAME   (64)
+#define TTY_MAX_SERIAL (32)
+
+// A USB-UIRT as tty_find_devices() finds it
+typedef struct tty_dev_info
+{
+    char name[TTY_MAX_NAME];     // device node, for tty_add_source()
+    char serial[TTY_MAX_SERIAL]; // USB serial number, empty if unknown
+} tty_dev_info;
+
 int  tty_find_device(buffer *dev_name);
+int  tty_find_devices(tty_dev_info *devs, UInt32 max);
 int  tty_add_source(void **ctx, buffer *dev_name);
 int  tty_set_callback(void *ctx, void (*fn)(void *, buffer *), void *fn_arg);
 int  tty_write(void *ctx, buffer *buf);
@@ -0,0 +1,578 @@
+/* Copyright (C) 2007 xyster.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+
+#define _XOPEN_SOURCE 600 // posix_openpt() and friends
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "platform.h"
+#include "debug.h"
+#include "ribsu-util.h"
+#include "uirt.h"
+#include "uirt-sm.h"
+#include "uirt-emu.h"
+
+#define MODULE_NAME uirt_emu
+DBG_MODULE_DEFINE();
+
+#define UEMU_IN_MAX (512)
+
+enum {
+    UEMU_M_UIR,
+    UEMU_M_RAW,
+    UEMU_M_RAW2,
+    UEMU_M_MAX
+};
+
+typedef struct uemu_ctx
+{
+    int fd;        // pty master, our end
+    int slave_fd;  // kept open so the master never sees a hangup
+    UInt32 flags;
+    UInt32 mode;
+    int txing;
+    buffer in;
+    UInt8 inbuf[UEMU_IN_MAX];
+    UInt32 nof_frames[UEMU_M_MAX];
+    UInt32 next_frame[UEMU_M_MAX];
+    buffer *frames[UEMU_M_MAX][UEMU_MAX_FRAMES];
+    UInt32 rx_interval;
+    UInt32 rx_left; // 0 means forever
+    reactor_timer tx_timer;
+    reactor_timer rx_timer;
+    UInt32 fault;      // UEMU_FAULT_* to hit the next commands with
+    UInt32 fault_left;
+    uemu_stats stats;
+} uemu_ctx;
+
+// Firmware 1.9, protocol 2.1, 26/10/2017, checksum appended at runtime
+static const UInt8 uemu_version[] = { 0x01, 0x09, 0x02, 0x01, 26, 10, 17 };
+
+static void   uemu_read_callback(int fd, void *info);
+static void   uemu_tx_done(void *arg);
+static void   uemu_rx_tick(void *arg);
+static void   uemu_command(uemu_ctx *ctx, UInt8 *d, UInt32 len);
+static void   uemu_send(uemu_ctx *ctx, const UInt8 *d, UInt32 len);
+static void   uemu_status(uemu_ctx *ctx, UInt8 status);
+static int    uemu_mode_index(UInt8 mode_cmd);
+static void   uemu_nec_raw(buffer *buf, UInt8 addr, UInt8 cmd);
+static void   uemu_nec_raw2(buffer *buf, UInt8 addr, UInt8 cmd);
+
+int
+uemu_create(void **ctx0, buffer *dev_name, UInt32 flags)
+{
+    uemu_ctx *ctx;
+    buffer *frame;
+    const char *name;
+    int error;
+
+    *ctx0 = NULL;
+
+    ctx = malloc(sizeof(*ctx));
+    if (!ctx)
+    {
+        U_NOMEM();
+        return -1;
+    }
+    bzero(ctx, sizeof(*ctx));
+    ctx->fd = ctx->slave_fd = -1;
+
+    buf_attach(&ctx->in, sizeof(ctx->inbuf), ctx->inbuf);
+    ctx->flags = flags;
+    ctx->mode = UEMU_M_UIR; // power on default, same as usm_init()
+
+    ctx->fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (ctx->fd < 0  ||  grantpt(ctx->fd)  ||  unlockpt(ctx->fd))
+    {
+        ERR("Failed to create pty - %s(%d)\n", strerror(errno), errno);
+        error = -1;
+        goto out;
+    }
+
+    name = ptsname(ctx->fd);
+    if (!name  ||  strlen(name) >= dev_name->max)
+    {
+        ERR("Bad pty name\n");
+        error = -1;
+        goto out;
+    }
+
+    ctx->slave_fd = open(name, O_RDWR | O_NOCTTY);
+    if (ctx->slave_fd < 0)
+    {
+        ERR("Failed to open %s - %s(%d)\n", name, strerror(errno), errno);
+        error = -1;
+        goto out;
+    }
+
+    fcntl(ctx->fd, F_SETFL, fcntl(ctx->fd, F_GETFL) | O_NONBLOCK);
+
+    if (reactor_add_fd(ctx->fd, uemu_read_callback, ctx))
+    {
+        error = -1;
+        goto out;
+    }
+
+    reactor_timer_init(&ctx->tx_timer, uemu_tx_done, ctx);
+    reactor_timer_init(&ctx->rx_timer, uemu_rx_tick, ctx);
+
+    // Something to receive out of the box, NEC address 0x00 command 0x12
+    frame = buf_alloc(256);
+    if (frame)
+    {
+        static const UInt8 uir[UIRT_UIR_CODE_LEN] = { 0x00, 0xff, 0x12, 0xed, 0x00, 0x00 };
+
+        bcopy(uir, frame->buf, sizeof(uir));
+        frame->len = sizeof(uir);
+        uemu_add_rx_frame(ctx, UIRT_CMD_MODE_UIR, frame);
+
+        uemu_nec_raw(frame, 0x00, 0x12);
+        uemu_add_rx_frame(ctx, UIRT_CMD_MODE_RAW, frame);
+
+        uemu_nec_raw2(frame, 0x00, 0x12);
+        uemu_add_rx_frame(ctx, UIRT_CMD_MODE_RAW2, frame);
+
+        buf_free(frame);
+    }
+
+    strcpy((char *)dev_name->buf, name);
+    dev_name->len = strlen(name);
+
+    DBG("Emulating USB-UIRT on %s\n", name);
+
+    *ctx0 = ctx;
+
+    error = 0;
+
+out:
+
+    if (error)
+    {
+        if (ctx->slave_fd >= 0) close(ctx->slave_fd);
+        if (ctx->fd >= 0) close(ctx->fd);
+        free(ctx);
+    }
+
+    return error;
+}
+
+int
+uemu_add_rx_frame(void *ctx0, UInt8 mode_cmd, buffer *frame)
+{
+    uemu_ctx *ctx;
+    buffer *copy;
+    int m;
+
+    ctx = ctx0;
+
+    m = uemu_mode_index(mode_cmd);
+    if (m < 0) return -1;
+
+    if (ctx->nof_frames[m] == UEMU_MAX_FRAMES)
+    {
+        ERR("Too many frames\n");
+        return -1;
+    }
+
+    copy = buf_alloc(frame->len);
+    if (!copy)
+    {
+        U_NOMEM();
+        return -1;
+    }
+    buf_copy(frame, copy);
+
+    ctx->frames[m][ctx->nof_frames[m]++] = copy;
+
+    return 0;
+}
+
+void
+uemu_clear_rx_frames(void *ctx0, UInt8 mode_cmd)
+{
+    uemu_ctx *ctx;
+    int m;
+
+    ctx = ctx0;
+
+    m = uemu_mode_index(mode_cmd);
+    if (m < 0) return;
+
+    while (ctx->nof_frames[m])
+    {
+        buf_free(ctx->frames[m][--ctx->nof_frames[m]]);
+    }
+    ctx->next_frame[m] = 0;
+}
+
+int
+uemu_start_rx(void *ctx0, UInt32 interval_usec, UInt32 count)
+{
+    uemu_ctx *ctx;
+
+    ctx = ctx0;
+
+    ctx->rx_interval = interval_usec;
+    ctx->rx_left = count;
+
+    reactor_timer_arm(&ctx->rx_timer, interval_usec);
+
+    return 0;
+}
+
+void
+uemu_stop_rx(void *ctx0)
+{
+    uemu_ctx *ctx;
+
+    ctx = ctx0;
+
+    reactor_timer_cancel(&ctx->rx_timer);
+}
+
+// Misbehave on the next count commands, the way a flaky link would
+void
+uemu_inject_fault(void *ctx0, UInt32 fault, UInt32 count)
+{
+    uemu_ctx *ctx;
+
+    ctx = ctx0;
+
+    ctx->fault = fault;
+    ctx->fault_left = count;
+}
+
+void
+uemu_get_stats(void *ctx0, uemu_stats *stats)
+{
+    uemu_ctx *ctx;
+
+    ctx = ctx0;
+
+    *stats = ctx->stats;
+}
+
+void
+uemu_shutdown(void *ctx0)
+{
+    uemu_ctx *ctx;
+
+    ctx = ctx0;
+
+    if (!ctx) return;
+
+    reactor_timer_deinit(&ctx->tx_timer);
+    reactor_timer_deinit(&ctx->rx_timer);
+    reactor_remove_fd(ctx->fd);
+
+    uemu_clear_rx_frames(ctx, UIRT_CMD_MODE_UIR);
+    uemu_clear_rx_frames(ctx, UIRT_CMD_MODE_RAW);
+    uemu_clear_rx_frames(ctx, UIRT_CMD_MODE_RAW2);
+
+    close(ctx->slave_fd);
+    close(ctx->fd);
+
+    free(ctx);
+}
+
+void
+uemu_read_callback(int fd, void *info)
+{
+    uemu_ctx *ctx;
+    UInt32 need;
+    int n;
+
+    (void)fd;
+    ctx = info;
+
+    n = read(ctx->fd, &ctx->in.buf[ctx->in.len], ctx->in.max - ctx->in.len);
+    if (n <= 0)
+    {
+        if (n < 0  &&  errno != EAGAIN  &&  errno != EIO)
+        {
+            ERR("Failed to read from pty - %s(%d)\n", strerror(errno), errno);
+        }
+        return;
+    }
+    ctx->in.len += n;
+
+    // carve out as many complete commands as there are
+    while (ctx->in.len)
+    {
+        switch (ctx->in.buf[0])
+        {
+            case UIRT_CMD_TX_RAW:
+            case UIRT_CMD_TX_STRUCT:
+                if (ctx->in.len < 2) return;
+                need = ctx->in.buf[UIRT_CMD_O_LENGTH] + 2;
+                break;
+            case UIRT_CMD_MODE_UIR:
+            case UIRT_CMD_MODE_RAW:
+            case UIRT_CMD_MODE_RAW2:
+            case UIRT_CMD_GET_VERSION:
+            case UIRT_CMD_GET_GPIO_CAPS:
+            case UIRT_CMD_GET_GPIO_CFG:
+            case UIRT_CMD_GET_GPIO:
+            case UIRT_CMD_REFRESH_GPIO:
+            case UIRT_CMD_GET_CFG:
+                need = 2;
+                break;
+            default:
+                // no way to find the end of it, so resync on the next write
+                DBG("Unknown command %02X\n", (unsigned)ctx->in.buf[0]);
+                ctx->stats.cmd_errs++;
+                uemu_status(ctx, UIRT_STATUS_CMD_ERROR);
+                ctx->in.len = 0;
+                return;
+        }
+
+        if (ctx->in.len < need) return;
+
+        uemu_command(ctx, ctx->in.buf, need);
+        buf_slide(&ctx->in, need);
+    }
+}
+
+void
+uemu_command(uemu_ctx *ctx, UInt8 *d, UInt32 len)
+{
+    UInt8 check, reply[sizeof(uemu_version) + 1];
+    UInt32 i, usec;
+
+    check = 0;
+    for (i = 0; i < len; i++)
+    {
+        check += d[i];
+    }
+
+    if (ctx->fault_left)
+    {
+        ctx->fault_left--;
+        ctx->stats.faults++;
+        if (ctx->fault == UEMU_FAULT_SILENT)
+        {
+            DBG("Ignoring %02X\n", (unsigned)d[0]);
+            return;
+        }
+        check = 1; // as if garbled on the way
+    }
+
+    if (check)
+    {
+        DBG("Checksum error on %02X\n", (unsigned)d[0]);
+        ctx->stats.csum_errs++;
+        uemu_status(ctx, UIRT_STATUS_CSUM_ERROR);
+        return;
+    }
+
+    ctx->stats.cmds++;
+
+    switch (d[0])
+    {
+        case UIRT_CMD_MODE_UIR:
+        case UIRT_CMD_MODE_RAW:
+        case UIRT_CMD_MODE_RAW2:
+            ctx->mode = uemu_mode_index(d[0]);
+            DBG("Mode %u\n", (unsigned)ctx->mode);
+            uemu_status(ctx, UIRT_STATUS_OK);
+            break;
+        case UIRT_CMD_GET_VERSION:
+            check = 0;
+            for (i = 0; i < sizeof(uemu_version); i++)
+            {
+                reply[i] = uemu_version[i];
+                check -= reply[i];
+            }
+            reply[i++] = check;
+            uemu_send(ctx, reply, i);
+            break;
+        case UIRT_CMD_TX_RAW:
+        case UIRT_CMD_TX_STRUCT:
+            if (ctx->txing)
+            {
+                // the real device can't queue, a second transmit is an overrun
+                DBG("Transmit while busy\n");
+                ctx->stats.cmd_errs++;
+                uemu_status(ctx, UIRT_STATUS_CMD_ERROR);
+                break;
+            }
+
+            usec = usm_airtime(d, len);
+            DMP("Transmitting for %uus\n", (unsigned)usec);
+
+            ctx->txing = 1;
+            ctx->stats.tx_usec = usec;
+            if (ctx->flags & UEMU_F_TXING)
+            {
+                uemu_status(ctx, UIRT_STATUS_TXING);
+            }
+            reactor_timer_arm(&ctx->tx_timer, usec);
+            break;
+        default:
+            ctx->stats.cmd_errs++;
+            uemu_status(ctx, UIRT_STATUS_CMD_ERROR);
+            break;
+    }
+}
+
+void
+uemu_tx_done(void *arg)
+{
+    uemu_ctx *ctx;
+
+    ctx = arg;
+
+    ctx->txing = 0;
+    ctx->stats.txs++;
+
+    uemu_status(ctx, UIRT_STATUS_OK);
+}
+
+void
+uemu_rx_tick(void *arg)
+{
+    uemu_ctx *ctx;
+    buffer *frame;
+    UInt32 m;
+    int n;
+
+    ctx = arg;
+    m = ctx->mode;
+
+    if (ctx->nof_frames[m])
+    {
+        frame = ctx->frames[m][ctx->next_frame[m]];
+        ctx->next_frame[m] = (ctx->next_frame[m] + 1) % ctx->nof_frames[m];
+
+        // drop the whole frame rather than tear it if the pty is full
+        n = write(ctx->fd, frame->buf, frame->len);
+        if (n == (int)frame->len)
+        {
+            ctx->stats.rx_frames++;
+        } else
+        {
+            ctx->stats.rx_drops++;
+        }
+    }
+
+    if (ctx->rx_left  &&  !--ctx->rx_left) return;
+
+    reactor_timer_arm(&ctx->rx_timer, ctx->rx_interval);
+}
+
+void
+uemu_send(uemu_ctx *ctx, const UInt8 *d, UInt32 len)
+{
+    if (write(ctx->fd, d, len) != (int)len)
+    {
+        ERR("Failed to write to pty - %s(%d)\n", strerror(errno), errno);
+    }
+}
+
+void
+uemu_status(uemu_ctx *ctx, UInt8 status)
+{
+    uemu_send(ctx, &status, 1);
+}
+
+int
+uemu_mode_index(UInt8 mode_cmd)
+{
+    switch (mode_cmd)
+    {
+        case UIRT_CMD_MODE_UIR:
+            return UEMU_M_UIR;
+        case UIRT_CMD_MODE_RAW:
+            return UEMU_M_RAW;
+        case UIRT_CMD_MODE_RAW2:
+            return UEMU_M_RAW2;
+        default:
+            return -1;
+    }
+}
+
+// NEC frame as RAW mode reports it: interspace, then pulse/space pairs in 50us
+void
+uemu_nec_raw(buffer *buf, UInt8 addr, UInt8 cmd)
+{
+    UInt32 bits, i, n;
+    UInt8 *d;
+
+    d = buf->buf;
+    n = 0;
+
+    bits = addr | (UInt32)(UInt8)~addr << 8 | (UInt32)cmd << 16 | (UInt32)(UInt8)~cmd << 24;
+
+    d[n++] = 0x03; // interspace 40ms
+    d[n++] = 0x20;
+
+    d[n++] = 180; // 9ms leader
+    d[n++] = 90;  // 4.5ms
+
+    for (i = 0; i < 32; i++)
+    {
+        d[n++] = 11; // 560us
+        d[n++] = (bits >> i) & 1 ? 34 : 11; // 1690us or 560us
+    }
+
+    d[n++] = 11; // stop bit
+    d[n++] = 0xff; // end of code
+
+    buf->len = n;
+}
+
+// Same frame as RAW2 reports it: 51.2us interspace, 400ns pulses with their
+// carrier cycle counts at 38kHz, and 400ns spaces
+void
+uemu_nec_raw2(buffer *buf, UInt8 addr, UInt8 cmd)
+{
+    UInt32 bits, i, n;
+    UInt8 *d;
+
+    d = buf->buf;
+    n = 0;
+
+    bits = addr | (UInt32)(UInt8)~addr << 8 | (UInt32)cmd << 16 | (UInt32)(UInt8)~cmd << 24;
+
+    d[n++] = 0x03; // interspace 40ms
+    d[n++] = 0x0d;
+
+    d[n++] = 0x57; // 9ms leader, 342 cycles
+    d[n++] = 0xe4;
+    d[n++] = 0x81;
+    d[n++] = 0x56;
+    d[n++] = 0x2b; // 4.5ms
+    d[n++] = 0xf2;
+
+    for (i = 0; i < 32; i++)
+    {
+        d[n++] = 0x05; // 560us, 21 cycles
+        d[n++] = 0x78;
+        d[n++] = 0x15;
+        if ((bits >> i) & 1)
+        {
+            d[n++] = 0x10; // 1690us
+            d[n++] = 0x81;
+        } else
+        {
+            d[n++] = 0x05; // 560us
+            d[n++] = 0x78;
+        }
+    }
+
+    d[n++] = 0x05; // stop bit
+    d[n++] = 0x78;
+    d[n++] = 0x15;
+    d[n++] = 0xff; // end of code
+
+    buf->len = n;
+}
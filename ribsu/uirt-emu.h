@@ -0,0 +1,44 @@
+/* Copyright (C) 2007 xyster.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+
+#ifndef __UIRT_EMU_H
+#define __UIRT_EMU_H
+
+/* Software USB-UIRT on the master side of a pseudo-terminal. The slave side
+ * name is handed back so the TTY driver can open it like the real thing.
+ */
+
+#define UEMU_F_TXING (1 << 0) // send UIRT_STATUS_TXING as soon as a transmit is accepted
+
+#define UEMU_MAX_FRAMES 16 // receive frames per mode
+
+#define UEMU_FAULT_SILENT (1) // commands go unanswered
+#define UEMU_FAULT_CSUM   (2) // commands arrive with a bad checksum
+
+typedef struct uemu_stats
+{
+    UInt32 cmds;      // well formed commands received
+    UInt32 csum_errs; // commands rejected for a bad checksum
+    UInt32 cmd_errs;  // unknown commands, or transmits while still busy
+    UInt32 txs;       // completed transmits
+    UInt32 tx_usec;   // modelled airtime of the last transmit
+    UInt32 rx_frames; // injected receive frames
+    UInt32 rx_drops;  // injected frames dropped because the pty was full
+    UInt32 faults;    // commands hit by an injected fault
+} uemu_stats;
+
+int  uemu_create(void **ctx, buffer *dev_name, UInt32 flags);
+int  uemu_add_rx_frame(void *ctx, UInt8 mode_cmd, buffer *frame);
+void uemu_clear_rx_frames(void *ctx, UInt8 mode_cmd);
+int  uemu_start_rx(void *ctx, UInt32 interval_usec, UInt32 count);
+void uemu_stop_rx(void *ctx);
+void uemu_inject_fault(void *ctx, UInt32 fault, UInt32 count);
+void uemu_get_stats(void *ctx, uemu_stats *stats);
+void uemu_shutdown(void *ctx);
+
+#endif
@@ -0,0 +1,226 @@
+/* Copyright (C) 2007 xyster.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "platform.h"
+#include "debug.h"
+#include "ribsu-util.h"
+#include "uirt-lib.h"
+
+#define MODULE_NAME uirt_lib
+DBG_MODULE_DEFINE();
+
+#define UL_MIN (64) // entries, slots and durations allocated on first use
+
+static UInt32 ul_norm(pstore *ps, UInt32 unit_ns, UInt16 *d);
+static UInt32 ul_sig(UInt16 *d, UInt32 n);
+static int    ul_match(UInt16 *a, UInt16 *b, UInt32 n);
+static int    ul_grow(ul_lib *lib, UInt32 n);
+static void   ul_link(ul_lib *lib, UInt32 i);
+
+// Add a code, durations in units of unit_ns. Returns -1 if it's empty, too
+// long or there's no room.
+int
+ul_add(ul_lib *lib, UInt32 id, pstore *ps, UInt32 unit_ns)
+{
+    UInt16 d[UL_ELEM_MAX];
+    ul_entry *e;
+    UInt32 n;
+
+    n = ul_norm(ps, unit_ns, d);
+    if (!n)
+    {
+        ERR("code %u is empty or longer than %d, not adding\n", (unsigned)id, UL_ELEM_MAX);
+        return -1;
+    }
+
+    if (ul_grow(lib, n)) return -1;
+
+    e = &lib->e[lib->nof++];
+    e->sig = ul_sig(d, n);
+    e->id = id;
+    e->off = lib->len;
+    e->nof = n;
+
+    bcopy(d, lib->d + lib->len, n * sizeof(*d));
+    lib->len += n;
+
+    ul_link(lib, lib->nof);
+
+    return 0;
+}
+
+// Find the code a frame is. Returns -1 if there is none within tolerance.
+int
+ul_lookup(ul_lib *lib, pstore *ps, UInt32 unit_ns, UInt32 *id)
+{
+    UInt16 d[UL_ELEM_MAX];
+    ul_entry *e;
+    UInt32 n, sig, i;
+
+    if (!lib->slots) return -1;
+
+    n = ul_norm(ps, unit_ns, d);
+    if (!n) return -1;
+
+    sig = ul_sig(d, n);
+
+    for (i = lib->slot[sig & (lib->slots - 1)]; i; i = e->next)
+    {
+        e = &lib->e[i - 1];
+        if (e->sig == sig  &&  e->nof == n  &&  ul_match(lib->d + e->off, d, n))
+        {
+            DBG("frame is code %u\n", (unsigned)e->id);
+            *id = e->id;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+int
+ul_lookup_rr(ul_lib *lib, rr_ctx *rr, UInt32 *id)
+{
+    return ul_lookup(lib, &rr->ps, 50000, id); // 50us
+}
+
+int
+ul_lookup_rr2(ul_lib *lib, rr2_ctx *rr2, UInt32 *id)
+{
+    if (rr2->freq_conf < RR2_FREQ_CONF_MIN) return -1;
+
+    return ul_lookup(lib, &rr2->ps, 400, id); // 400ns
+}
+
+void
+ul_free(ul_lib *lib)
+{
+    free(lib->e);
+    free(lib->d);
+    free(lib->slot);
+    bzero(lib, sizeof(*lib));
+}
+
+// Durations to us, pulse first and alternating, saturating at 16 bits
+UInt32
+ul_norm(pstore *ps, UInt32 unit_ns, UInt16 *d)
+{
+    UInt32 i, n, t;
+
+    n = ps->nof_pulses + ps->nof_spaces;
+    if (n > UL_ELEM_MAX) return 0;
+
+    for (i = 0; i < n; i++)
+    {
+        t = ps_get(ps, i) * unit_ns / 1000;
+        d[i] = (t > 0xffff ? 0xffff : t);
+    }
+
+    return n;
+}
+
+// Every duration against the previous one of its kind: shorter, longer or
+// the same. Remotes keep their durations at least 2:1 apart, the threshold
+// of 1.4:1 sits between that and same durations off by UL_TOL.
+UInt32
+ul_sig(UInt16 *d, UInt32 n)
+{
+    UInt32 h, i, a, b, q;
+
+    h = 2166136261u ^ n;
+    for (i = 2; i < n; i++)
+    {
+        a = d[i];
+        b = d[i - 2];
+        q = (a * 7 < b * 5 ? 0 : (b * 7 < a * 5 ? 2 : 1));
+        h = (h ^ q) * 16777619u;
+    }
+
+    return h;
+}
+
+// a is the learned code
+int
+ul_match(UInt16 *a, UInt16 *b, UInt32 n)
+{
+    UInt32 i, t;
+
+    for (i = 0; i < n; i++)
+    {
+        t = (a[i] > b[i] ? a[i] - b[i] : b[i] - a[i]);
+        if (t > UL_TOL(a[i])) return 0;
+    }
+
+    return 1;
+}
+
+// Make room for one more entry of n durations, rehashing when the slots are
+// half full
+int
+ul_grow(ul_lib *lib, UInt32 n)
+{
+    UInt32 max, i;
+    void *p;
+
+    if (lib->nof == lib->max)
+    {
+        max = lib->max ? 2 * lib->max : UL_MIN;
+        if (max > UL_LIMIT)
+        {
+            ERR("library limit of %d codes reached\n", UL_LIMIT);
+            return -1;
+        }
+
+        p = realloc(lib->e, max * sizeof(*lib->e));
+        if (!p) goto no_mem;
+        lib->e = p;
+        lib->max = max;
+    }
+
+    if (lib->len + n > lib->size)
+    {
+        for (max = lib->size ? lib->size : UL_MIN; max < lib->len + n; max *= 2);
+
+        p = realloc(lib->d, max * sizeof(*lib->d));
+        if (!p) goto no_mem;
+        lib->d = p;
+        lib->size = max;
+    }
+
+    if (2 * (lib->nof + 1) > lib->slots)
+    {
+        max = lib->slots ? 2 * lib->slots : UL_MIN;
+
+        p = calloc(max, sizeof(*lib->slot));
+        if (!p) goto no_mem;
+        free(lib->slot);
+        lib->slot = p;
+        lib->slots = max;
+
+        for (i = 1; i <= lib->nof; i++)
+        {
+            ul_link(lib, i);
+        }
+    }
+
+    return 0;
+
+no_mem:
+    U_NOMEM();
+    return -1;
+}
+
+// Put entry i (1 based) at the head of its slot
+void
+ul_link(ul_lib *lib, UInt32 i)
+{
+    UInt32 *s;
+
+    s = &lib->slot[lib->e[i - 1].sig & (lib->slots - 1)];
+    lib->e[i - 1].next = *s;
+    *s = i;
+}
@@ -0,0 +1,58 @@
+/* Copyright (C) 2007 xyster.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+
+#ifndef __UIRT_LIB_H
+#define __UIRT_LIB_H
+
+#include "uirt-raw.h"
+#include "uirt-raw2.h"
+
+/* Library of learned codes, looked up by received frame. Every code is
+ * indexed under a signature that quantises each duration against the one
+ * two before it (the previous pulse or space) into shorter, same or longer,
+ * split at 1.4:1. The candidates in the slot are then compared duration by
+ * duration within UL_TOL.
+ *
+ * UL_TOL is bounded by the signature. Durations a remote keeps the same
+ * (1:1) can drift apart to (1 + 1/8) / (1 - 1/8) = 1.29:1 and ones it keeps
+ * at least 2:1 apart close in to no less than 1.56:1, both clear of 1.4:1.
+ * Every frame ul_match() accepts hashes to the learned code's slot. Any
+ * wider, say a quarter, and a same pair could reach 1.67:1 and be missed.
+ */
+
+#define UL_TOL(t)      ((t) / 8u)      // us either way a duration may be off
+#define UL_LIMIT       (1 << 20)       // codes
+#define UL_ELEM_MAX    (1024)          // pulses plus spaces of a code
+
+typedef struct ul_entry
+{
+    UInt32 sig;
+    UInt32 id;   // caller's name for the code
+    UInt32 off;  // first duration in the arena
+    UInt32 nof;  // pulses plus spaces
+    UInt32 next; // 1 based index of the next entry with the same signature slot
+} ul_entry;
+
+// A zeroed ul_lib is empty
+typedef struct ul_lib
+{
+    UInt32   nof, max;  // entries
+    ul_entry *e;
+    UInt32   len, size; // durations in us, pulse first and alternating
+    UInt16   *d;
+    UInt32   slots;     // power of 2, 0 until the first add
+    UInt32   *slot;     // 1 based index of the first entry
+} ul_lib;
+
+int  ul_add(ul_lib *lib, UInt32 id, pstore *ps, UInt32 unit_ns);
+int  ul_lookup(ul_lib *lib, pstore *ps, UInt32 unit_ns, UInt32 *id);
+int  ul_lookup_rr(ul_lib *lib, rr_ctx *rr, UInt32 *id);
+int  ul_lookup_rr2(ul_lib *lib, rr2_ctx *rr2, UInt32 *id);
+void ul_free(ul_lib *lib);
+
+#endif
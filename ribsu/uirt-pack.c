@@ -0,0 +1,387 @@
+/* Copyright (C) 2007 xyster.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "platform.h"
+#include "debug.h"
+#include "ribsu-util.h"
+#include "uirt-pack.h"
+
+#define MODULE_NAME uirt_pack
+DBG_MODULE_DEFINE();
+
+typedef struct pk_class
+{
+    UInt32 lo, hi; // durations that map to it
+    UInt32 t;      // what they come back as
+    UInt32 count;
+} pk_class;
+
+static UInt32 pk_classify(UInt32 *t, UInt32 n, pk_class *c);
+static int    pk_cmp(const void *a, const void *b);
+static UInt32 pk_put(UInt8 *d, UInt32 v);
+static UInt32 pk_get(UInt8 *d, UInt32 len, UInt32 *n, UInt32 *v);
+
+// Pack the durations of ps, scale is carrier cycles per unit of ps as a 24
+// bit fraction. Returns the length, 0 if it doesn't fit max.
+UInt32
+pk_encode(pstore *ps, UInt32 scale, UInt32 freq, UInt8 *d, UInt32 max)
+{
+    pk_class c[PK_CLASS_MAX];
+    UInt32 *t, prev[2], i, j, n, k, bits, nof, sym, acc, nacc, v;
+    SInt32 delta;
+    UInt8 *sd;
+
+    nof = ps->nof_pulses + ps->nof_spaces;
+    if (PK_MAX(nof) > max)
+    {
+        ERR("%u durations may not fit %u bytes\n", (unsigned)nof, (unsigned)max);
+        return 0;
+    }
+
+    t = malloc(2 * (nof + 1) * sizeof(*t));
+    if (!t)
+    {
+        U_NOMEM();
+        return 0;
+    }
+
+    for (i = 0; i < nof; i++)
+    {
+        t[i] = (UInt32)(((UInt64)ps_get(ps, i) * scale + (1 << 23)) >> 24);
+    }
+
+    k = pk_classify(t, nof, c);
+    for (bits = 1; (1u << bits) < k + 1; bits++);
+
+    n = 0;
+    n += pk_put(d + n, freq);
+    n += pk_put(d + n, nof);
+    d[n++] = k;
+    for (j = 0; j < k; j++)
+    {
+        n += pk_put(d + n, c[j].t - (j ? c[j - 1].t : 0));
+    }
+
+    // symbols first, the escapes go after them in the order they come up
+    sd = d + n;
+    n += (nof * bits + 7) / 8;
+    acc = nacc = 0;
+    prev[0] = prev[1] = 0;
+
+    for (i = 0; i < nof; i++)
+    {
+        for (j = 0; j < k  &&  t[i] > c[j].hi; j++);
+
+        if (j < k  &&  t[i] >= c[j].lo)
+        {
+            sym = j;
+            v = c[j].t;
+        } else
+        {
+            sym = k;
+            v = t[i];
+            delta = (SInt32)(v - prev[i & 1]);
+            n += pk_put(d + n, ((UInt32)delta << 1) ^ (UInt32)(delta >> 31));
+        }
+        prev[i & 1] = v;
+
+        acc |= sym << nacc;
+        nacc += bits;
+        while (nacc >= 8)
+        {
+            *sd++ = acc;
+            acc >>= 8;
+            nacc -= 8;
+        }
+    }
+    if (nacc) *sd = acc;
+
+    free(t);
+
+    DBG("%u durations in %u classes packed into %u bytes\n", (unsigned)nof, (unsigned)k, (unsigned)n);
+
+    return n;
+}
+
+// Unpack into ps, which is reset first. Returns -1 if d is cut short or
+// corrupt.
+int
+pk_decode(pstore *ps, UInt32 *freq, UInt8 *d, UInt32 len)
+{
+    UInt32 c[PK_CLASS_MAX], prev[2], n, nof, k, bits, mask, i, j, v, z, acc, nacc;
+    UInt8 *sd;
+
+    ps_reset(ps);
+
+    n = 0;
+    if (!pk_get(d, len, &n, freq)  ||  !pk_get(d, len, &n, &nof)) goto corrupt;
+    if (n >= len  ||  nof > 2 * PS_LIMIT) goto corrupt;
+
+    k = d[n++];
+    if (k > PK_CLASS_MAX) goto corrupt;
+    for (bits = 1; (1u << bits) < k + 1; bits++);
+    mask = (1u << bits) - 1;
+
+    for (j = 0, v = 0; j < k; j++)
+    {
+        if (!pk_get(d, len, &n, &z)) goto corrupt;
+        v += z;
+        c[j] = v;
+    }
+
+    sd = d + n;
+    n += (nof * bits + 7) / 8;
+    if (n > len) goto corrupt;
+
+    acc = nacc = 0;
+    prev[0] = prev[1] = 0;
+
+    for (i = 0; i < nof; i++)
+    {
+        if (nacc < bits)
+        {
+            acc |= (UInt32)*sd++ << nacc;
+            nacc += 8;
+        }
+        j = acc & mask;
+        acc >>= bits;
+        nacc -= bits;
+
+        if (j < k)
+        {
+            v = c[j];
+        } else if (j == k)
+        {
+            if (!pk_get(d, len, &n, &z)) goto corrupt;
+            v = prev[i & 1] + ((z >> 1) ^ -(z & 1));
+        } else
+        {
+            goto corrupt;
+        }
+        prev[i & 1] = v;
+
+        if ((i & 1 ? ps_add_space(ps, v) : ps_add_pulse(ps, v))) return -1;
+    }
+
+    return 0;
+
+corrupt:
+    ERR("Packed code is corrupt\n");
+    ps_reset(ps);
+    return -1;
+}
+
+UInt32
+pk_from_rp(rp_ctx *rp, UInt8 *d, UInt32 max)
+{
+    return pk_encode(&rp->ps, 1 << 24, rp->freq, d, max);
+}
+
+UInt32
+pk_from_rr2(rr2_ctx *rr2, UInt8 *d, UInt32 max)
+{
+    return pk_encode(&rr2->ps, rr2->cycle_scale, rr2->calc_freq, d, max);
+}
+
+UInt32
+pk_from_pronto(UInt8 *pronto, UInt32 len, UInt8 *d, UInt32 max)
+{
+    rp_ctx rp;
+    UInt32 n;
+
+    bzero(&rp, sizeof(rp));
+    rp_parse(&rp, len, pronto);
+    n = pk_from_rp(&rp, d, max);
+    rp_deinit(&rp);
+
+    return n;
+}
+
+// rp starts out zeroed or as left by an earlier parse, like rp_init() wants
+int
+pk_to_rp(rp_ctx *rp, UInt8 *d, UInt32 len)
+{
+    rp->repeat_count = 1;
+    rp->interspace = 0;
+
+    return pk_decode(&rp->ps, &rp->freq, d, len);
+}
+
+// Learned Pronto, as rr2_output_pronto() writes it. Returns the length, 0 if
+// the code is corrupt or doesn't fit max.
+UInt32
+pk_to_pronto(UInt8 *d, UInt32 len, UInt8 *pronto, UInt32 max)
+{
+    pstore ps;
+    UInt32 freq, nof, n, i, t;
+
+    bzero(&ps, sizeof(ps));
+    n = 0;
+
+    if (pk_decode(&ps, &freq, d, len)  ||  !freq) goto out;
+
+    nof = ps.nof_pulses + ps.nof_spaces;
+    if (8 + 2 * (nof + 1) > max) goto out;
+
+    pronto[n++] = 0;
+    pronto[n++] = 0; // learned command
+    t = 4145146 / freq;
+    pronto[n++] = t >> 8;
+    pronto[n++] = t & 0xff; // frequency
+    pronto[n++] = 0;
+    pronto[n++] = 0; // once burst-pair count
+    pronto[n++] = ps.nof_pulses >> 8;
+    pronto[n++] = ps.nof_pulses & 0xff; // repeat burst-pair count
+
+    for (i = 0; i < nof; i++)
+    {
+        t = ps_get(&ps, i);
+        if (t > 0xffff) t = 0xffff;
+        pronto[n++] = t >> 8;
+        pronto[n++] = t & 0xff;
+    }
+
+    // A code learned from RAW2 has no trailing space, add the 10ms the
+    // USB-UIRT takes as the end of a code
+    if (nof & 1)
+    {
+        t = freq / 100;
+        pronto[n++] = t >> 8;
+        pronto[n++] = t & 0xff;
+    }
+
+out:
+    ps_free(&ps);
+
+    return n;
+}
+
+// TX_RAW without the checksum, as usm_process_user() makes of Pronto. Returns
+// the length, 0 if the code is corrupt or doesn't fit max.
+UInt32
+pk_to_tx_raw(UInt8 *d, UInt32 len, UInt8 repeat_count, UInt8 *tx, UInt32 max)
+{
+    rp_ctx rp;
+    UInt32 n;
+
+    bzero(&rp, sizeof(rp));
+    n = 0;
+
+    if (pk_to_rp(&rp, d, len)  ||  !rp.freq) goto out;
+
+    if (RP_OUTPUT_MAX(&rp) > max)
+    {
+        ERR("%u pulses don't fit a transmit\n", (unsigned)rp.ps.nof_pulses);
+        goto out;
+    }
+
+    rp.repeat_count = repeat_count;
+    n = rp_output(&rp, tx);
+
+out:
+    rp_deinit(&rp);
+
+    return n;
+}
+
+// Cluster the durations into classes PK_TOL wide, keeping the PK_CLASS_MAX
+// most used ones in ascending order. Durations nothing else is close to are
+// left to escape.
+UInt32
+pk_classify(UInt32 *t, UInt32 n, pk_class *c)
+{
+    pk_class cur, all[PK_CLASS_MAX];
+    UInt32 *s, i, j, k, m;
+    UInt64 sum;
+
+    s = t + n + 1;
+    bcopy(t, s, n * sizeof(*t));
+    qsort(s, n, sizeof(*s), pk_cmp);
+
+    k = 0;
+    for (i = 0; i < n; i = j)
+    {
+        sum = 0;
+        for (j = i; j < n  &&  s[j] <= s[i] + PK_TOL(s[i]); j++)
+        {
+            sum += s[j];
+        }
+        if (j - i < 2) continue;
+
+        cur.lo = s[i];
+        cur.hi = s[j - 1];
+        cur.count = j - i;
+        cur.t = (sum + cur.count / 2) / cur.count;
+
+        // by count, once full the least used falls off the end
+        if (k < PK_CLASS_MAX)
+        {
+            k++;
+        } else if (all[k - 1].count >= cur.count)
+        {
+            continue;
+        }
+
+        for (m = k - 1; m  &&  all[m - 1].count < cur.count; m--)
+        {
+            all[m] = all[m - 1];
+        }
+        all[m] = cur;
+    }
+
+    // back in ascending order for the encoder's search
+    for (i = 0; i < k; i++)
+    {
+        c[i] = all[i];
+    }
+    qsort(c, k, sizeof(*c), pk_cmp);
+
+    return k;
+}
+
+// pk_class starts with lo, so this sorts both
+int
+pk_cmp(const void *a, const void *b)
+{
+    UInt32 x, y;
+
+    x = *(const UInt32 *)a;
+    y = *(const UInt32 *)b;
+
+    return (x > y) - (x < y);
+}
+
+UInt32
+pk_put(UInt8 *d, UInt32 v)
+{
+    UInt32 n;
+
+    for (n = 0; v >= 0x80; v >>= 7)
+    {
+        d[n++] = 0x80 | (v & 0x7f);
+    }
+    d[n++] = v;
+
+    return n;
+}
+
+// Read a varint at *n, returns 0 if it runs past len
+UInt32
+pk_get(UInt8 *d, UInt32 len, UInt32 *n, UInt32 *v)
+{
+    UInt32 shift, b;
+
+    *v = 0;
+    for (shift = 0; *n < len  &&  shift < 35; shift += 7)
+    {
+        b = d[(*n)++];
+        *v |= (b & 0x7f) << shift;
+        if (!(b & 0x80)) return 1;
+    }
+
+    return 0;
+}
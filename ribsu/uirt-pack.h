@@ -0,0 +1,46 @@
+/* Copyright (C) 2007 xyster.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+
+#ifndef __UIRT_PACK_H
+#define __UIRT_PACK_H
+
+#include "uirt-raw2.h"
+#include "uirt-pronto.h"
+
+/* Compact form of a code for storing and exchanging libraries. A remote
+ * uses a handful of distinct durations, so every duration becomes a few bit
+ * index into a dictionary of duration classes, and the odd one that fits no
+ * class is sent as a varint delta from the previous one of its kind:
+ *
+ *   varint freq (Hz), varint durations, UInt8 classes
+ *   classes varints, ascending class durations delta coded
+ *   durations symbols of log2(classes + 1) bits, LSB first, the last
+ *     symbol means escape
+ *   escapes varints, zigzag delta from the previous pulse or space
+ *
+ * Durations are carrier cycles, pulse first and alternating, the same as
+ * Pronto. Durations within PK_TOL of a class come back as its mean, which
+ * receivers can't tell apart. A NEC code packs into about 30 bytes against
+ * 288 characters of Pronto hex.
+ */
+
+#define PK_CLASS_MAX (15)                // classes of a code
+#define PK_TOL(t)    ((t) / 16 + 1)      // cycles a class spans from its shortest
+#define PK_MAX(n)    (86 + 6 * (n))      // worst case bytes for n durations
+
+UInt32 pk_encode(pstore *ps, UInt32 scale, UInt32 freq, UInt8 *d, UInt32 max);
+int    pk_decode(pstore *ps, UInt32 *freq, UInt8 *d, UInt32 len);
+
+UInt32 pk_from_rp(rp_ctx *rp, UInt8 *d, UInt32 max);
+UInt32 pk_from_rr2(rr2_ctx *rr2, UInt8 *d, UInt32 max);
+UInt32 pk_from_pronto(UInt8 *pronto, UInt32 len, UInt8 *d, UInt32 max);
+int    pk_to_rp(rp_ctx *rp, UInt8 *d, UInt32 len);
+UInt32 pk_to_pronto(UInt8 *d, UInt32 len, UInt8 *pronto, UInt32 max);
+UInt32 pk_to_tx_raw(UInt8 *d, UInt32 len, UInt8 repeat_count, UInt8 *tx, UInt32 max);
+
+#endif
@@ -6,7 +6,7 @@
  */
 
 
-#include <CoreFoundation/CoreFoundation.h>
+#include "platform.h"
 #include "debug.h"
 #include "ribsu-util.h"
 #include "uirt-pronto.h"
@@ -82,7 +82,7 @@ rp_output(rp_ctx *ctx, UInt8 *d)
     
     d[n++] = UIRT_CMD_TX_RAW; // RAW command
     
-    d[n++] = 6 + (UInt8)(ctx->nof_pulses + ctx->nof_spaces); // RAW command length
+    d[n++] = 6 + (UInt8)(ctx->ps.nof_pulses + ctx->ps.nof_spaces); // RAW command length
     
     d[n++] = v; // frequency
     
@@ -91,17 +91,17 @@ rp_output(rp_ctx *ctx, UInt8 *d)
     d[n++] = (UInt8)(ctx->interspace >> 8); // interspace hi
     d[n++] = (UInt8)(ctx->interspace & 0xff); // interspace low
     
-    d[n++] = (UInt8)(ctx->nof_pulses + ctx->nof_spaces); 
+    d[n++] = (UInt8)(ctx->ps.nof_pulses + ctx->ps.nof_spaces); 
     
-    nof_pulses = ctx->nof_pulses;
-    nof_spaces = ctx->nof_spaces;
+    nof_pulses = ctx->ps.nof_pulses;
+    nof_spaces = ctx->ps.nof_spaces;
     nof_fudge = 0;
     
     while (nof_pulses  ||  nof_spaces)
     {
         if (nof_pulses)
         {
-            t = ctx->pulse[ctx->nof_pulses - nof_pulses];
+            t = PS_PULSE(&ctx->ps, ctx->ps.nof_pulses - nof_pulses);
             if (t >= 0x80)
             {
                 d[n++] = 0x80 | (t >> 8);
@@ -116,7 +116,7 @@ rp_output(rp_ctx *ctx, UInt8 *d)
         
         if (nof_spaces)
         {
-            t = ctx->space[ctx->nof_spaces - nof_spaces];
+            t = PS_SPACE(&ctx->ps, ctx->ps.nof_spaces - nof_spaces);
             if (t >= 0x80)
             {
                 d[n++] = 0x80 | (t >> 8);
@@ -131,6 +131,13 @@ rp_output(rp_ctx *ctx, UInt8 *d)
         }
     }
     
+    // both length bytes have to hold it, with two bytes for a long duration
+    if (n - sizeof(uirt_tx_cmd) > UIRT_TX_RAW_DATA_MAX)
+    {
+        ERR("%u bytes of durations don't fit a transmit\n", (unsigned)(n - sizeof(uirt_tx_cmd)));
+        return 0;
+    }
+    
     DMP("d[1] = %02X, d[6] = %02X, nof_fudge = %02X\n", d[1], d[6], (int)nof_fudge);
     d[1] += nof_fudge; // redo the length to take fudge into account
     d[6] += nof_fudge; 
@@ -142,8 +149,13 @@ UInt32
 rp_init(rp_ctx *ctx, UInt8 *d)
 {
     UInt32 n, f;
+    pstore ps;
     
+    // everything starts over except the pulse arena
+    ps = ctx->ps;
     bzero(ctx, sizeof(*ctx));
+    ctx->ps = ps;
+    ps_reset(&ctx->ps);
     
     ctx->interspace = 0;
     ctx->repeat_count = 1;
@@ -167,6 +179,12 @@ rp_init(rp_ctx *ctx, UInt8 *d)
     return n;
 }
 
+void
+rp_deinit(rp_ctx *ctx)
+{
+    ps_free(&ctx->ps);
+}
+
 // PhPl
 UInt32
 rp_pulse(rp_ctx *ctx, UInt8 *d)
@@ -180,7 +198,7 @@ rp_pulse(rp_ctx *ctx, UInt8 *d)
     p |= (UInt32)d[n++];
     
     // record the pulse
-    ctx->pulse[ctx->nof_pulses++] = p;
+    ps_add_pulse(&ctx->ps, p);
     
    DBG("pulse = %02X\n", (unsigned)p);
     
@@ -200,7 +218,7 @@ rp_space(rp_ctx *ctx, UInt8 *d)
     s |= (UInt32)d[n++];
     
     // record the space
-    ctx->space[ctx->nof_spaces++] = s;
+    ps_add_space(&ctx->ps, s);
   
     DBG("space = %02X\n", (unsigned)s);
     
@@ -9,22 +9,22 @@
 #ifndef __UIRT_PRONTO_H
 #define __UIRT_PRONTO_H
 
-#define RP_MAX_PULSES 128
-
 typedef struct rp_ctx
 {
     UInt8 repeat_count;
     UInt32 interspace; // interspace in 50us (pulled from thin air)
     UInt32 freq; 
-    UInt32 nof_pulses;
-    UInt32 pulse[RP_MAX_PULSES]; // pulse times in carrier cycles
-    UInt32 nof_spaces;
-    UInt32 space[RP_MAX_PULSES]; // space times in carrier cycles
+    pstore ps; // pulse and space times in carrier cycles
 } rp_ctx;
 
+// most bytes rp_output() writes for ctx, with every duration taking 2 bytes
+#define RP_OUTPUT_MAX(ctx) (7 + 2 * ((ctx)->ps.nof_pulses + (ctx)->ps.nof_spaces))
+
 int rp_parse(rp_ctx *ctx, UInt32 len, UInt8 *d);
+// TX_RAW without the checksum, 0 if the code is too long for the device
 UInt32 rp_output(rp_ctx *ctx, UInt8 *d); 
-UInt32 rp_init(rp_ctx *ctx, UInt8 *d);
+UInt32 rp_init(rp_ctx *ctx, UInt8 *d); // ctx must start out zeroed
+void rp_deinit(rp_ctx *ctx);
 UInt32 rp_pulse(rp_ctx *ctx, UInt8 *d);
 UInt32 rp_space(rp_ctx *ctx, UInt8 *d);
 
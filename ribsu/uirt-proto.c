@@ -0,0 +1,629 @@
+/* Copyright (C) 2007 xyster.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "platform.h"
+#include "debug.h"
+#include "ribsu-util.h"
+#include "uirt.h"
+#include "uirt-proto.h"
+
+#define MODULE_NAME uirt_proto
+DBG_MODULE_DEFINE();
+
+// Durations are compared in ns against nominal values in us, with the 25%
+// slack receivers need. The bounds fold into constants, so matching is a
+// pair of compares and no division.
+#define UP_MATCH(t, us) ((t) >= (UInt32)(us) * 750  &&  (t) <= (UInt32)(us) * 1250)
+
+#define UP_T(ps, i, unit) (ps_get((ps), (i)) * (unit))
+#define UP_P(ps, i, unit) UP_T(ps, 2 * (i), unit)     // pulse i in ns
+#define UP_S(ps, i, unit) UP_T(ps, 2 * (i) + 1, unit) // space i in ns
+
+// half bits of a biphase code, a few spare for sloppy trailers
+#define UP_HALVES_MAX 64
+
+typedef struct up_timing
+{
+    UInt32 proto;
+    UInt32 lead_pulse; // us
+    UInt32 lead_space;
+    UInt32 nbits;
+    UInt32 mark;       // pulse in front of every bit
+    UInt32 zero;       // space of a 0
+    UInt32 one;        // space of a 1
+} up_timing;
+
+// Pulse distance protocols, all LSB first with a stop pulse
+static const up_timing up_nec     = { UP_PROTO_NEC,     9000, 4500, 32, 560, 560, 1690 };
+static const up_timing up_samsung = { UP_PROTO_SAMSUNG, 4500, 4500, 32, 560, 560, 1690 };
+static const up_timing up_jvc     = { UP_PROTO_JVC,     8400, 4200, 16, 526, 526, 1574 };
+
+static int up_distance(const up_timing *tm, pstore *ps, UInt32 unit, UInt32 first, UInt32 *bits);
+static int up_try_nec(up_ctx *ctx, pstore *ps, UInt32 unit, up_code *code);
+static int up_try_samsung(pstore *ps, UInt32 unit, up_code *code);
+static int up_try_jvc(pstore *ps, UInt32 unit, int cont, up_code *code);
+static int up_try_sirc(pstore *ps, UInt32 unit, up_code *code);
+static int up_try_rc5(pstore *ps, UInt32 unit, up_code *code);
+static int up_try_rc6(pstore *ps, UInt32 unit, up_code *code);
+static int up_halves(pstore *ps, UInt32 unit, UInt32 first, UInt32 half, UInt32 max,
+                     UInt8 *lv, UInt32 *n);
+
+void
+up_init(up_ctx *ctx)
+{
+    bzero(ctx, sizeof(*ctx));
+}
+
+// Decode a frame of durations in units of unit_ns. cont is set when the
+// frame followed the previous one without an interspace, i.e. the remote
+// kept sending. Returns 0 and fills in code on a match, -1 otherwise.
+int
+up_decode(up_ctx *ctx, pstore *ps, UInt32 unit_ns, int cont, up_code *code)
+{
+    UInt32 p0, s0;
+    int ret;
+
+    bzero(code, sizeof(*code));
+
+    if (ps->nof_pulses < 2  ||  !ps->nof_spaces) goto none;
+
+    p0 = UP_P(ps, 0, unit_ns);
+    s0 = UP_S(ps, 0, unit_ns);
+
+    // the leader narrows it down to one or two candidates
+    if (UP_MATCH(p0, 9000))
+    {
+        ret = up_try_nec(ctx, ps, unit_ns, code);
+        if (ret) ret = up_try_jvc(ps, unit_ns, cont, code);
+    } else if (UP_MATCH(p0, 4500))
+    {
+        ret = up_try_samsung(ps, unit_ns, code);
+    } else if (UP_MATCH(p0, 2400)  &&  UP_MATCH(s0, 600))
+    {
+        ret = up_try_sirc(ps, unit_ns, code);
+    } else if (UP_MATCH(p0, 2666))
+    {
+        ret = up_try_rc6(ps, unit_ns, code);
+    } else if (p0 < 2400 * 1000)
+    {
+        // no leader at all, biphase RC5 or a JVC repeat
+        ret = up_try_rc5(ps, unit_ns, code);
+        if (ret) ret = up_try_jvc(ps, unit_ns, cont, code);
+    } else
+    {
+        ret = -1;
+    }
+
+    if (ret) goto none;
+
+    // anything sent again within the same transmission is a held button
+    if (cont  &&  !code->repeat  &&  ctx->last.proto == code->proto  &&
+        ctx->last.address == code->address  &&  ctx->last.command == code->command)
+    {
+        code->repeat = 1;
+    }
+
+    ctx->last = *code;
+
+    DBG("%s address %X command %X bits %u%s\n", up_proto_name(code->proto),
+        (unsigned)code->address, (unsigned)code->command, (unsigned)code->bits,
+        code->repeat ? " repeat" : "");
+
+    return 0;
+
+none:
+    // whatever came before is no longer being repeated
+    bzero(&ctx->last, sizeof(ctx->last));
+
+    return -1;
+}
+
+int
+up_decode_rr(up_ctx *ctx, rr_ctx *rr, up_code *code)
+{
+    return up_decode(ctx, &rr->ps, 50000, rr->cont, code); // 50us
+}
+
+int
+up_decode_rr2(up_ctx *ctx, rr2_ctx *rr2, up_code *code)
+{
+    // a carrier all over the place is noise, not a remote
+    if (rr2->freq_conf < RR2_FREQ_CONF_MIN)
+    {
+        bzero(code, sizeof(*code));
+        bzero(&ctx->last, sizeof(ctx->last));
+        return -1;
+    }
+
+    return up_decode(ctx, &rr2->ps, 400, rr2->cont, code); // 400ns
+}
+
+const char *
+up_proto_name(UInt32 proto)
+{
+    switch (proto)
+    {
+        case UP_PROTO_NEC:
+            return "NEC";
+        case UP_PROTO_RC5:
+            return "RC5";
+        case UP_PROTO_RC6:
+            return "RC6";
+        case UP_PROTO_SIRC:
+            return "SIRC";
+        case UP_PROTO_SAMSUNG:
+            return "Samsung";
+        case UP_PROTO_JVC:
+            return "JVC";
+        default:
+            return "none";
+    }
+}
+
+// Read nbits pulse distance bits starting at pulse first, then the stop pulse
+int
+up_distance(const up_timing *tm, pstore *ps, UInt32 unit, UInt32 first, UInt32 *bits)
+{
+    UInt32 i, s, v;
+
+    if (ps->nof_pulses != first + tm->nbits + 1) return -1;
+
+    v = 0;
+    for (i = 0; i < tm->nbits; i++)
+    {
+        if (!UP_MATCH(UP_P(ps, first + i, unit), tm->mark)) return -1;
+
+        s = UP_S(ps, first + i, unit);
+        if (UP_MATCH(s, tm->one))
+        {
+            v |= (UInt32)1 << i;
+        } else if (!UP_MATCH(s, tm->zero))
+        {
+            return -1;
+        }
+    }
+
+    if (!UP_MATCH(UP_P(ps, first + i, unit), tm->mark)) return -1;
+
+    *bits = v;
+
+    return 0;
+}
+
+int
+up_try_nec(up_ctx *ctx, pstore *ps, UInt32 unit, up_code *code)
+{
+    UInt32 v;
+
+    // 9ms, 2.25ms and a stop pulse repeat whatever was sent last
+    if (ps->nof_pulses == 2  &&  UP_MATCH(UP_S(ps, 0, unit), 2250))
+    {
+        if (ctx->last.proto != UP_PROTO_NEC) return -1;
+
+        *code = ctx->last;
+        code->repeat = 1;
+        return 0;
+    }
+
+    if (!UP_MATCH(UP_S(ps, 0, unit), up_nec.lead_space)) return -1;
+    if (up_distance(&up_nec, ps, unit, 1, &v)) return -1;
+
+    // the command is always sent with its complement
+    if ((((v >> 16) ^ (v >> 24)) & 0xff) != 0xff) return -1;
+
+    code->proto = UP_PROTO_NEC;
+    code->command = (v >> 16) & 0xff;
+    code->bits = 32;
+
+    // extended NEC uses the address complement as 8 more address bits
+    if (((v ^ (v >> 8)) & 0xff) != 0xff)
+    {
+        code->address = v & 0xffff;
+    } else
+    {
+        code->address = v & 0xff;
+    }
+
+    return 0;
+}
+
+int
+up_try_samsung(pstore *ps, UInt32 unit, up_code *code)
+{
+    UInt32 v;
+
+    if (!UP_MATCH(UP_S(ps, 0, unit), up_samsung.lead_space)) return -1;
+    if (up_distance(&up_samsung, ps, unit, 1, &v)) return -1;
+
+    if ((((v >> 16) ^ (v >> 24)) & 0xff) != 0xff) return -1;
+
+    code->proto = UP_PROTO_SAMSUNG;
+    code->command = (v >> 16) & 0xff;
+    code->bits = 32;
+
+    // the address byte is normally sent twice
+    if ((v ^ (v >> 8)) & 0xff)
+    {
+        code->address = v & 0xffff;
+    } else
+    {
+        code->address = v & 0xff;
+    }
+
+    return 0;
+}
+
+int
+up_try_jvc(pstore *ps, UInt32 unit, int cont, up_code *code)
+{
+    UInt32 v, first;
+
+    // repeats are sent without the leader
+    first = UP_MATCH(UP_P(ps, 0, unit), up_jvc.lead_pulse) ? 1 : 0;
+    if (first  &&  !UP_MATCH(UP_S(ps, 0, unit), up_jvc.lead_space)) return -1;
+
+    if (up_distance(&up_jvc, ps, unit, first, &v)) return -1;
+
+    code->proto = UP_PROTO_JVC;
+    code->address = v & 0xff;
+    code->command = (v >> 8) & 0xff;
+    code->bits = 16;
+    code->repeat = !first  &&  cont;
+
+    return 0;
+}
+
+// Pulse width: 1.2ms pulses are ones, 600us zeroes, 12, 15 or 20 bits LSB
+// first. There is no stop pulse, the last space is the end of the frame.
+int
+up_try_sirc(pstore *ps, UInt32 unit, up_code *code)
+{
+    UInt32 i, n, p, v;
+
+    n = ps->nof_pulses - 1;
+    if (n != 12  &&  n != 15  &&  n != 20) return -1;
+
+    v = 0;
+    for (i = 0; i < n; i++)
+    {
+        p = UP_P(ps, i + 1, unit);
+        if (UP_MATCH(p, 1200))
+        {
+            v |= (UInt32)1 << i;
+        } else if (!UP_MATCH(p, 600))
+        {
+            return -1;
+        }
+
+        if (i + 1 < ps->nof_spaces  &&  !UP_MATCH(UP_S(ps, i + 1, unit), 600)) return -1;
+    }
+
+    code->proto = UP_PROTO_SIRC;
+    code->command = v & 0x7f;
+    code->address = v >> 7;
+    code->bits = n;
+
+    return 0;
+}
+
+// Expand pulses and spaces from pulse first on into a level per half bit.
+// Each element has to be a whole number (up to max) of half bit times.
+int
+up_halves(pstore *ps, UInt32 unit, UInt32 first, UInt32 half, UInt32 max,
+          UInt8 *lv, UInt32 *n)
+{
+    UInt32 i, e, k, t, nof;
+
+    nof = ps->nof_pulses + ps->nof_spaces;
+
+    for (e = 2 * first; e < nof; e++)
+    {
+        t = UP_T(ps, e, unit);
+
+        // round to the nearest number of halves
+        for (k = 1; k <= max; k++)
+        {
+            if (t < half * (1000 * k + 500)) break;
+        }
+        if (k > max  ||  t < half * 500) return -1;
+
+        if (*n + k > UP_HALVES_MAX) return -1;
+        for (i = 0; i < k; i++)
+        {
+            lv[(*n)++] = (e & 1) ? 0 : 1;
+        }
+    }
+
+    // a trailing space merges into the end of frame gap
+    if (*n < UP_HALVES_MAX) lv[(*n)++] = 0;
+
+    return 0;
+}
+
+// Biphase at 889us: a 1 is space then pulse. 2 start bits, toggle, 5 bit
+// address, 6 bit command, the second start bit doubles as command bit 6.
+int
+up_try_rc5(pstore *ps, UInt32 unit, up_code *code)
+{
+    UInt8 lv[UP_HALVES_MAX];
+    UInt32 n, i, v;
+
+    if (ps->nof_pulses < 7  ||  ps->nof_pulses > 14) return -1;
+
+    // the first half of the leading 1 is indistinguishable from idle
+    lv[0] = 0;
+    n = 1;
+    if (up_halves(ps, unit, 0, 889, 2, lv, &n)  ||  n < 28) return -1;
+
+    v = 0;
+    for (i = 0; i < 14; i++)
+    {
+        if (lv[2 * i] == lv[2 * i + 1]) return -1;
+        v = (v << 1) | lv[2 * i + 1];
+    }
+
+    if (!(v & 0x2000)) return -1;
+
+    code->proto = UP_PROTO_RC5;
+    code->address = (v >> 6) & 0x1f;
+    code->command = (v & 0x3f) | ((v & 0x1000) ? 0 : 0x40);
+    code->bits = 14;
+    code->toggle = (v >> 11) & 1;
+
+    return 0;
+}
+
+// Mode 0: 2.666ms leader, then biphase at 444us where a 1 is pulse then
+// space. Start bit, 3 mode bits, a double length toggle, 8 bit address and
+// 8 bit command.
+int
+up_try_rc6(pstore *ps, UInt32 unit, up_code *code)
+{
+    UInt8 lv[UP_HALVES_MAX];
+    UInt32 n, i, v;
+
+    if (!UP_MATCH(UP_S(ps, 0, unit), 889)) return -1;
+    if (ps->nof_pulses < 10  ||  ps->nof_pulses > 24) return -1;
+
+    n = 0;
+    if (up_halves(ps, unit, 1, 444, 3, lv, &n)  ||  n < 44) return -1;
+
+    // start bit and mode 000
+    if (!lv[0]  ||  lv[1]) return -1;
+    for (i = 1; i < 4; i++)
+    {
+        if (lv[2 * i]  ||  !lv[2 * i + 1]) return -1;
+    }
+
+    // the toggle takes twice the time
+    if (lv[8] != lv[9]  ||  lv[10] != lv[11]  ||  lv[8] == lv[10]) return -1;
+
+    v = 0;
+    for (i = 6; i < 22; i++)
+    {
+        if (lv[2 * i] == lv[2 * i + 1]) return -1;
+        v = (v << 1) | lv[2 * i];
+    }
+
+    code->proto = UP_PROTO_RC6;
+    code->address = v >> 8;
+    code->command = v & 0xff;
+    code->bits = 16;
+    code->toggle = lv[8];
+
+    return 0;
+}
+
+// Encoding
+
+typedef struct up_carrier
+{
+    UInt32 khz;    // carrier
+    UInt32 period; // us from the start of one frame to the start of the next
+} up_carrier;
+
+// indexed by UP_PROTO_*
+static const up_carrier up_carriers[] = {
+    {  0,      0 },
+    { 38, 108000 }, // NEC
+    { 36, 113792 }, // RC5
+    { 36, 106667 }, // RC6
+    { 40,  45000 }, // SIRC
+    { 38, 108000 }, // Samsung
+    { 38,  60000 }, // JVC
+};
+
+typedef struct up_enc
+{
+    UInt8 *d;
+    UInt32 n, max;
+    UInt32 khz;
+    int    level; // of the element being built up, -1 before the first
+    UInt32 acc;   // its length so far in us
+    UInt32 total; // us of everything flushed
+    int    error;
+} up_enc;
+
+static void up_enc_flush(up_enc *e);
+static void up_enc_add(up_enc *e, int level, UInt32 us);
+static void up_enc_distance(up_enc *e, const up_timing *tm, UInt32 v, int leader);
+static void up_enc_biphase(up_enc *e, UInt32 v, UInt32 nbits, UInt32 half, int one_first);
+
+// Write the USB-UIRT TX_RAW command (sans checksum) for code straight into d.
+// Durations are in carrier cycles as the device wants them, the interspace
+// pads every frame out to the protocol's repeat period. Returns the number
+// of bytes written, 0 if the code can't be sent.
+UInt32
+up_encode(up_code *code, UInt8 repeat_count, UInt8 *d, UInt32 max)
+{
+    up_enc e;
+    uirt_tx_cmd *cmd;
+    UInt32 i, v, nbits, interspace;
+
+    if (!code->proto  ||  code->proto >= sizeof(up_carriers) / sizeof(up_carriers[0])) return 0;
+    if (max < sizeof(*cmd)) return 0;
+
+    bzero(&e, sizeof(e));
+    e.d = d + sizeof(*cmd);
+    e.max = max - sizeof(*cmd);
+    if (e.max > UIRT_TX_RAW_DATA_MAX) e.max = UIRT_TX_RAW_DATA_MAX; // both length bytes have to hold it
+    e.khz = up_carriers[code->proto].khz;
+    e.level = -1;
+
+    switch (code->proto)
+    {
+        case UP_PROTO_NEC:
+            v = code->address & 0xffff;
+            if (v <= 0xff) v |= (~v & 0xff) << 8;
+            v |= (code->command & 0xff) << 16;
+            v |= (~code->command & 0xff) << 24;
+            up_enc_distance(&e, &up_nec, v, 1);
+            break;
+        case UP_PROTO_SAMSUNG:
+            v = code->address & 0xffff;
+            if (v <= 0xff) v |= v << 8;
+            v |= (code->command & 0xff) << 16;
+            v |= (~code->command & 0xff) << 24;
+            up_enc_distance(&e, &up_samsung, v, 1);
+            break;
+        case UP_PROTO_JVC:
+            v = (code->address & 0xff) | (code->command & 0xff) << 8;
+            up_enc_distance(&e, &up_jvc, v, 1);
+            break;
+        case UP_PROTO_SIRC:
+            nbits = code->bits;
+            if (nbits != 12  &&  nbits != 15  &&  nbits != 20)
+            {
+                nbits = (code->address > 0xff ? 20 : code->address > 0x1f ? 15 : 12);
+            }
+            v = (code->command & 0x7f) | code->address << 7;
+            up_enc_add(&e, 1, 2400);
+            for (i = 0; i < nbits; i++)
+            {
+                up_enc_add(&e, 0, 600);
+                up_enc_add(&e, 1, (v >> i) & 1 ? 1200 : 600);
+            }
+            break;
+        case UP_PROTO_RC5:
+            v = 0x2000 | ((code->command & 0x40) ? 0 : 0x1000);
+            v |= (code->toggle & 1) << 11;
+            v |= (code->address & 0x1f) << 6;
+            v |= code->command & 0x3f;
+            up_enc_biphase(&e, v, 14, 889, 0);
+            break;
+        case UP_PROTO_RC6:
+            up_enc_add(&e, 1, 2666);
+            up_enc_add(&e, 0, 889);
+            up_enc_biphase(&e, 0x8, 4, 444, 1); // start bit, mode 0
+            up_enc_biphase(&e, code->toggle & 1, 1, 889, 1);
+            v = (code->address & 0xff) << 8 | (code->command & 0xff);
+            up_enc_biphase(&e, v, 16, 444, 1);
+            break;
+    }
+
+    // a frame ends with a pulse, the interspace takes care of the rest
+    if (e.level == 1) up_enc_flush(&e);
+
+    if (e.error  ||  !e.n)
+    {
+        ERR("%s code doesn't fit a transmit\n", up_proto_name(code->proto));
+        return 0;
+    }
+
+    interspace = up_carriers[code->proto].period;
+    interspace = (interspace > e.total ? interspace - e.total : 0) / 50;
+
+    cmd = (uirt_tx_cmd *)d;
+    cmd->op = UIRT_CMD_TX_RAW;
+    cmd->len = 6 + e.n;
+    cmd->freq = 2500 / e.khz;
+    cmd->repeat_count = repeat_count;
+    d[4] = (UInt8)(interspace >> 8); // big endian
+    d[5] = (UInt8)(interspace & 0xff);
+    cmd->data_len = e.n;
+
+    return sizeof(*cmd) + e.n;
+}
+
+// Write out the element built up so far, one byte or two with the top bit
+// set, like rp_output() does
+void
+up_enc_flush(up_enc *e)
+{
+    UInt32 t;
+
+    // leading silence is the interspace's business
+    if (e->level == 1  ||  e->n)
+    {
+        t = (e->acc * e->khz + 500) / 1000;
+        if (t > 0x7fff) t = 0x7fff;
+
+        if (e->n + 2 > e->max)
+        {
+            e->error = 1;
+        } else if (t >= 0x80)
+        {
+            e->d[e->n++] = 0x80 | (t >> 8);
+            e->d[e->n++] = t & 0xff;
+        } else
+        {
+            e->d[e->n++] = t;
+        }
+
+        e->total += e->acc;
+    }
+
+    e->acc = 0;
+}
+
+// Runs of the same level merge into one element
+void
+up_enc_add(up_enc *e, int level, UInt32 us)
+{
+    if (level != e->level)
+    {
+        if (e->level >= 0) up_enc_flush(e);
+        e->level = level;
+    }
+
+    e->acc += us;
+}
+
+void
+up_enc_distance(up_enc *e, const up_timing *tm, UInt32 v, int leader)
+{
+    UInt32 i;
+
+    if (leader)
+    {
+        up_enc_add(e, 1, tm->lead_pulse);
+        up_enc_add(e, 0, tm->lead_space);
+    }
+
+    for (i = 0; i < tm->nbits; i++)
+    {
+        up_enc_add(e, 1, tm->mark);
+        up_enc_add(e, 0, (v >> i) & 1 ? tm->one : tm->zero);
+    }
+
+    up_enc_add(e, 1, tm->mark); // stop
+}
+
+// nbits of v MSB first, one_first says whether a 1 is pulse then space (RC6)
+// or space then pulse (RC5)
+void
+up_enc_biphase(up_enc *e, UInt32 v, UInt32 nbits, UInt32 half, int one_first)
+{
+    int b;
+
+    while (nbits--)
+    {
+        b = (v >> nbits) & 1;
+        up_enc_add(e, one_first ? b : !b, half);
+        up_enc_add(e, one_first ? !b : b, half);
+    }
+}
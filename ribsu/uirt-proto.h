@@ -0,0 +1,52 @@
+/* Copyright (C) 2007 xyster.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+
+#ifndef __UIRT_PROTO_H
+#define __UIRT_PROTO_H
+
+#include "uirt-raw.h"
+#include "uirt-raw2.h"
+
+/* Decoder bank for the common consumer IR protocols. It runs straight on
+ * the pulse/space store of a received frame and names the button without a
+ * detour through Pronto. The encoders go the other way, from a code to the
+ * TX_RAW bytes the device transmits.
+ */
+
+#define UP_PROTO_NONE    (0)
+#define UP_PROTO_NEC     (1)
+#define UP_PROTO_RC5     (2)
+#define UP_PROTO_RC6     (3)
+#define UP_PROTO_SIRC    (4)
+#define UP_PROTO_SAMSUNG (5)
+#define UP_PROTO_JVC     (6)
+
+typedef struct up_code
+{
+    UInt32 proto;   // UP_PROTO_*
+    UInt32 address; // device, 16 bit for extended NEC, 13 bit for 20 bit SIRC
+    UInt32 command;
+    UInt32 bits;    // payload length as sent
+    UInt32 toggle;  // RC5/RC6 toggle bit, flips with every new press
+    int    repeat;  // the button is being held, not pressed again
+} up_code;
+
+// Repeat detection needs the previous code of the same transmission
+typedef struct up_ctx
+{
+    up_code last;
+} up_ctx;
+
+void up_init(up_ctx *ctx);
+int  up_decode(up_ctx *ctx, pstore *ps, UInt32 unit_ns, int cont, up_code *code);
+int  up_decode_rr(up_ctx *ctx, rr_ctx *rr, up_code *code);
+int  up_decode_rr2(up_ctx *ctx, rr2_ctx *rr2, up_code *code);
+UInt32 up_encode(up_code *code, UInt8 repeat_count, UInt8 *d, UInt32 max);
+const char *up_proto_name(UInt32 proto);
+
+#endif
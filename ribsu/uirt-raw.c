@@ -5,7 +5,7 @@
  * published by the Free Software Foundation.
  */
 
-#include <CoreFoundation/CoreFoundation.h>
+#include "platform.h"
 #include "debug.h"
 #include "ribsu-util.h"
 #include "uirt.h"
@@ -16,79 +16,75 @@ DBG_MODULE_DEFINE();
 
 enum {
     DDS_INIT,
+    DDS_INIT_PULSE, // new frame that starts without an interspace
     DDS_INTERSPACE,
     DDS_PULSE,
     DDS_SPACE
 };
 
+// longest single element (the interspace)
+#define RR_ELEM_MAX 2
 
-static UInt32 rr_interspace(rr_ctx *ctx, UInt32 len, UInt8 *d);
-static UInt32 rr_pulse(rr_ctx *ctx, UInt32 len, UInt8 *d);
-static UInt32 rr_space(rr_ctx *ctx, UInt32 len, UInt8 *d);
+// space byte classes, a long space ends the frame with the next one already
+// under way and 0xff ends the transmission
+enum {
+    RR_SP_RECORD,
+    RR_SP_LONG,
+    RR_SP_END
+};
+
+static const UInt8 rr_space_class[256] = {
+    [0x81 ... 0xfe] = RR_SP_LONG,
+    [0xff] = RR_SP_END
+};
+
+static UInt32 rr_decode(rr_ctx *ctx, UInt8 *d, UInt32 len);
 
-// Parse RAW data and store internally
+// Parse RAW data and store internally. Whatever is parsed is consumed from
+// the ring, an incomplete element is left there for the next call.
 rr_ret
-rr_parse(rr_ctx *ctx, UInt32 len, UInt8 *d)
+rr_parse(rr_ctx *ctx, ring *in)
 {
     rr_ret ret;
-    UInt32 n, m;
-    UInt32 (*fn)(rr_ctx *, UInt32, UInt8 *);
-    int nextState;
+    UInt32 n, m, len, contig, left;
+    UInt8 *d, tmp[RR_ELEM_MAX];
     
     n = 0;
+    len = RING_LEN(in);
     
     while (n < len  &&  !ctx->done)
     {
-        switch (ctx->state)
-        {
-            case DDS_INIT:
-                DMP("INIT\n");
-                fn = rr_init;
-                nextState = DDS_INTERSPACE;
-                break;
-            case DDS_INTERSPACE:
-                DMP("INTERSPACE\n");
-                fn = rr_interspace;
-                nextState = DDS_PULSE;
-                break;
-            case DDS_PULSE:
-                DMP("PULSE\n");
-                fn = rr_pulse;
-                nextState = DDS_SPACE;
-                break;
-            case DDS_SPACE:
-                DMP("SPACE\n");
-                fn = rr_space;
-                nextState = DDS_PULSE;
-                break;
-            default:
-                fn = NULL;
-        }
+        d = ring_contig(in, n, &contig);
+        m = rr_decode(ctx, d, contig);
+        n += m;
+        if (ctx->done  ||  m == contig) continue;
+        
+        // the rest of the span is a partial element, either the remainder
+        // is still in flight or it is on the other side of the wrap
+        left = len - n;
+        if (left == contig - m) break;
         
-        m = fn(ctx, len - n, &d[n]);
-        ctx->state = nextState;
-        if (m > len - n) break;
+        if (left > sizeof(tmp)) left = sizeof(tmp);
+        ring_peek(in, n, tmp, left);
+        m = rr_decode(ctx, tmp, left);
+        if (!m) break;
         n += m;
     }
+    
+    ring_consume(in, n);
  
     ret.n = n;
     if (ctx->done)
     {
         ret.done = 1;
-        if (ret.n >= 2)
-        {
-            ret.m = (ctx->done == 1 ? n - 2 : n); // partial
-        } else
-        {
-            ret.m = ret.n;
-        }
-        ret.d[0] = ret.d[1] = 0; // 0 inter-space delay
-        ctx->state = DDS_INIT;
+        DBG("%u pulses, %u spaces\n", (unsigned)ctx->ps.nof_pulses, (unsigned)ctx->ps.nof_spaces);
+        // a long space ends the frame with the next one already under way,
+        // so that one has no interspace of its own
+        ctx->state = (ctx->done == 1 ? DDS_INIT_PULSE : DDS_INIT);
         ctx->done = 0;
     } else
     {
         ret.done = 0;
-        ret.m = ret.n;
     }
     
     return ret;
@@ -115,17 +111,17 @@ rr_output_pronto(rr_ctx *ctx, UInt8 *d)
     d[n++] = 4145146 / ctx->freq; // frequency
     d[n++] = 0;
     d[n++] = 0; // once burst-pair count
-    d[n++] = ctx->nof_pulses >> 8;
-    d[n++] = ctx->nof_pulses & 0xff; // repeat burst-pair count
+    d[n++] = ctx->ps.nof_pulses >> 8;
+    d[n++] = ctx->ps.nof_pulses & 0xff; // repeat burst-pair count
     
-    nof_pulses = ctx->nof_pulses;
-    nof_spaces = ctx->nof_spaces;
+    nof_pulses = ctx->ps.nof_pulses;
+    nof_spaces = ctx->ps.nof_spaces;
 
     while (nof_pulses  ||  nof_spaces)
     {
         if (nof_pulses)
         {
-            t = 78000 * ctx->pulse[ctx->nof_pulses - nof_pulses] / ctx->freq;
+            t = 78000 * PS_PULSE(&ctx->ps, ctx->ps.nof_pulses - nof_pulses) / ctx->freq;
             d[n++] = t >> 8;
             d[n++] = t & 0xff;
             nof_pulses--;
@@ -133,7 +129,7 @@ rr_output_pronto(rr_ctx *ctx, UInt8 *d)
         
         if (nof_spaces)
         {
-            t = 78000 * ctx->space[ctx->nof_spaces - nof_spaces] / ctx->freq;
+            t = 78000 * PS_SPACE(&ctx->ps, ctx->ps.nof_spaces - nof_spaces) / ctx->freq;
             d[n++] = t >> 8;
             d[n++] = t & 0xff;
             nof_spaces--;
@@ -171,7 +167,7 @@ rr_output(rr_ctx *ctx, UInt8 *d)
     
     d[n++] = UIRT_CMD_TX_RAW; // RAW command
     
-    d[n++] = 6 + (UInt8)(ctx->nof_pulses + ctx->nof_spaces); // RAW command length
+    d[n++] = 6 + (UInt8)(ctx->ps.nof_pulses + ctx->ps.nof_spaces); // RAW command length
     
     d[n++] = v; // frequency
     
@@ -180,17 +176,17 @@ rr_output(rr_ctx *ctx, UInt8 *d)
     d[n++] = (UInt8)(ctx->interspace >> 8); // interspace hi
     d[n++] = (UInt8)(ctx->interspace & 0xff); // interspace low
     
-    d[n++] = (UInt8)(ctx->nof_pulses + ctx->nof_spaces); 
+    d[n++] = (UInt8)(ctx->ps.nof_pulses + ctx->ps.nof_spaces); 
     
-    nof_pulses = ctx->nof_pulses;
-    nof_spaces = ctx->nof_spaces;
+    nof_pulses = ctx->ps.nof_pulses;
+    nof_spaces = ctx->ps.nof_spaces;
     nof_fudge = 0;
     
     while (nof_pulses  ||  nof_spaces)
     {
         if (nof_pulses)
         {
-            t = 78000 * ctx->pulse[ctx->nof_pulses - nof_pulses] / ctx->freq;
+            t = 78000 * PS_PULSE(&ctx->ps, ctx->ps.nof_pulses - nof_pulses) / ctx->freq;
             if (t >= 0x80)
             {
                 d[n++] = 0x80 | (t >> 8);
@@ -206,7 +202,7 @@ rr_output(rr_ctx *ctx, UInt8 *d)
         
         if (nof_spaces)
         {
-            t = 80000 * ctx->space[ctx->nof_spaces - nof_spaces] / ctx->freq;
+            t = 80000 * PS_SPACE(&ctx->ps, ctx->ps.nof_spaces - nof_spaces) / ctx->freq;
             
             if (t >= 0x80)
             {
@@ -222,6 +218,13 @@ rr_output(rr_ctx *ctx, UInt8 *d)
         }
     }
     
+    // both length bytes have to hold it, with two bytes for a long duration
+    if (n - sizeof(uirt_tx_cmd) > UIRT_TX_RAW_DATA_MAX)
+    {
+        ERR("%u bytes of durations don't fit a transmit\n", (unsigned)(n - sizeof(uirt_tx_cmd)));
+        return 0;
+    }
+    
     DMP("d[1] = %02X, d[6] = %02X, nof_fudge = %02X\n", 
         d[UIRT_CMD_O_LENGTH], d[UIRT_CMD_TX_RAW_O_LENGTH], (int)nof_fudge);
     d[UIRT_CMD_O_LENGTH] += nof_fudge; // redo the length to take fudge into account
@@ -233,7 +236,16 @@ rr_output(rr_ctx *ctx, UInt8 *d)
 UInt32
 rr_init(rr_ctx *ctx, UInt32 len, UInt8 *d)
 {
+    pstore ps;
+    
+    (void)len;
+    (void)d;
+    
+    // everything starts over except the pulse arena
+    ps = ctx->ps;
     bzero(ctx, sizeof(*ctx));
+    ctx->ps = ps;
+    ps_reset(&ctx->ps);
     
     ctx->freq = 38461; // pick a default that divides 2500000 semi-nicely for no particular reason
     ctx->repeat_count = 1;
@@ -241,67 +253,71 @@ rr_init(rr_ctx *ctx, UInt32 len, UInt8 *d)
     return 0;
 }
 
-UInt32
-rr_interspace(rr_ctx *ctx, UInt32 len, UInt8 *d)
+void
+rr_deinit(rr_ctx *ctx)
 {
-    UInt32 n, i;
-    
-    n = 0;
-
-    if (len < 2) return -len;
-    i = (UInt32)d[n++] << 8;
-    i |= (UInt32)d[n++];
-    
-    ctx->interspace = i;
-    
-    return n;
+    ps_free(&ctx->ps);
 }
 
+// Decode as many whole elements as the linear span holds in one pass and
+// return the bytes used. Stops in front of an element cut off by the end of
+// the span, ctx->state records exactly where to pick up again.
 UInt32
-rr_pulse(rr_ctx *ctx, UInt32 len, UInt8 *d)
+rr_decode(rr_ctx *ctx, UInt8 *d, UInt32 len)
 {
-    UInt32 n, p;
-    
-    n = 0;
-
-    // time in 50us units
-    p = (UInt32)d[n++];
-    
-    // record the pulse
-    ctx->pulse[ctx->nof_pulses++] = p;
+    UInt8 *p, *end;
+    UInt32 s;
+    int state;
     
-    return n;
-}
-
-UInt32
-rr_space(rr_ctx *ctx, UInt32 len, UInt8 *d)
-{
-    UInt32 n, s;
-    static UInt32 max_s = 0;
-    
-    n = 0;
+    p = d;
+    end = d + len;
+    state = ctx->state;
     
-    s = (UInt32)d[n++];
-    if (s == 0xff) 
+    if (state == DDS_INIT  ||  state == DDS_INIT_PULSE)
     {
-        ctx->done = 2;
-        return n;
+        rr_init(ctx, 0, NULL);
+        ctx->cont = (state == DDS_INIT_PULSE);
+        state = (state == DDS_INIT ? DDS_INTERSPACE : DDS_PULSE);
     }
-
-    if (s > max_s)
+    
+    if (state == DDS_INTERSPACE)
     {
-        max_s = s;
-        DBG("max_s = %X\n", (int)max_s);
+        if (end - p < 2) goto out;
+        ctx->interspace = ((UInt32)p[0] << 8) | (UInt32)p[1];
+        p += 2;
+        state = DDS_PULSE;
     }
     
-    if (s > 0x80)
+    if (state == DDS_SPACE) goto space;
+    
+    for (;;)
     {
-        ctx->done = 1;
-        return n;
+        // pulse, time in 50us units
+        if (p == end)
+        {
+            state = DDS_PULSE;
+            break;
+        }
+        ps_add_pulse(&ctx->ps, *p++);
+        
+    space:
+        if (p == end)
+        {
+            state = DDS_SPACE;
+            break;
+        }
+        s = *p++;
+        if (rr_space_class[s] != RR_SP_RECORD)
+        {
+            ctx->done = (rr_space_class[s] == RR_SP_END ? 2 : 1);
+            state = DDS_PULSE;
+            break;
+        }
+        ps_add_space(&ctx->ps, s);
     }
-   
-    // record the space
-    ctx->space[ctx->nof_spaces++] = s;
     
-    return n;
+out:
+    ctx->state = state;
+    
+    return p - d;
 }
@@ -8,33 +8,32 @@
 #ifndef __UIRT_RAW_H
 #define __UIRT_RAW_H
 
-#define RR_MAX_PULSES 128
-
 typedef struct rr_ctx
 {
     int state;
     int done;
     UInt8 repeat_count;
+    UInt8 cont; // frame followed the previous one without an interspace
     UInt32 interspace; // interspace in 50us
     UInt32 freq; // frequency (pulled from thin air)
-    UInt32 nof_pulses;
-    UInt32 pulse[RR_MAX_PULSES]; // pulse times in 50us
-    UInt32 nof_spaces;
-    UInt32 space[RR_MAX_PULSES]; // space times in 50us
+    pstore ps; // pulse and space times in 50us
 } rr_ctx;
 
+// bytes rr_output_pronto() writes for ctx
+#define RR_PRONTO_LEN(ctx) (10 + 2 * ((ctx)->ps.nof_pulses + (ctx)->ps.nof_spaces))
+
 typedef struct rr_ret
 {
     int done;
-    UInt32 n : 16;
-    UInt32 m : 16;
-    UInt8 d[2];
+    UInt32 n; // bytes consumed from the ring
 } rr_ret;
 
-UInt32 rr_init(rr_ctx *ctx, UInt32 len, UInt8 *d);
-rr_ret rr_parse(rr_ctx *ctx, UInt32 len, UInt8 *d);
+UInt32 rr_init(rr_ctx *ctx, UInt32 len, UInt8 *d); // ctx must start out zeroed
+void rr_deinit(rr_ctx *ctx);
+rr_ret rr_parse(rr_ctx *ctx, ring *in);
 void rr_set_frequency(rr_ctx *ctx, UInt32 freq);
 UInt32 rr_output_pronto(rr_ctx *ctx, UInt8 *d);
+// TX_RAW without the checksum, 0 if the code is too long for the device
 UInt32 rr_output(rr_ctx *ctx, UInt8 *d);
 
 #endif
@@ -5,7 +5,8 @@
  * published by the Free Software Foundation.
  */
 
-#include <CoreFoundation/CoreFoundation.h>
+#include <stddef.h>
+#include "platform.h"
 #include "debug.h"
 #include "ribsu-util.h"
 #include "uirt.h"
@@ -16,92 +17,75 @@ DBG_MODULE_DEFINE();
 
 enum {
     DDS_INIT,
+    DDS_INIT_PULSE, // new frame that starts without an interspace
     DDS_INTERSPACE,
     DDS_PULSE,
     DDS_SPACE
 };
 
+// longest single element (a pulse with a 2 byte cycle count)
+#define RR2_ELEM_MAX 4
 
-static UInt32 rr2_interspace(rr2_ctx *ctx, UInt32 len, UInt8 *d);
-static UInt32 rr2_pulse(rr2_ctx *ctx, UInt32 len, UInt8 *d);
-static UInt32 rr2_space(rr2_ctx *ctx, UInt32 len, UInt8 *d);
+// RAW2 spaces above this end the frame with the next one already under way
+#define RR2_SPACE_LONG 0x3e80
+
+// pulse element length by its first cycle count byte, PhPlCl or PhPlChCl
+#define RR2_PULSE_LEN(c) (3 + ((c) >> 7))
+
+// 400ns units to carrier cycles, rounded
+#define RR2_CYCLES(ctx, t) ((UInt32)(((UInt64)(t) * (ctx)->cycle_scale + (1 << 23)) >> 24))
+
+static UInt32 rr2_decode(rr2_ctx *ctx, UInt8 *d, UInt32 len);
 static UInt32 rr2_final(rr2_ctx *ctx, UInt32 len, UInt8 *d);
 
-// Parse RAW2 data and store internally
+// Parse RAW2 data and store internally. Whatever is parsed is consumed from
+// the ring, an incomplete element is left there for the next call.
 rr2_ret
-rr2_parse(rr2_ctx *ctx, UInt32 len, UInt8 *d)
+rr2_parse(rr2_ctx *ctx, ring *in)
 {
     rr2_ret ret;
-    UInt32 n, m;
-    UInt32 (*fn)(rr2_ctx *, UInt32, UInt8 *);
-    int nextState;
+    UInt32 n, m, len, contig, left;
+    UInt8 *d, tmp[RR2_ELEM_MAX];
     
-    m = n = 0;
+    n = 0;
+    len = RING_LEN(in);
     
-    DMP("state, n, len, ctx->done = %d, %d, %d, %d",
-        (int)ctx->state, (int)n, (int)len, ctx->done);
     while (n < len  &&  !ctx->done)
     {
-        DMP("state, n, len, ctx->done = %d, %d, %d, %d",
-            (int)ctx->state, (int)n, (int)len, ctx->done);
-        switch (ctx->state)
-        {
-            case DDS_INIT:
-                DMP("DDS_INIT");
-                fn = rr2_init;
-                nextState = DDS_INTERSPACE;
-                break;
-            case DDS_INTERSPACE:
-                DMP("DDS_INTERSPACE");
-                fn = rr2_interspace;
-                nextState = DDS_PULSE;
-                break;
-            case DDS_PULSE:
-                DMP("DDS_PULSE");
-                fn = rr2_pulse;
-                nextState = DDS_SPACE;
-                break;
-            case DDS_SPACE:
-                DMP("DDS_SPACE");
-                fn = rr2_space;
-                nextState = DDS_PULSE;
-                break;
-            default:
-                fn = NULL;
-        }
-
-        m = fn(ctx, len - n, &d[n]);
-        ctx->state = nextState;
-        DMP("m %d", (int)m);
-        if (m > len - n) break;
+        d = ring_contig(in, n, &contig);
+        m = rr2_decode(ctx, d, contig);
+        n += m;
+        if (ctx->done  ||  m == contig) continue;
+        
+        // the rest of the span is a partial element, either the remainder
+        // is still in flight or it is on the other side of the wrap
+        left = len - n;
+        if (left == contig - m) break;
+        
+        if (left > sizeof(tmp)) left = sizeof(tmp);
+        ring_peek(in, n, tmp, left);
+        m = rr2_decode(ctx, tmp, left);
+        if (!m) break;
         n += m;
-        DMP("state, n, len, ctx->done = %d, %d, %d, %d",
-            (int)ctx->state, (int)n, (int)len, ctx->done);
     }
     DMP("state, n, len, ctx->done = %d, %d, %d, %d",
         (int)ctx->state, (int)n, (int)len, ctx->done);
  
+    ring_consume(in, n);
+    
     ret.n = n;
     if (ctx->done)
     {
-        rr2_final(ctx, len - n, &d[n]);
+        rr2_final(ctx, 0, NULL);
         
         ret.done = 1;
-        if (ret.n >= 2)
-        {
-            ret.m = (ctx->done == 1 ? n - 2 : n); // partial
-        } else
-        {
-            ret.m = ret.n;
-        }
-
-        ret.d[0] = ret.d[1] = 0;
-        ctx->state = DDS_INIT;
+        // a long space ends the frame with the next one already under way,
+        // so that one has no interspace of its own
+        ctx->state = (ctx->done == 1 ? DDS_INIT_PULSE : DDS_INIT);
         ctx->done = 0;
     } else
     {
         ret.done = 0;
-        ret.m = ret.n;
     }
     
     return ret;
@@ -122,15 +106,15 @@ rr2_output_pronto(rr2_ctx *ctx, UInt8 *d)
     d[n++] = 4145146 / ctx->calc_freq; // frequency
     d[n++] = 0;
     d[n++] = 0; // once burst-pair count
-    d[n++] = ctx->nof_pulses >> 8;
-    d[n++] = ctx->nof_pulses & 0xff; // repeat burst-pair count
-    nof_pulses = ctx->nof_pulses;
-    nof_spaces = ctx->nof_spaces;
+    d[n++] = ctx->ps.nof_pulses >> 8;
+    d[n++] = ctx->ps.nof_pulses & 0xff; // repeat burst-pair count
+    nof_pulses = ctx->ps.nof_pulses;
+    nof_spaces = ctx->ps.nof_spaces;
     while (nof_pulses  ||  nof_spaces)
     {
         if (nof_pulses)
         {
-            t = 560 * ctx->pulse[ctx->nof_pulses - nof_pulses] / ctx->calc_freq;
+            t = RR2_CYCLES(ctx, PS_PULSE(&ctx->ps, ctx->ps.nof_pulses - nof_pulses));
             d[n++] = t >> 8;
             d[n++] = t & 0xff;
             nof_pulses--;
@@ -138,7 +122,7 @@ rr2_output_pronto(rr2_ctx *ctx, UInt8 *d)
         
         if (nof_spaces)
         {
-            t = 560 * ctx->space[ctx->nof_spaces - nof_spaces] / ctx->calc_freq;
+            t = RR2_CYCLES(ctx, PS_SPACE(&ctx->ps, ctx->ps.nof_spaces - nof_spaces));
             d[n++] = t >> 8;
             d[n++] = t & 0xff;
             nof_spaces--;
@@ -174,7 +158,7 @@ rr2_output(rr2_ctx *ctx, UInt8 *d)
     
     d[n++] = 0x36; // RAW command
     
-    d[n++] = 6 + (UInt8)(ctx->nof_pulses + ctx->nof_spaces); // RAW command length
+    d[n++] = 6 + (UInt8)(ctx->ps.nof_pulses + ctx->ps.nof_spaces); // RAW command length
 
     d[n++] = v; // frequency
     
@@ -183,17 +167,17 @@ rr2_output(rr2_ctx *ctx, UInt8 *d)
     d[n++] = (UInt8)(ctx->interspace >> 8); // interspace hi
     d[n++] = (UInt8)(ctx->interspace & 0xff); // interspace low
     
-    d[n++] = (UInt8)(ctx->nof_pulses + ctx->nof_spaces); 
+    d[n++] = (UInt8)(ctx->ps.nof_pulses + ctx->ps.nof_spaces); 
     
-    nof_pulses = ctx->nof_pulses;
-    nof_spaces = ctx->nof_spaces;
+    nof_pulses = ctx->ps.nof_pulses;
+    nof_spaces = ctx->ps.nof_spaces;
     nof_fudge = 0;
         
     while (nof_pulses  ||  nof_spaces)
     {
         if (nof_pulses)
         {
-            t = 560 * ctx->pulse[ctx->nof_pulses - nof_pulses] / ctx->calc_freq;
+            t = RR2_CYCLES(ctx, PS_PULSE(&ctx->ps, ctx->ps.nof_pulses - nof_pulses));
             DMP("pulse %02Xh", (int)t);
             
             if (t >= 0x80)
@@ -211,7 +195,7 @@ rr2_output(rr2_ctx *ctx, UInt8 *d)
         
         if (nof_spaces)
         {
-            t = 560 * ctx->space[ctx->nof_spaces - nof_spaces] / ctx->calc_freq;
+            t = RR2_CYCLES(ctx, PS_SPACE(&ctx->ps, ctx->ps.nof_spaces - nof_spaces));
             DMP("space %02Xh", (int)t);
             
             if (t >= 0x80)
@@ -228,6 +212,13 @@ rr2_output(rr2_ctx *ctx, UInt8 *d)
         }
     }
     
+    // both length bytes have to hold it, with two bytes for a long duration
+    if (n - sizeof(uirt_tx_cmd) > UIRT_TX_RAW_DATA_MAX)
+    {
+        ERR("%u bytes of durations don't fit a transmit\n", (unsigned)(n - sizeof(uirt_tx_cmd)));
+        return 0;
+    }
+    
     DMP("d[1] = %02X, d[6] = %02X, nof_fudge = %02X", 
         d[UIRT_CMD_O_LENGTH], d[UIRT_CMD_TX_RAW_O_LENGTH], (int)nof_fudge);
     d[UIRT_CMD_O_LENGTH] += nof_fudge; // redo the length to take fudge into account
@@ -239,113 +230,168 @@ rr2_output(rr2_ctx *ctx, UInt8 *d)
 UInt32
 rr2_init(rr2_ctx *ctx, UInt32 len, UInt8 *d)
 {
-    bzero(ctx, sizeof(*ctx));
+    (void)len;
+    (void)d;
+    
+    // everything starts over except the pulse arena and the carrier samples
+    // that follow it, those are only read up to nof_freq_samples
+    bzero(ctx, offsetof(rr2_ctx, ps));
+    ps_reset(&ctx->ps);
     
     ctx->repeat_count = 1;
     
     return 0;
 }
 
-UInt32
-rr2_interspace(rr2_ctx *ctx, UInt32 len, UInt8 *d)
+void
+rr2_deinit(rr2_ctx *ctx)
 {
-    UInt32 n, i;
-
-    if (len < 2) return -len;
-
-    n = 0;
-    
-    i = (UInt32)d[n++] << 8;
-    i |= (UInt32)d[n++];
-    i = i * 500 / 512; // convert from 51.2us to 50us
-    
-    ctx->interspace = i;
-    
-    return n;
+    ps_free(&ctx->ps);
 }
 
-// PhPlCl or PhPlChCl
+// Decode as many whole elements as the linear span holds in one pass and
+// return the bytes used. Stops in front of an element cut off by the end of
+// the span, ctx->state records exactly where to pick up again.
 UInt32
-rr2_pulse(rr2_ctx *ctx, UInt32 len, UInt8 *d)
+rr2_decode(rr2_ctx *ctx, UInt8 *d, UInt32 len)
 {
-    UInt32 n, p, c, f;
+    UInt8 *p, *end;
+    UInt32 t, c, m;
+    int state;
     
-    n = 0;
-
-    if (len < 3) return -len;
+    p = d;
+    end = d + len;
+    state = ctx->state;
     
-    // time in 400ns units
-    p = (UInt32)d[n++] << 8;
-    p |= (UInt32)d[n++];
-        
-    // number of carrier cycles 
-    c = (UInt32)d[n++];
-    if (c & 0x80)
+    if (state == DDS_INIT  ||  state == DDS_INIT_PULSE)
     {
-        if (len < 4) return -len;
-        c = ((c & 0x7f) << 8) | (UInt32)d[n++];
+        rr2_init(ctx, 0, NULL);
+        ctx->cont = (state == DDS_INIT_PULSE);
+        state = (state == DDS_INIT ? DDS_INTERSPACE : DDS_PULSE);
     }
     
-    // add the grokked frequency to the running total for later averaging
-    if (c != 0)
+    if (state == DDS_INTERSPACE)
+    {
+        if (end - p < 2) goto out;
+        t = ((UInt32)p[0] << 8) | (UInt32)p[1];
+        ctx->interspace = t * 500 / 512; // convert from 51.2us to 50us
+        p += 2;
+        state = DDS_PULSE;
+    }
+    
+    if (state == DDS_SPACE) goto space;
+    
+    for (;;)
     {
-        f = (250000 / p) * (10 * c - 5); 
-        DMP("p = %u, c = %u, f = %u", (unsigned)p, (unsigned)c, (unsigned)f); 
+        // pulse, time in 400ns units followed by the number of carrier cycles
+        if (end - p < 3  ||  end - p < RR2_PULSE_LEN(p[2]))
+        {
+            state = DDS_PULSE;
+            break;
+        }
+        t = ((UInt32)p[0] << 8) | (UInt32)p[1];
+        c = p[2];
+        m = RR2_PULSE_LEN(c);
+        if (c & 0x80) c = ((c & 0x7f) << 8) | (UInt32)p[3];
+        p += m;
+        
+        // sample the carrier, rr2_final() makes sense of it
+        if (c  &&  t  &&  c < 0x8000  &&  ctx->nof_freq_samples < RR2_FREQ_MAX)
+        {
+            if (t > ctx->freq_t[ctx->freq_anchor]  ||  !ctx->nof_freq_samples)
+            {
+                ctx->freq_anchor = ctx->nof_freq_samples;
+            }
+            ctx->freq_t[ctx->nof_freq_samples] = t;
+            ctx->freq_c[ctx->nof_freq_samples] = 2 * c - 1;
+            ctx->nof_freq_samples++;
+        }
+        
+        ps_add_pulse(&ctx->ps, t);
+        
+    space:
+        // space, time in 400ns units, a lone 0xff ends the transmission
+        if (p == end)
+        {
+            state = DDS_SPACE;
+            break;
+        }
+        if (p[0] == 0xff)
+        {
+            p++;
+            ctx->done = 2;
+            state = DDS_PULSE;
+            break;
+        }
+        if (end - p < 2)
+        {
+            state = DDS_SPACE;
+            break;
+        }
+        t = ((UInt32)p[0] << 8) | (UInt32)p[1];
+        p += 2;
+        if (t > RR2_SPACE_LONG)
+        {
+            DBG("s = %X", (int)t);
+            ctx->done = 1;
+            state = DDS_PULSE;
+            break;
+        }
         
-        ctx->freq_total += f;
-        ctx->nof_freq_samples++;
+        ps_add_space(&ctx->ps, t);
     }
     
-    // record the pulse
-    ctx->pulse[ctx->nof_pulses++] = p;
+out:
+    ctx->state = state;
     
-    return n;
+    return p - d;
 }
 
+// Carrier frequency of the frame. A pulse of t 400ns units holding c
+// cycles (counted edge to edge, so c - 1/2 periods) has a carrier of
+// 1.25MHz * (2c - 1) / t. The longest pulse has the least counting error and
+// anchors the estimate: pulses more than 5% off it, compared by cross
+// multiplying, are dropped and the rest averaged weighted by time. That is
+// one division per frame however many pulses there are.
 UInt32
-rr2_space(rr2_ctx *ctx, UInt32 len, UInt8 *d)
+rr2_final(rr2_ctx *ctx, UInt32 len, UInt8 *d)
 {
-    UInt32 n, s;
+    UInt32 num, den, all_t, i, m;
+    UInt64 a, b;
     
-    n = 0;
+    (void)len;
+    (void)d;
     
-    if (len < 1) return -len;
-    // time in 400ns units
-    s = (UInt32)d[n++];
-    if (s == 0xff)
-    {
-        ctx->done = 2;
-        return n;
-    }
-
-    if (len < 2) return -len;
-    s = (s << 8) | (UInt32)d[n++];
+    m = ctx->freq_anchor;
+    num = den = all_t = 0;
     
-    if (s > 0x3e80)
+    for (i = 0; i < ctx->nof_freq_samples; i++)
     {
-        DBG("s = %X", (int)s);
-        ctx->done = 1;
-        return n;
+        all_t += ctx->freq_t[i];
+        
+        a = (UInt64)ctx->freq_c[i] * ctx->freq_t[m];
+        b = (UInt64)ctx->freq_c[m] * ctx->freq_t[i];
+        if (20 * (a > b ? a - b : b - a) > b) continue;
+        
+        num += ctx->freq_c[i];
+        den += ctx->freq_t[i];
     }
     
-    // record the space
-    ctx->space[ctx->nof_spaces++] = s;
-    
-    return n;
-}
-
-UInt32
-rr2_final(rr2_ctx *ctx, UInt32 len, UInt8 *d)
-{
-    if (ctx->nof_freq_samples)
+    // num / 2 cycles in den 400ns units, which is also what the outputs
+    // scale every duration by to get carrier cycles
+    if (den)
     {
-        ctx->calc_freq = ctx->freq_total / ctx->nof_freq_samples;
+        ctx->cycle_scale = (UInt32)(((UInt64)num << 23) / den);
+        ctx->freq_conf = 100 * den / all_t;
     } else
     {
-        ctx->calc_freq = 1; // Just set it to something that won't crash
+        ctx->cycle_scale = (UInt32)(((UInt64)RR2_FREQ_DEFAULT << 24) / 2500000);
+        ctx->freq_conf = 0;
     }
-
-    DBG("calc_freq = %u", (unsigned)ctx->calc_freq);
+    
+    ctx->calc_freq = (UInt32)(((UInt64)ctx->cycle_scale * 2500000 + (1 << 23)) >> 24);
+    
+    DBG("calc_freq = %u, confidence %u%%", (unsigned)ctx->calc_freq, (unsigned)ctx->freq_conf);
     
     return 0;
 }
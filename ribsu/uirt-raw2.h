@@ -8,33 +8,40 @@
 #ifndef __UIRT_RAW2_H
 #define __UIRT_RAW2_H
 
-#define RR2_MAX_PULSES 128
+#define RR2_FREQ_MAX      (32)    // pulses of a frame sampled for the carrier
+#define RR2_FREQ_DEFAULT  (38000) // assumed when there are no samples
+#define RR2_FREQ_CONF_MIN (50)    // below this the frame is hardly IR
 
 typedef struct rr2_ctx
 {
     int state;
     int done;
     UInt8 repeat_count;
+    UInt8 cont; // frame followed the previous one without an interspace
     UInt32 interspace; // interspace in 50us
-    UInt32 freq_total; // frequency total
     UInt32 nof_freq_samples; // number of frequency samples
+    UInt32 freq_anchor; // sample of the longest pulse
     UInt32 calc_freq; // calculated frequency
-    UInt32 nof_pulses;
-    UInt32 pulse[RR2_MAX_PULSES]; // pulse times in 400ns
-    UInt32 nof_spaces;
-    UInt32 space[RR2_MAX_PULSES]; // space times in 400ns
+    UInt32 freq_conf; // 0-100, how much of the pulse time agrees with calc_freq
+    UInt32 cycle_scale; // carrier cycles per 400ns, 24 bit fraction
+    pstore ps; // pulse and space times in 400ns
+    UInt16 freq_t[RR2_FREQ_MAX]; // pulse time in 400ns
+    UInt16 freq_c[RR2_FREQ_MAX]; // and carrier half cycles in it, 2 * cycles - 1
 } rr2_ctx;
 
+// bytes rr2_output_pronto() writes for ctx
+#define RR2_PRONTO_LEN(ctx) (10 + 2 * ((ctx)->ps.nof_pulses + (ctx)->ps.nof_spaces))
+
 typedef struct rr2_ret
 {
     int done;
-    UInt32 n : 16;
-    UInt32 m : 16;
-    UInt8 d[2];
+    UInt32 n; // bytes consumed from the ring
 } rr2_ret;
 
-UInt32 rr2_init(rr2_ctx *ctx, UInt32 len, UInt8 *d);
-rr2_ret rr2_parse(rr2_ctx *ctx, UInt32 len, UInt8 *d);
+UInt32 rr2_init(rr2_ctx *ctx, UInt32 len, UInt8 *d); // ctx must start out zeroed
+void rr2_deinit(rr2_ctx *ctx);
+rr2_ret rr2_parse(rr2_ctx *ctx, ring *in);
+// TX_RAW without the checksum, 0 if the code is too long for the device
 UInt32 rr2_output(rr2_ctx *ctx, UInt8 *d);
 UInt32 rr2_output_pronto(rr2_ctx *ctx, UInt8 *d);
 
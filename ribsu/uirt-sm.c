@@ -6,7 +6,7 @@
  */
 
 
-#include <CoreFoundation/CoreFoundation.h>
+#include "platform.h"
 
 #include "debug.h"
 #include "ribsu-util.h"
@@ -17,15 +17,9 @@
 #define MODULE_NAME uirt_sm
 DBG_MODULE_DEFINE();
 
-// 00 is a pseudo command we use only here
+// 00 and 01 are pseudo commands we use only here
 #define UIRT_CMD_TX_PRONTO     (0x00)
-
-enum {
-    USM_M_ECHO,
-    USM_M_UIR,
-    USM_M_RAW,
-    USM_M_RAW2,
-};
+#define UIRT_CMD_TX_PROTO      (0x01) // 01 PP AAAA CC RR [BB], see usm_encode_proto()
 
 enum {
     USM_W_STATUS, // waiting for UIRT to return status
@@ -37,14 +31,17 @@ static void usm_process_uir(usm_ctx *ctx, buffer *in, buffer *out);
 static void usm_process_raw(usm_ctx *ctx, buffer *in, buffer *out);
 static void usm_process_raw2(usm_ctx *ctx, buffer *in, buffer *out);
 static void usm_process_thru(usm_ctx *ctx, buffer *in, buffer *out);
-static int  usm_checksum(buffer *buf);
+static void usm_aggregate(usm_ctx *ctx, buffer *in);
+static void usm_encode_proto(usm_ctx *ctx, buffer *in, buffer *out);
+static void usm_frame_done(usm_ctx *ctx, UInt32 *count, buffer *out);
+static void usm_status(usm_ctx *ctx, UInt8 status);
 
 void 
 usm_init(usm_ctx *ctx)
 {
     bzero(ctx, sizeof(*ctx));
     
-    buf_attach(&ctx->agg, USM_AGG_MAX, ctx->agg_buf);
+    ring_attach(&ctx->agg, USM_AGG_MAX, ctx->agg_buf, USM_AGG_LIMIT);
     
     // power on defaults
     ctx->mode = USM_M_UIR;
@@ -53,6 +50,43 @@ usm_init(usm_ctx *ctx)
     rr2_init(&ctx->raw2_ctx, 0, NULL);
 }
 
+void
+usm_deinit(usm_ctx *ctx)
+{
+    ring_free(&ctx->agg);
+    rr_deinit(&ctx->raw_ctx);
+    rr2_deinit(&ctx->raw2_ctx);
+    rp_deinit(&ctx->pronto_ctx);
+    lru_free(&ctx->tx_cache);
+}
+
+void
+usm_get_stats(usm_ctx *ctx, usm_stats *stats)
+{
+    *stats = ctx->stats;
+    stats->tx_cache_hits = ctx->tx_cache.hits;
+    stats->tx_cache_misses = ctx->tx_cache.misses;
+    stats->tx_cache_evictions = ctx->tx_cache.evictions;
+}
+
+// Put the machine where a capture says it was, the parsers start over if the
+// mode changes
+void
+usm_set_mode(usm_ctx *ctx, UInt32 mode, UInt32 state)
+{
+    if (mode != ctx->mode)
+    {
+        rr_init(&ctx->raw_ctx, 0, NULL);
+        rr2_init(&ctx->raw2_ctx, 0, NULL);
+        up_init(&ctx->proto_ctx);
+    }
+    
+    ctx->mode = mode;
+    ctx->state = state;
+    ctx->pending = (state != USM_W_CODE);
+    ring_reset(&ctx->agg);
+}
+
 void
 usm_process_uirt(usm_ctx *ctx, buffer *in, buffer *out)
 {
@@ -60,6 +94,10 @@ usm_process_uirt(usm_ctx *ctx, buffer *in, buffer *out)
     
     if (!in->len) return;
     
+    ctx->t_in = ctx->t_rx = u_now();
+    ctx->frame_out = 0;
+    ctx->replies = 0;
+    
     switch (ctx->state)
     {
         case USM_W_STATUS:
@@ -89,6 +127,9 @@ usm_process_uirt(usm_ctx *ctx, buffer *in, buffer *out)
 void
 usm_process_uirt_more(usm_ctx *ctx, buffer *out)
 {
+    ctx->frame_out = 0;
+    ctx->replies = 0;
+    
     switch (ctx->mode)
     {
         case USM_M_UIR:
@@ -111,9 +152,19 @@ usm_process_uirt_more(usm_ctx *ctx, buffer *out)
 void
 usm_process_user(usm_ctx *ctx, buffer *in, buffer *out)
 {
-    rp_ctx rp;
-   
-    switch (in->buf[0])
+    usm_encode_user(ctx, in, out);
+    if (out->len)
+    {
+        usm_command_sent(ctx, in->buf[0]);
+    }
+}
+
+// A command made by usm_encode_user() went to the device, op is the first
+// byte of what the user gave
+void
+usm_command_sent(usm_ctx *ctx, UInt8 op)
+{
+    switch (op)
     {
         case UIRT_CMD_MODE_UIR:
             ctx->mode = USM_M_UIR;
@@ -142,6 +193,7 @@ usm_process_user(usm_ctx *ctx, buffer *in, buffer *out)
         case UIRT_CMD_TX_RAW:
         case UIRT_CMD_TX_STRUCT:
         case UIRT_CMD_TX_PRONTO:
+        case UIRT_CMD_TX_PROTO:
             ctx->state = USM_W_STATUS;
             break;
         default:
@@ -151,13 +203,35 @@ usm_process_user(usm_ctx *ctx, buffer *in, buffer *out)
             break;
     }
     
-    ctx->agg.len = 0;
+    ring_reset(&ctx->agg);
     
+    ctx->pending++;
+    ctx->stats.commands++;
+    ctx->t_cmd = u_now();
+}
+
+// Turn a user command into what the device takes, without sending it. The
+// machine doesn't move until usm_command_sent(), so a command can be made
+// well ahead of the device being ready for it. out is empty if in can't be
+// sent.
+void
+usm_encode_user(usm_ctx *ctx, buffer *in, buffer *out)
+{
     if (in->buf[0] == UIRT_CMD_TX_PRONTO)
     {
+        // a resend is a lookup of the finished, checksummed command
+        if (lru_get(&ctx->tx_cache, ctx->default_frequency, in, out)) return;
+        
         // futz with the pronto encoding and make it RAW
-        rp_parse(&rp, in->len, in->buf);
-        out->len = rp_output(&rp, out->buf);
+        rp_parse(&ctx->pronto_ctx, in->len, in->buf);
+        if (RP_OUTPUT_MAX(&ctx->pronto_ctx) >= out->max)
+        {
+            ERR("%u pulses don't fit a transmit, dropping\n", (unsigned)ctx->pronto_ctx.ps.nof_pulses);
+            out->len = 0;
+            return;
+        }
+        out->len = rp_output(&ctx->pronto_ctx, out->buf);
+        if (!out->len) return;
         
         {
             /* output generated RAW for debug purposes
@@ -171,13 +245,106 @@ usm_process_user(usm_ctx *ctx, buffer *in, buffer *out)
             DMP("%s\n", buf.buf);
         }
         
+    } else if (in->buf[0] == UIRT_CMD_TX_PROTO)
+    {
+        usm_encode_proto(ctx, in, out);
+        if (!out->len) return;
     } else
     {
-        // pass-thru
+        // pass-thru, with room left for the checksum
+        if (in->len >= out->max)
+        {
+            ERR("%u byte command doesn't fit, dropping\n", (unsigned)in->len);
+            out->len = 0;
+            return;
+        }
         buf_copy(in, out);
     }
 
-    usm_checksum(out);
+    if (usm_checksum(out))
+    {
+        out->len = 0;
+        return;
+    }
+    
+    if (in->buf[0] == UIRT_CMD_TX_PRONTO)
+    {
+        lru_put(&ctx->tx_cache, ctx->default_frequency, in, out);
+    }
+}
+
+// Airtime of a TX_RAW command in us, 0 for any other. Durations are in
+// carrier cycles and the frequency byte is 2500000 / f, so one cycle lasts
+// freq_byte / 2.5 us.
+UInt32
+usm_airtime(UInt8 *d, UInt32 len)
+{
+    uirt_tx_cmd *cmd;
+    UInt32 n, end, t, cycles, interspace;
+    
+    cmd = (uirt_tx_cmd *)d;
+    
+    if (len < sizeof(*cmd)  ||  cmd->op != UIRT_CMD_TX_RAW) return 0;
+    
+    end = sizeof(*cmd) + cmd->data_len;
+    if (end > len - 1) end = len - 1; // don't count the checksum
+    
+    cycles = 0;
+    for (n = sizeof(*cmd); n < end; n++)
+    {
+        t = d[n];
+        if ((t & 0x80)  &&  n + 1 < end)
+        {
+            t = ((t & 0x7f) << 8) | d[++n];
+        }
+        cycles += t;
+    }
+    
+    // interspace is in 50us
+    interspace = ((UInt32)d[4] << 8 | d[5]) * 50;
+    
+    return (cmd->repeat_count ? cmd->repeat_count : 1) * (cycles * 2 * cmd->freq / 5 + interspace);
+}
+
+// The output of usm_encode_user() never made it to the device, don't wait
+// for an answer to it
+void
+usm_command_lost(usm_ctx *ctx)
+{
+    if (ctx->pending) ctx->pending--;
+    if (!ctx->pending) ctx->state = USM_W_CODE;
+}
+
+// Protocol, big endian address, command, repeat count and optionally the
+// number of bits (SIRC only) become TX_RAW without going through Pronto
+void
+usm_encode_proto(usm_ctx *ctx, buffer *in, buffer *out)
+{
+    up_code code;
+
+    out->len = 0;
+
+    if (in->len < 6)
+    {
+        ERR("Protocol transmit too short, dropping\n");
+        return;
+    }
+
+    bzero(&code, sizeof(code));
+    code.proto = in->buf[1];
+    code.address = (UInt32)in->buf[2] << 8 | in->buf[3];
+    code.command = in->buf[4];
+    code.bits = (in->len > 6 ? in->buf[6] : 0);
+
+    // every new press flips the toggle, the device repeats keep it
+    if (code.proto == UP_PROTO_RC5  ||  code.proto == UP_PROTO_RC6)
+    {
+        code.toggle = ctx->toggle;
+        ctx->toggle ^= 1;
+    }
+
+    // leave room for the checksum
+    out->len = up_encode(&code, in->buf[5], out->buf, out->max - 1);
 }
 
 void 
@@ -191,18 +358,13 @@ usm_process_uir(usm_ctx *ctx, buffer *in, buffer *out)
 {
     if (in)
     {
-        buf_append(&ctx->agg, in);
+        usm_aggregate(ctx, in);
     }
     
-    if (ctx->agg.len >= UIRT_UIR_CODE_LEN)
+    if (RING_LEN(&ctx->agg) >= UIRT_UIR_CODE_LEN)
     {
-        bcopy(ctx->agg.buf, out->buf, UIRT_UIR_CODE_LEN);
-        out->len = UIRT_UIR_CODE_LEN;
-        if (ctx->agg.len > UIRT_UIR_CODE_LEN)
-        {
-            bcopy(&ctx->agg.buf[UIRT_UIR_CODE_LEN], ctx->agg.buf, ctx->agg.len - UIRT_UIR_CODE_LEN);
-        }
-        ctx->agg.len -= UIRT_UIR_CODE_LEN;
+        out->len = ring_read(&ctx->agg, out->buf, UIRT_UIR_CODE_LEN);
+        usm_frame_done(ctx, &ctx->stats.frames_uir, out);
     } else
     {
         out->len = 0;
@@ -216,38 +378,39 @@ usm_process_raw(usm_ctx *ctx, buffer *in, buffer *out)
   
     if (in)
     {
-        if (ctx->agg.len + in->len > USM_AGG_MAX)
-        {
-            ERR("agg max passed, need %d\n", (int)(ctx->agg.len + in->len));
-        } else
-        {
-            buf_append(&ctx->agg, in);
-        }
+        usm_aggregate(ctx, in);
     }
     
-    ret = rr_parse(&ctx->raw_ctx, ctx->agg.len, ctx->agg.buf);
+    ret = rr_parse(&ctx->raw_ctx, &ctx->agg);
     if (ret.done)
     {
         // process only if something useful was found
         
+        if (!up_decode_rr(&ctx->proto_ctx, &ctx->raw_ctx, &ctx->code))
+        {
+            ctx->stats.frames_proto++;
+        }
+        
         if (ctx->default_frequency)
         {
             rr_set_frequency(&ctx->raw_ctx, ctx->default_frequency);
         }
         
+        if (RR_PRONTO_LEN(&ctx->raw_ctx) > out->max)
+        {
+            ERR("%u pulses don't fit the output, dropping\n", (unsigned)ctx->raw_ctx.ps.nof_pulses);
+            ctx->stats.frames_dropped++;
+            out->len = 0;
+            return;
+        }
+        
         //out->len = rr_output(&ctx->raw_ctx, out->buf);
         out->len = rr_output_pronto(&ctx->raw_ctx, out->buf);
+        usm_frame_done(ctx, &ctx->stats.frames_raw, out);
     } else
     {
         out->len = 0;
     }
-    
-    // fix up the aggregation buffer
-    buf_slide(&ctx->agg, ret.m);
-    if (ret.m != ret.n)
-    {
-        bcopy(ret.d, ctx->agg.buf, ret.n - ret.m);
-    }    
 }
 
 void
@@ -256,42 +419,169 @@ usm_process_raw2(usm_ctx *ctx, buffer *in, buffer *out)
     rr2_ret ret;
     if (in)
     {
-        if (ctx->agg.len + in->len > USM_AGG_MAX)
-        {
-            ERR("agg max passed, need %d\n", (int)(ctx->agg.len + in->len));
-        } else
-        {
-            buf_append(&ctx->agg, in);
-        }
+        usm_aggregate(ctx, in);
     }
     
     // parse the data 
-    ret = rr2_parse(&ctx->raw2_ctx, ctx->agg.len, ctx->agg.buf);
+    ret = rr2_parse(&ctx->raw2_ctx, &ctx->agg);
     if (ret.done)
     {
+        if (!up_decode_rr2(&ctx->proto_ctx, &ctx->raw2_ctx, &ctx->code))
+        {
+            ctx->stats.frames_proto++;
+        }
+        
+        if (RR2_PRONTO_LEN(&ctx->raw2_ctx) > out->max)
+        {
+            ERR("%u pulses don't fit the output, dropping\n", (unsigned)ctx->raw2_ctx.ps.nof_pulses);
+            ctx->stats.frames_dropped++;
+            out->len = 0;
+            return;
+        }
+        
         // prettify the data
         //out->len = rr2_output(&ctx->raw2_ctx, out->buf);
         out->len = rr2_output_pronto(&ctx->raw2_ctx, out->buf);
+        usm_frame_done(ctx, &ctx->stats.frames_raw2, out);
     } else
     {
         out->len = 0;
     }
-    
-    // fix up the aggregation buffer
-    buf_slide(&ctx->agg, ret.m);
-    if (ret.m != ret.n)
+}
+
+// Queue up device input for the parsers, the ring grows under bursts
+void
+usm_aggregate(usm_ctx *ctx, buffer *in)
+{
+    if (ring_append(&ctx->agg, in))
     {
-        bcopy(ret.d, ctx->agg.buf, ret.n - ret.m);
+        ERR("agg limit passed, need %d, dropping\n", (int)(RING_LEN(&ctx->agg) + in->len));
+        ctx->stats.agg_overflows++;
     }
 }
 
 void
 usm_process_thru(usm_ctx *ctx, buffer *in, buffer *out)
 {
-    // passthru response
+    UInt32 i;
+    
+    // passthru response, nothing is held back for more
+    if (!in)
+    {
+        out->len = 0;
+        return;
+    }
+    
     buf_copy(in, out);
     
-    ctx->state = USM_W_CODE;
+    switch (ctx->state)
+    {
+        case USM_W_STATUS:
+            // a status per command, in the order they were sent. TXING
+            // comes ahead of the status of a transmit.
+            for (i = 0; i < in->len  &&  ctx->replies < ctx->pending; i++)
+            {
+                if (in->buf[i] == UIRT_STATUS_TXING) continue;
+                
+                usm_status(ctx, in->buf[i]);
+                ctx->replies++;
+            }
+            break;
+        case USM_W_VER:
+            ctx->replies = 1;
+            break;
+        default:
+            return;
+    }
+    
+    // anything sent after a GET_VERSION answers with a status
+    ctx->pending -= (ctx->replies < ctx->pending ? ctx->replies : ctx->pending);
+    ctx->state = (ctx->pending ? USM_W_STATUS : USM_W_CODE);
+}
+
+// The structured form of the frame that is in out, or NULL if out is
+// something else, like a status
+usm_frame *
+usm_last_frame(usm_ctx *ctx)
+{
+    return ctx->frame_out ? &ctx->frame : NULL;
+}
+
+// How many commands the output is the answer to, oldest first. A status
+// byte answers each but GET_VERSION, which the whole output answers.
+UInt32
+usm_last_replies(usm_ctx *ctx)
+{
+    return ctx->replies;
+}
+
+// A frame went out, describe it, count it and time it from when its last
+// input came in
+void
+usm_frame_done(usm_ctx *ctx, UInt32 *count, buffer *out)
+{
+    usm_frame *f;
+    UInt64 now;
+    
+    f = &ctx->frame;
+    f->mode = ctx->mode;
+    f->ns = ctx->t_rx;
+    f->code = &ctx->code;
+    
+    switch (ctx->mode)
+    {
+        case USM_M_UIR:
+            f->ps = NULL;
+            f->unit_ns = f->freq = f->freq_conf = f->interspace = 0;
+            bcopy(out->buf, f->uir, UIRT_UIR_CODE_LEN);
+            bzero(&ctx->code, sizeof(ctx->code));
+            break;
+        case USM_M_RAW:
+            f->ps = &ctx->raw_ctx.ps;
+            f->unit_ns = 50000;
+            f->freq = ctx->raw_ctx.freq;
+            f->freq_conf = 0;
+            f->interspace = (ctx->raw_ctx.cont ? 0 : ctx->raw_ctx.interspace * 50);
+            break;
+        case USM_M_RAW2:
+            f->ps = &ctx->raw2_ctx.ps;
+            f->unit_ns = 400;
+            f->freq = ctx->raw2_ctx.calc_freq;
+            f->freq_conf = ctx->raw2_ctx.freq_conf;
+            f->interspace = (ctx->raw2_ctx.cont ? 0 : ctx->raw2_ctx.interspace * 50);
+            break;
+    }
+    ctx->frame_out = 1;
+    
+    now = u_now();
+    hist_add(&ctx->stats.decode_ns, now - ctx->t_in);
+    ctx->t_in = now;
+    
+    (*count)++;
+}
+
+void
+usm_status(usm_ctx *ctx, UInt8 status)
+{
+    hist_add(&ctx->stats.status_ns, u_now() - ctx->t_cmd);
+    
+    switch (status)
+    {
+        case UIRT_STATUS_OK:
+            ctx->stats.status_ok++;
+            break;
+        case UIRT_STATUS_CSUM_ERROR:
+            ctx->stats.status_csum_error++;
+            break;
+        case UIRT_STATUS_TO_ERROR:
+            ctx->stats.status_timeout++;
+            break;
+        case UIRT_STATUS_CMD_ERROR:
+            ctx->stats.status_cmd_error++;
+            break;
+        default:
+            ctx->stats.status_other++;
+    }
 }
 
 int
@@ -300,7 +590,7 @@ usm_checksum(buffer *buf)
 	int check = 0;
 	UInt32 i;
     
-    if (buf->len == buf->max)
+    if (buf->len >= buf->max)
     {
         ERR("Unable to append checksum, buffer not big enough\n");
         return -1;
@@ -10,24 +10,100 @@
 
 #include "uirt-raw.h"
 #include "uirt-raw2.h"
+#include "uirt-pronto.h"
+#include "uirt-proto.h"
+#include "uirt.h"
 
-#define USM_AGG_MAX (4096) 
+#define USM_AGG_MAX   (4096)    // aggregation starts out embedded
+#define USM_AGG_LIMIT (1 << 20) // and may grow on the heap up to this
+
+// Master modes
+enum {
+    USM_M_ECHO,
+    USM_M_UIR,
+    USM_M_RAW,
+    USM_M_RAW2,
+};
+
+// A received frame as the parser left it, nothing is copied. ps and code
+// are only good until the next frame.
+typedef struct usm_frame
+{
+    UInt32 mode;       // USM_M_UIR/USM_M_RAW/USM_M_RAW2
+    UInt64 ns;         // u_now() when the input that finished it was handed in
+    pstore *ps;        // pulse first and alternating, NULL in UIR mode
+    UInt32 unit_ns;    // of a ps duration, 50us for RAW and 400ns for RAW2
+    UInt32 freq;       // carrier in Hz, a guess in RAW mode
+    UInt32 freq_conf;  // 0-100, 0 when it's a guess
+    UInt32 interspace; // us of quiet before the frame, 0 if it continued the last
+    up_code *code;     // protocol decode, proto is UP_PROTO_NONE if there was none
+    UInt8 uir[UIRT_UIR_CODE_LEN]; // UIR mode only
+} usm_frame;
+
+// Duration i of a frame in us
+#define USM_FRAME_US(f, i) ((UInt32)((UInt64)ps_get((f)->ps, (i)) * (f)->unit_ns / 1000))
+
+// Counters only ever go up. They are written from the thread the device is
+// read on, and any thread may take a snapshot with usm_get_stats().
+typedef struct usm_stats
+{
+    UInt32 tx_cache_hits;      // Pronto transmits served from the cache
+    UInt32 tx_cache_misses;    // Pronto transmits converted
+    UInt32 tx_cache_evictions;
+    UInt32 commands;           // sent to the device
+    UInt32 frames_uir;         // decoded, per mode
+    UInt32 frames_raw;
+    UInt32 frames_raw2;
+    UInt32 frames_proto;       // of those, named by a protocol decoder
+    UInt32 frames_dropped;     // too long for the output
+    UInt32 agg_overflows;      // device input dropped at USM_AGG_LIMIT
+    UInt32 status_ok;          // device replies to commands
+    UInt32 status_csum_error;
+    UInt32 status_timeout;
+    UInt32 status_cmd_error;
+    UInt32 status_other;
+    hist   decode_ns;          // in the call that finished a frame
+    hist   status_ns;          // from a command to its status
+} usm_stats;
 
 typedef struct usm_ctx
 {
     UInt32 mode; // master mode (USM_M_RAW2/USM_M_RAW/USM_M_UIR)
     UInt32 state;
     UInt32 default_frequency;
-    buffer agg;
+    ring   agg;
     UInt8  agg_buf[USM_AGG_MAX];
     rr_ctx raw_ctx;
     rr2_ctx raw2_ctx;
+    rp_ctx pronto_ctx;
+    up_ctx proto_ctx;
+    up_code code; // protocol decode of the last received frame
+    UInt32 toggle; // RC5/RC6 toggle bit of the next protocol transmit
+    lru    tx_cache; // Pronto transmits already turned into TX_RAW
+    UInt64 t_in;  // when the input being processed arrived, or a frame was last put out
+    UInt64 t_cmd; // when the command awaiting status was sent
+    UInt64 t_rx;  // when the input being processed was handed in
+    usm_frame frame;
+    int frame_out; // the output of the last process call is frame
+    UInt32 pending; // commands sent and not answered yet
+    UInt32 replies; // commands the output of the last process call answered
+    usm_stats stats;
 } usm_ctx;
 
 void usm_init(usm_ctx *ctx);
+void usm_deinit(usm_ctx *ctx);
 void usm_process_uirt(usm_ctx *ctx, buffer *in, buffer *out);
 void usm_process_uirt_more(usm_ctx *ctx, buffer *out);
 void usm_process_user(usm_ctx *ctx, buffer *in, buffer *out);
+void usm_encode_user(usm_ctx *ctx, buffer *in, buffer *out);
+void usm_command_sent(usm_ctx *ctx, UInt8 op);
+int  usm_checksum(buffer *buf);
+void usm_get_stats(usm_ctx *ctx, usm_stats *stats);
+void usm_set_mode(usm_ctx *ctx, UInt32 mode, UInt32 state);
+usm_frame *usm_last_frame(usm_ctx *ctx);
+UInt32 usm_last_replies(usm_ctx *ctx);
+void usm_command_lost(usm_ctx *ctx);
+UInt32 usm_airtime(UInt8 *d, UInt32 len);
 
 
 void usm_set_default_frequency(usm_ctx *ctx, UInt32 frequency);
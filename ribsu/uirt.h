@@ -34,6 +34,8 @@
 #define UIRT_CMD_O_LENGTH        (1)
 #define UIRT_CMD_TX_RAW_O_LENGTH (6)
 
+#define UIRT_TX_RAW_DATA_MAX (0xff - 6) // the length byte counts the 6 ahead of the data too
+
 #pragma pack(1)
 
 typedef struct uirt_tx_cmd
@@ -6,20 +6,69 @@
  */
 
 
-#include <CoreFoundation/CoreFoundation.h>
+#include <unistd.h>
+
+#include "platform.h"
+
+#ifdef __APPLE__
 #include <IOKit/IOCFPlugIn.h>
 
 #include <IOKit/usb/IOUSBLib.h>
 
-#include <unistd.h>
-
 #include "printInterpretedError.h"
+#endif
+
 #include "debug.h"
 #include "ribsu-util.h"
+#include "usb.h"
 
 #define MODULE_NAME usb
 DBG_MODULE_DEFINE();
 
+#ifndef __APPLE__
+
+// Direct USB access is done through I/O kit. Elsewhere the kernel FTDI driver
+// owns the device, so fail here and let ribsu_init() fall back to the TTY.
+
+int 
+usb_add_source(void **ctx0, UInt32 vid, UInt32 pid)
+{
+    (void)vid;
+    (void)pid;
+    *ctx0 = NULL;
+    
+    DBG("No direct USB support on this platform\n");
+    
+    return -1;
+}
+
+int
+usb_set_callback(void *ctx0, void (*fn)(void *, buffer *), void *fn_arg)
+{
+    (void)ctx0;
+    (void)fn;
+    (void)fn_arg;
+    
+    return -1;
+}
+
+int  
+usb_write(void *ctx0, buffer *buf)
+{
+    (void)ctx0;
+    (void)buf;
+    
+    return -1;
+}
+
+void
+usb_shutdown(void *ctx0)
+{
+    (void)ctx0;
+}
+
+#else
+
 // Set this flag to get more status messages
 #define VERBOSE 0
 
@@ -86,7 +135,7 @@ typedef struct usb_ctx
 
 static int getInterface(io_iterator_t interfaceIterator, IOUSBInterfaceInterface ***intf0);
 static IOUSBInterfaceInterface **getUSBInterfaceInterface(io_service_t usbInterface);
-static Boolean isThisTheInterfaceYoureLookingFor(IOUSBInterfaceInterface **intf);
+static Boolean isThisTheInterfaceYoureLookingFor(IOUSBInterfaceInterface **intf, Boolean *foundOnce);
 static int openUSBInterface(IOUSBInterfaceInterface **intf);
 static int initFTDI(IOUSBInterfaceInterface **intf);
 static int initUIRT(usb_ctx *ctx);
@@ -95,8 +144,6 @@ static unsigned ftdi_232bm_baud_base_to_divisor(unsigned baud, int base);
 static int async_read(usb_ctx *ctx);
 static void usb_read_callback(void *refCon, IOReturn result, void *arg0);
 
-CFSocketContext stdinContext;
-
 int 
 usb_add_source(void **ctx0, UInt32 vid, UInt32 pid)
 {
@@ -114,7 +161,7 @@ usb_add_source(void **ctx0, UInt32 vid, UInt32 pid)
     ctx = malloc(sizeof(*ctx));
     if (!ctx)
     {
-        ERR("No memory\n");
+        U_NOMEM();
         error = -1;
         goto out;
     }
@@ -278,10 +325,12 @@ getInterface(io_iterator_t interfaceIterator, IOUSBInterfaceInterface ***intf0)
 {
     IOUSBInterfaceInterface **intf;
     io_service_t usbInterface;
+    Boolean foundOnce;
     int err = 0;
     
     *intf0 = NULL;
     intf = NULL;
+    foundOnce = false; // per search, every device gets its own
     
     usbInterface = IOIteratorNext(interfaceIterator);
     if (usbInterface == 0)
@@ -297,7 +346,7 @@ getInterface(io_iterator_t interfaceIterator, IOUSBInterfaceInterface ***intf0)
         if (intf != nil)
         {
             // Don't release the interface here. That's one too many releases and causes set alt interface to fail
-            if (isThisTheInterfaceYoureLookingFor(intf))
+            if (isThisTheInterfaceYoureLookingFor(intf, &foundOnce))
             {
                 err = openUSBInterface(intf);
                 *intf0 = intf;
@@ -347,21 +396,20 @@ getUSBInterfaceInterface(io_service_t usbInterface)
 }
 
 Boolean 
-isThisTheInterfaceYoureLookingFor(IOUSBInterfaceInterface **intf)
+isThisTheInterfaceYoureLookingFor(IOUSBInterfaceInterface **intf, Boolean *foundOnce)
 {
     //	Check to see if this is the interface you're interested in
     //  This code is only expecting one interface, so returns true
     //  the first time.
     //  You code could check the nature and type of endpoints etc
     
-    static Boolean foundOnce  = false;
-    if (foundOnce)
+    if (*foundOnce)
     {
         LOG("Subsequent interface found, we're only intersted in 1 of them\n");
         return false;
     }
     
-    foundOnce = true;
+    *foundOnce = true;
     return true;
 }
 
@@ -621,5 +669,4 @@ usb_read_callback(void *refCon, IOReturn result, void *arg0)
     }
 }
 
-
-
+#endif
@@ -0,0 +1,822 @@
+/* Copyright (C) 2007 xyster.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* Microbenchmarks for the codec and state machine hot paths. Every result
+ * goes to stdout as one JSON object per line so runs can be diffed and
+ * checked by scripts, anything meant for humans goes to stderr.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "platform.h"
+
+#include "debug.h"
+#include "ribsu-util.h"
+#include "uirt.h"
+#include "uirt-raw.h"
+#include "uirt-raw2.h"
+#include "uirt-pronto.h"
+#include "uirt-proto.h"
+#include "uirt-lib.h"
+#include "uirt-pack.h"
+#include "uirt-sm.h"
+#include "capture.h"
+
+#define MODULE_NAME bench
+DBG_MODULE_DEFINE();
+
+#define BENCH_STREAM_MAX (64 * 1024)
+#define BENCH_FRAME_MAX  (1024)
+#define BENCH_CHUNK      (64)  // bytes per read, the FTDI packet size
+#define BENCH_CODES      (48)  // transmissions per generated stream
+#define BENCH_REPEATS    (2)   // NEC repeat frames after each code
+#define BENCH_LIB_CODES  (32768) // learned codes to look frames up in
+
+typedef struct bench_data
+{
+    buffer raw;                 // captured RAW mode stream
+    buffer raw2;                // captured RAW2 mode stream
+    UInt32 raw_frames;
+    UInt32 raw2_frames;
+    buffer pronto;              // a decoded code in pronto, as users send it
+    buffer tx;                  // the same code as TX_RAW, as the device gets it
+    rr_ctx rr;                  // one parsed frame of each kind for the outputs
+    rr2_ctx rr2;
+    rp_ctx rp;
+    UInt32 seed;
+} bench_data;
+
+typedef struct bench_result
+{
+    UInt32 frames;
+    UInt32 bytes;
+} bench_result;
+
+typedef struct bench
+{
+    const char *name;
+    void (*fn)(bench_data *data, bench_result *res);
+} bench;
+
+static void bench_rr_parse(bench_data *data, bench_result *res);
+static void bench_rr2_parse(bench_data *data, bench_result *res);
+static void bench_rp_parse(bench_data *data, bench_result *res);
+static void bench_rr_output(bench_data *data, bench_result *res);
+static void bench_rr2_output_pronto(bench_data *data, bench_result *res);
+static void bench_rp_output(bench_data *data, bench_result *res);
+static void bench_up_decode(bench_data *data, bench_result *res);
+static void bench_up_encode(bench_data *data, bench_result *res);
+static void bench_ul_lookup(bench_data *data, bench_result *res);
+static void bench_pk_encode(bench_data *data, bench_result *res);
+static void bench_pk_decode(bench_data *data, bench_result *res);
+static void bench_usm_checksum(bench_data *data, bench_result *res);
+static void bench_buf2hex(bench_data *data, bench_result *res);
+static void bench_hex2buf(bench_data *data, bench_result *res);
+static void bench_usm_raw(bench_data *data, bench_result *res);
+static void bench_usm_raw2(bench_data *data, bench_result *res);
+static void bench_usm_tx_pronto(bench_data *data, bench_result *res);
+static void bench_cap_replay(bench_data *data, bench_result *res);
+static void bench_dbg_trace(bench_data *data, bench_result *res);
+
+static const bench benches[] = {
+    { "rr_parse",          bench_rr_parse },
+    { "rr2_parse",         bench_rr2_parse },
+    { "rp_parse",          bench_rp_parse },
+    { "rr_output",         bench_rr_output },
+    { "rr2_output_pronto", bench_rr2_output_pronto },
+    { "rp_output",         bench_rp_output },
+    { "up_decode",         bench_up_decode },
+    { "up_encode",         bench_up_encode },
+    { "ul_lookup",         bench_ul_lookup },
+    { "pk_encode",         bench_pk_encode },
+    { "pk_decode",         bench_pk_decode },
+    { "usm_checksum",      bench_usm_checksum },
+    { "u_buf2hex",         bench_buf2hex },
+    { "u_hex2buf",         bench_hex2buf },
+    { "usm_raw",           bench_usm_raw },
+    { "usm_raw2",          bench_usm_raw2 },
+    { "usm_tx_pronto",     bench_usm_tx_pronto },
+    { "cap_replay",        bench_cap_replay },
+    { "dbg_trace",         bench_dbg_trace },
+};
+
+static int    bench_setup(bench_data *data, const char *raw_file, const char *raw2_file);
+static int    bench_load(buffer *buf, const char *name);
+static UInt32 bench_count(buffer *stream, UInt8 mode_cmd);
+static void   bench_gen_raw(bench_data *data, buffer *buf);
+static void   bench_gen_raw2(bench_data *data, buffer *buf);
+static UInt32 bench_jitter(bench_data *data, UInt32 v);
+static double bench_now(void);
+static char  *bench_rate(char *s, size_t max, const char *fmt, double n, double d);
+void usage(void);
+
+int
+main(int argc, char **argv)
+{
+    bench_data *data;
+    bench_result res;
+    UInt64 frames, bytes;
+    const char *only, *raw_file, *raw2_file;
+    double min_time, t0, t;
+    char ns_per_frame[32], bytes_per_sec[32];
+    UInt32 i, iters;
+    int f;
+
+    only = raw_file = raw2_file = NULL;
+    min_time = 0.2;
+
+    while ((f = getopt(argc, argv, "b:r:R:t:d")) >= 0)
+    {
+        switch (f)
+        {
+            case 'b':
+                only = optarg;
+                break;
+            case 'r':
+                raw_file = optarg;
+                break;
+            case 'R':
+                raw2_file = optarg;
+                break;
+            case 't':
+                min_time = strtod(optarg, NULL) / 1000.0;
+                break;
+            case 'd':
+                dbg_level_bench++;
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    data = malloc(sizeof(*data));
+    if (!data)
+    {
+        ERR("No memory\n");
+        return 1;
+    }
+
+    if (bench_setup(data, raw_file, raw2_file)) return 1;
+
+    for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
+    {
+        if (only  &&  strcmp(only, benches[i].name)) continue;
+
+        // warm up, then run whole passes until enough time has gone by
+        benches[i].fn(data, &res);
+
+        frames = bytes = 0;
+        iters = 0;
+        t0 = bench_now();
+        do
+        {
+            benches[i].fn(data, &res);
+            frames += res.frames;
+            bytes += res.bytes;
+            iters++;
+            t = bench_now() - t0;
+        } while (t < min_time  ||  t <= 0);
+
+        printf("{\"bench\": \"%s\", \"iters\": %u, \"frames\": %llu, \"bytes\": %llu, "
+               "\"sec\": %.6f, \"ns_per_frame\": %s, \"bytes_per_sec\": %s}\n",
+               benches[i].name, (unsigned)iters, (unsigned long long)frames, (unsigned long long)bytes, t,
+               bench_rate(ns_per_frame, sizeof(ns_per_frame), "%.1f", t * 1e9, frames),
+               bench_rate(bytes_per_sec, sizeof(bytes_per_sec), "%.0f", bytes, t));
+        fflush(stdout);
+    }
+
+    free(data);
+
+    return 0;
+}
+
+void
+bench_rr_parse(bench_data *data, bench_result *res)
+{
+    static ring in;
+    static UInt8 in_buf[BENCH_STREAM_MAX];
+    static rr_ctx ctx; // the pulse arena is kept between passes
+    rr_ret ret;
+
+    ring_attach(&in, sizeof(in_buf), in_buf, sizeof(in_buf));
+    ring_append(&in, &data->raw);
+
+    rr_init(&ctx, 0, NULL);
+    res->frames = 0;
+    res->bytes = data->raw.len;
+
+    do
+    {
+        ret = rr_parse(&ctx, &in);
+        res->frames += ret.done;
+    } while (ret.done);
+}
+
+void
+bench_rr2_parse(bench_data *data, bench_result *res)
+{
+    static ring in;
+    static UInt8 in_buf[BENCH_STREAM_MAX];
+    static rr2_ctx ctx;
+    rr2_ret ret;
+
+    ring_attach(&in, sizeof(in_buf), in_buf, sizeof(in_buf));
+    ring_append(&in, &data->raw2);
+
+    rr2_init(&ctx, 0, NULL);
+    res->frames = 0;
+    res->bytes = data->raw2.len;
+
+    do
+    {
+        ret = rr2_parse(&ctx, &in);
+        res->frames += ret.done;
+    } while (ret.done);
+}
+
+void
+bench_rp_parse(bench_data *data, bench_result *res)
+{
+    static rp_ctx ctx;
+
+    rp_parse(&ctx, data->pronto.len, data->pronto.buf);
+
+    res->frames = 1;
+    res->bytes = data->pronto.len;
+}
+
+void
+bench_pk_encode(bench_data *data, bench_result *res)
+{
+    UInt8 d[PK_MAX(2 * BENCH_FRAME_MAX)];
+
+    res->frames = 1;
+    res->bytes = pk_from_rp(&data->rp, d, sizeof(d));
+}
+
+// The same code as rp_parse, packed
+void
+bench_pk_decode(bench_data *data, bench_result *res)
+{
+    static UInt8 d[PK_MAX(2 * BENCH_FRAME_MAX)];
+    static UInt32 len;
+    static rp_ctx ctx;
+
+    if (!len)
+    {
+        len = pk_from_rp(&data->rp, d, sizeof(d));
+    }
+
+    pk_to_rp(&ctx, d, len);
+
+    res->frames = 1;
+    res->bytes = len;
+}
+
+void
+bench_rr_output(bench_data *data, bench_result *res)
+{
+    UInt8 d[BENCH_FRAME_MAX];
+
+    res->frames = 1;
+    res->bytes = rr_output(&data->rr, d);
+}
+
+void
+bench_rr2_output_pronto(bench_data *data, bench_result *res)
+{
+    UInt8 d[BENCH_FRAME_MAX];
+
+    res->frames = 1;
+    res->bytes = rr2_output_pronto(&data->rr2, d);
+}
+
+void
+bench_rp_output(bench_data *data, bench_result *res)
+{
+    UInt8 d[BENCH_FRAME_MAX];
+
+    res->frames = 1;
+    res->bytes = rp_output(&data->rp, d);
+}
+
+void
+bench_up_decode(bench_data *data, bench_result *res)
+{
+    static up_ctx ctx;
+    up_code code;
+
+    res->frames = !up_decode_rr2(&ctx, &data->rr2, &code);
+    res->bytes = 0;
+}
+
+// The NEC code of the generated captures, straight to TX_RAW
+void
+bench_up_encode(bench_data *data, bench_result *res)
+{
+    UInt8 d[BENCH_FRAME_MAX];
+    up_code code;
+
+    (void)data;
+    bzero(&code, sizeof(code));
+    code.proto = UP_PROTO_NEC;
+    code.address = 0xff;
+
+    res->frames = 1;
+    res->bytes = up_encode(&code, 1, d, sizeof(d));
+}
+
+// The captured NEC frame against a library of BENCH_LIB_CODES NEC codes,
+// the frame's own code among them
+void
+bench_ul_lookup(bench_data *data, bench_result *res)
+{
+    static ul_lib lib;
+    static pstore ps;
+    UInt32 code, bits, i, id;
+
+    if (!lib.nof)
+    {
+        for (code = 0; code < BENCH_LIB_CODES; code++)
+        {
+            bits = 0x00ff | ((code >> 8) << 8) | ((code & 0xff) << 16) | ((~code & 0xff) << 24);
+
+            ps_reset(&ps);
+            ps_add_pulse(&ps, 0x57e4); // 400ns units as in bench_gen_raw2()
+            ps_add_space(&ps, 0x2bf2);
+            for (i = 0; i < 32; i++)
+            {
+                ps_add_pulse(&ps, 0x0578);
+                ps_add_space(&ps, (bits >> i) & 1 ? 0x1081 : 0x0578);
+            }
+            ps_add_pulse(&ps, 0x0578);
+
+            ul_add(&lib, code, &ps, 400);
+        }
+    }
+
+    res->frames = !ul_lookup_rr2(&lib, &data->rr2, &id);
+    res->bytes = 0;
+}
+
+void
+bench_usm_checksum(bench_data *data, bench_result *res)
+{
+    buffer out;
+    UInt8 d[BENCH_FRAME_MAX];
+
+    buf_attach(&out, sizeof(d), d);
+    buf_copy(&data->tx, &out);
+    usm_checksum(&out);
+
+    res->frames = 1;
+    res->bytes = data->tx.len;
+}
+
+void
+bench_buf2hex(bench_data *data, bench_result *res)
+{
+    buffer hex;
+    UInt8 d[2 * BENCH_FRAME_MAX + 1];
+
+    buf_attach(&hex, sizeof(d), d);
+    u_buf2hex(&data->pronto, &hex);
+
+    res->frames = 1;
+    res->bytes = data->pronto.len;
+}
+
+void
+bench_hex2buf(bench_data *data, bench_result *res)
+{
+    static buffer hex;
+    static UInt8 hex_buf[2 * BENCH_FRAME_MAX + 1];
+    buffer out;
+    UInt8 d[BENCH_FRAME_MAX];
+
+    if (!hex.buf)
+    {
+        buf_attach(&hex, sizeof(hex_buf), hex_buf);
+        u_buf2hex(&data->pronto, &hex);
+        hex.len++; // the NUL
+    }
+
+    buf_attach(&out, sizeof(d), d);
+    u_hex2buf(&hex, &out);
+
+    res->frames = 1;
+    res->bytes = out.len;
+}
+
+// Feed a captured stream through the state machine a packet at a time, the
+// way the TTY and USB read callbacks do
+static void
+bench_usm(buffer *stream, UInt8 mode_cmd, bench_result *res)
+{
+    static usm_ctx ctx;
+    buffer in, out;
+    UInt8 cmd[2], out_buf[BENCH_FRAME_MAX];
+    UInt32 n;
+
+    usm_init(&ctx);
+
+    buf_attach(&out, sizeof(out_buf), out_buf);
+    buf_attach(&in, sizeof(cmd), cmd);
+    cmd[0] = mode_cmd;
+    in.len = 1;
+    usm_process_user(&ctx, &in, &out);
+    cmd[0] = UIRT_STATUS_OK;
+    in.len = 1;
+    usm_process_uirt(&ctx, &in, &out);
+
+    res->frames = 0;
+    res->bytes = stream->len;
+
+    for (n = 0; n < stream->len; n += in.len)
+    {
+        in.buf = stream->buf + n;
+        in.len = stream->len - n < BENCH_CHUNK ? stream->len - n : BENCH_CHUNK;
+        in.max = in.len;
+
+        usm_process_uirt(&ctx, &in, &out);
+        while (out.len)
+        {
+            res->frames++;
+            usm_process_uirt_more(&ctx, &out);
+        }
+    }
+
+    usm_deinit(&ctx);
+}
+
+void
+bench_usm_raw(bench_data *data, bench_result *res)
+{
+    bench_usm(&data->raw, UIRT_CMD_MODE_RAW, res);
+}
+
+void
+bench_usm_raw2(bench_data *data, bench_result *res)
+{
+    bench_usm(&data->raw2, UIRT_CMD_MODE_RAW2, res);
+}
+
+// Resending the same Pronto code, all but the first are cache hits
+void
+bench_usm_tx_pronto(bench_data *data, bench_result *res)
+{
+    static usm_ctx ctx;
+    static int init;
+    buffer out;
+    UInt8 out_buf[BENCH_FRAME_MAX];
+
+    if (!init)
+    {
+        usm_init(&ctx);
+        init = 1;
+    }
+
+    buf_attach(&out, sizeof(out_buf), out_buf);
+    usm_process_user(&ctx, &data->pronto, &out);
+
+    res->frames = 1;
+    res->bytes = out.len;
+}
+
+// The RAW2 stream recorded once, a packet per record, then replayed flat out
+void
+bench_cap_replay(bench_data *data, bench_result *res)
+{
+    static void *cap;
+    static UInt32 bytes;
+    char path[] = "/tmp/ribsu_bench.XXXXXX";
+    usm_ctx *ctx;
+    buffer in, out;
+    UInt8 cmd[2], out_buf[BENCH_FRAME_MAX];
+    void *rec;
+    UInt32 n;
+    int fd;
+
+    ctx = malloc(sizeof(*ctx));
+    if (!ctx) return;
+    usm_init(ctx);
+
+    if (!cap)
+    {
+        fd = mkstemp(path);
+        if (fd < 0) goto out;
+        close(fd);
+
+        if (cap_open(&rec, path)) goto out;
+
+        buf_attach(&out, sizeof(out_buf), out_buf);
+        buf_attach(&in, sizeof(cmd), cmd);
+        cmd[0] = UIRT_CMD_MODE_RAW2;
+        in.len = 1;
+        usm_process_user(ctx, &in, &out);
+        cmd[0] = UIRT_STATUS_OK;
+        in.len = 1;
+        usm_process_uirt(ctx, &in, &out);
+
+        for (n = 0; n < data->raw2.len; n += in.len)
+        {
+            in.buf = data->raw2.buf + n;
+            in.len = data->raw2.len - n < BENCH_CHUNK ? data->raw2.len - n : BENCH_CHUNK;
+            in.max = in.len;
+
+            cap_record(rec, ctx->mode, ctx->state, &in);
+        }
+        cap_close(rec);
+
+        if (cap_map(&cap, path)) goto out;
+        unlink(path);
+        bytes = data->raw2.len;
+    }
+
+    cap_rewind(cap);
+    res->frames = cap_replay(cap, ctx, 0, NULL, NULL);
+    res->bytes = bytes;
+
+out:
+    usm_deinit(ctx);
+    free(ctx);
+}
+
+// A DBG() line of the RAW2 parser as it goes into the trace ring, the writer
+// formats to /dev/null and whatever it can't keep up with is dropped
+void
+bench_dbg_trace(bench_data *data, bench_result *res)
+{
+    static FILE *null;
+
+    if (!null)
+    {
+        null = fopen("/dev/null", "w");
+        if (!null  ||  dbg_ring_start(null, 0)) return;
+    }
+
+    dbg_trace("DBG: uirt_raw2: ribsu/uirt-raw2.c(381): calc_freq = %u, confidence %u%%",
+              (unsigned)data->rr2.calc_freq, (unsigned)data->rr2.freq_conf);
+
+    res->frames = 1;
+    res->bytes = 0;
+}
+
+int
+bench_setup(bench_data *data, const char *raw_file, const char *raw2_file)
+{
+    static UInt8 raw_buf[BENCH_STREAM_MAX], raw2_buf[BENCH_STREAM_MAX];
+    static UInt8 pronto_buf[BENCH_FRAME_MAX], tx_buf[BENCH_FRAME_MAX];
+    ring in;
+    UInt8 in_buf[BENCH_STREAM_MAX];
+
+    bzero(data, sizeof(*data));
+    data->seed = 1;
+
+    buf_attach(&data->raw, sizeof(raw_buf), raw_buf);
+    buf_attach(&data->raw2, sizeof(raw2_buf), raw2_buf);
+    buf_attach(&data->pronto, sizeof(pronto_buf), pronto_buf);
+    buf_attach(&data->tx, sizeof(tx_buf), tx_buf);
+
+    if (raw_file)
+    {
+        if (bench_load(&data->raw, raw_file)) return -1;
+    } else
+    {
+        bench_gen_raw(data, &data->raw);
+    }
+
+    if (raw2_file)
+    {
+        if (bench_load(&data->raw2, raw2_file)) return -1;
+    } else
+    {
+        bench_gen_raw2(data, &data->raw2);
+    }
+
+    data->raw_frames = bench_count(&data->raw, UIRT_CMD_MODE_RAW);
+    data->raw2_frames = bench_count(&data->raw2, UIRT_CMD_MODE_RAW2);
+    if (!data->raw_frames  ||  !data->raw2_frames)
+    {
+        ERR("No complete frames in the RAW (%u) or RAW2 (%u) stream\n",
+            (unsigned)data->raw_frames, (unsigned)data->raw2_frames);
+        return -1;
+    }
+
+    // the first frame of each stream stands in for the output benchmarks
+    ring_attach(&in, sizeof(in_buf), in_buf, sizeof(in_buf));
+    ring_append(&in, &data->raw);
+    rr_init(&data->rr, 0, NULL);
+    rr_parse(&data->rr, &in);
+
+    ring_reset(&in);
+    ring_append(&in, &data->raw2);
+    rr2_init(&data->rr2, 0, NULL);
+    rr2_parse(&data->rr2, &in);
+
+    data->pronto.len = rr2_output_pronto(&data->rr2, data->pronto.buf);
+    rp_parse(&data->rp, data->pronto.len, data->pronto.buf);
+    data->tx.len = rp_output(&data->rp, data->tx.buf);
+
+    LOG("RAW %u bytes, %u frames, RAW2 %u bytes, %u frames, pronto %u bytes\n",
+        (unsigned)data->raw.len, (unsigned)data->raw_frames,
+        (unsigned)data->raw2.len, (unsigned)data->raw2_frames, (unsigned)data->pronto.len);
+
+    return 0;
+}
+
+int
+bench_load(buffer *buf, const char *name)
+{
+    FILE *fp;
+
+    fp = fopen(name, "rb");
+    if (!fp)
+    {
+        ERR("Failed to open %s\n", name);
+        return -1;
+    }
+
+    buf->len = fread(buf->buf, 1, buf->max, fp);
+    fclose(fp);
+
+    if (buf->len == buf->max)
+    {
+        ERR("%s is larger than %u bytes\n", name, (unsigned)buf->max);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Complete frames in a stream, as the state machine reports them
+UInt32
+bench_count(buffer *stream, UInt8 mode_cmd)
+{
+    bench_result res;
+
+    bench_usm(stream, mode_cmd, &res);
+
+    return res.frames;
+}
+
+/* Generated streams mimic a remote held down briefly: NEC codes, each
+ * followed by repeat frames, with a tick of jitter on every element like a
+ * real capture has. Frames are separated by long spaces and a transmission
+ * ends with the end of code marker.
+ */
+void
+bench_gen_raw(bench_data *data, buffer *buf)
+{
+    UInt32 code, rpt, bits, i, n;
+    UInt8 *d;
+
+    d = buf->buf;
+    n = 0;
+
+    for (code = 0; code < BENCH_CODES; code++)
+    {
+        bits = 0x00ff | (code << 16) | ((~code & 0xff) << 24);
+
+        d[n++] = 0x03; // interspace 40ms
+        d[n++] = 0x20;
+        d[n++] = bench_jitter(data, 180); // 9ms leader
+        d[n++] = bench_jitter(data, 90);  // 4.5ms
+
+        for (i = 0; i < 32; i++)
+        {
+            d[n++] = bench_jitter(data, 11);
+            d[n++] = bench_jitter(data, (bits >> i) & 1 ? 34 : 11);
+        }
+
+        d[n++] = bench_jitter(data, 11); // stop bit
+
+        for (rpt = 0; rpt < BENCH_REPEATS; rpt++)
+        {
+            d[n++] = 0xfe; // long space, the repeat follows without an interspace
+            d[n++] = bench_jitter(data, 180);
+            d[n++] = bench_jitter(data, 45); // 2.25ms
+            d[n++] = bench_jitter(data, 11);
+        }
+
+        d[n++] = 0xff; // end of code
+    }
+
+    buf->len = n;
+}
+
+void
+bench_gen_raw2(bench_data *data, buffer *buf)
+{
+    UInt32 code, rpt, bits, i, n, t;
+    UInt8 *d;
+
+    d = buf->buf;
+    n = 0;
+
+    for (code = 0; code < BENCH_CODES; code++)
+    {
+        bits = 0x00ff | (code << 16) | ((~code & 0xff) << 24);
+
+        d[n++] = 0x03; // interspace 40ms
+        d[n++] = 0x0d;
+
+        t = bench_jitter(data, 0x57e4); // 9ms leader, 342 cycles
+        d[n++] = t >> 8;
+        d[n++] = t & 0xff;
+        d[n++] = 0x81;
+        d[n++] = 0x56;
+        t = bench_jitter(data, 0x2bf2); // 4.5ms
+        d[n++] = t >> 8;
+        d[n++] = t & 0xff;
+
+        for (i = 0; i < 33; i++)
+        {
+            t = bench_jitter(data, 0x0578); // 560us, 21 cycles
+            d[n++] = t >> 8;
+            d[n++] = t & 0xff;
+            d[n++] = 0x15;
+            if (i == 32) break; // stop bit
+
+            t = bench_jitter(data, (bits >> i) & 1 ? 0x1081 : 0x0578);
+            d[n++] = t >> 8;
+            d[n++] = t & 0xff;
+        }
+
+        for (rpt = 0; rpt < BENCH_REPEATS; rpt++)
+        {
+            d[n++] = 0x9c; // long space, the repeat follows without an interspace
+            d[n++] = 0x40;
+            t = bench_jitter(data, 0x57e4);
+            d[n++] = t >> 8;
+            d[n++] = t & 0xff;
+            d[n++] = 0x81;
+            d[n++] = 0x56;
+            t = bench_jitter(data, 0x15f9); // 2.25ms
+            d[n++] = t >> 8;
+            d[n++] = t & 0xff;
+            t = bench_jitter(data, 0x0578);
+            d[n++] = t >> 8;
+            d[n++] = t & 0xff;
+            d[n++] = 0x15;
+        }
+
+        d[n++] = 0xff; // end of code
+    }
+
+    buf->len = n;
+}
+
+// v give or take a tick, from a fixed seed so every run sees the same data
+UInt32
+bench_jitter(bench_data *data, UInt32 v)
+{
+    data->seed = data->seed * 1103515245 + 12345;
+
+    return v + ((data->seed >> 16) % 3) - 1;
+}
+
+double
+bench_now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// n / d as JSON, null where there is no rate, such as bytes of a bench
+// that moves none
+char *
+bench_rate(char *s, size_t max, const char *fmt, double n, double d)
+{
+    if (n > 0  &&  d > 0)
+    {
+        snprintf(s, max, fmt, n / d);
+    } else
+    {
+        snprintf(s, max, "null");
+    }
+
+    return s;
+}
+
+void
+usage(void)
+{
+    USG("ribsu_bench [-b <name>] [-r <file>] [-R <file>] [-t <msec>] [-d]\n"
+        "\t-b run only the named benchmark\n"
+        "\t-r use a captured RAW mode stream instead of the generated one\n"
+        "\t-R use a captured RAW2 mode stream instead of the generated one\n"
+        "\t-t minimum run time per benchmark in milliseconds (default 200)\n"
+        "\t-d increment debug level\n");
+}
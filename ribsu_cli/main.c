@@ -7,7 +7,9 @@
 
 #include <stdio.h>
 #include <unistd.h>
-#include <CoreFoundation/CoreFoundation.h>
+#include <errno.h>
+#include <signal.h>
+#include "platform.h"
 
 #include "debug.h"
 #include "ribsu-util.h"
@@ -15,26 +17,59 @@
 #include "tty.h"
 #include "uirt-raw.h"
 #include "uirt-sm.h"
+#include "uirt-emu.h"
+#include "capture.h"
 #include "ribsu.h"
+#include "ribsu-mgr.h"
 
 #define MODULE_NAME main
 DBG_MODULE_DEFINE();
 
-ribsu_ctx ribsu;
+// Everything the callbacks share, handed to each of them
+typedef struct cli_ctx
+{
+    ribsu_ctx *ribsu; // the device typed in commands go to
+    void *mgr;        // every device with -m, NULL otherwise
+    FILE *in;
+    int learning; // a learn was started from stdin and hasn't finished
+    
+    // The last command typed in, resent back to back by B
+    struct {
+        buffer cmd;
+        UInt8 cmd_buf[RIBSU_CMD_MAX];
+        UInt32 left;  // still to queue
+        UInt32 out;   // queued and not done
+        UInt32 errors;
+        UInt64 t0;
+    } burst;
+} cli_ctx;
 
 static void ribsu_read_callback(void *ctx0, buffer *buf);
-void stdin_read_callback(CFSocketRef s, 
-                         CFSocketCallBackType callbackType, 
-                         CFDataRef address, 
-                         const void *data, 
-                         void *info);
+static void ribsu_frame_callback(void *ctx0, usm_frame *fr);
+static void ribsu_done_callback(void *ctx0, int status, UInt64 latency_ns);
+static void burst_done_callback(void *ctx0, int status, UInt64 latency_ns);
+static void burst_fill(cli_ctx *cli);
+static void mgr_read(void *ctx0, UInt32 id, buffer *buf);
+static void mgr_select(cli_ctx *cli, const char *which);
+static int  mgr_open(cli_ctx *cli, int emulate, UInt32 emu_usec, UInt32 emu_count, void **emu, int frames);
+static int  replay_capture(cli_ctx *cli, const char *path, UInt32 flags);
+static void print_stats(cli_ctx *cli);
+static void print_hist(const char *name, hist *h);
+void stdin_read_callback(int fd, void *info);
 void signal_handler(int sigraised);
 void usage(void);
 
 int 
 main(int argc, char **argv)
 {
-    int f;
+    int f, emulate, frames, manage;
+    UInt32 emu_usec, emu_count, replay_flags, i;
+    void *emu[MGR_MAX_DEVICES];
+    ribsu_ctx one;
+    cli_ctx cli;
+    const char *record, *replay, *log;
+    FILE *log_fp;
+    buffer emu_dev;
     ribsu_opts opts;
     sig_t old_handler;
     
@@ -45,8 +80,19 @@ main(int argc, char **argv)
     }
     
     bzero(&opts, sizeof(opts));
+    bzero(&cli, sizeof(cli));
+    buf_attach(&cli.burst.cmd, sizeof(cli.burst.cmd_buf), cli.burst.cmd_buf);
+    emulate = 0;
+    emu_usec = 0;
+    emu_count = 1;
+    bzero(emu, sizeof(emu));
+    manage = 0;
+    record = replay = log = NULL;
+    log_fp = NULL;
+    replay_flags = 0;
+    frames = 0;
     
-    while ((f = getopt(argc, argv, "ut:v:p:d")) >= 0)
+    while ((f = getopt(argc, argv, "ut:v:p:de:n:mc:r:R:l:f")) >= 0)
     {
         switch (f)
         {
@@ -59,7 +105,7 @@ main(int argc, char **argv)
                 opts.use_tty = 1;
                 if (optarg[0] != '-')
                 {
-                    strlcpy(opts.tty_dev_name, optarg, sizeof(opts.tty_dev_name));
+                    snprintf(opts.tty_dev_name, sizeof(opts.tty_dev_name), "%s", optarg);
                 }
                 break;
             case 'v':
@@ -68,15 +114,54 @@ main(int argc, char **argv)
             case 'p':
                 opts.pid = strtol(optarg, NULL, 0);
                 break;
+            case 'e':
+                emulate = 1;
+                emu_usec = strtol(optarg, NULL, 0);
+                break;
+            case 'n':
+                emu_count = strtol(optarg, NULL, 0);
+                if (emu_count < 1  ||  emu_count > MGR_MAX_DEVICES)
+                {
+                    usage();
+                    return 1;
+                }
+                break;
+            case 'm':
+                manage = 1;
+                break;
+            case 'c':
+                record = optarg;
+                break;
+            case 'r':
+                replay = optarg;
+                replay_flags = 0;
+                break;
+            case 'R':
+                replay = optarg;
+                replay_flags = CAP_F_REALTIME;
+                break;
+            case 'l':
+                log = optarg;
+                break;
+            case 'f':
+                frames = 1;
+                break;
             case 'd':
                 dbg_level_main++;
                 dbg_level_uirt_raw++;
                 dbg_level_uirt_raw2++;
                 dbg_level_uirt_pronto++;
+                dbg_level_uirt_proto++;
+                dbg_level_uirt_lib++;
+                dbg_level_uirt_pack++;
                 dbg_level_uirt_sm++;
                 dbg_level_usb++;
+                dbg_level_reactor++;
                 dbg_level_tty++;
                 dbg_level_ribsu++;
+                dbg_level_uirt_emu++;
+                dbg_level_capture++;
+                dbg_level_ribsu_mgr++;
                 break;
             case '?':
                 usage();
@@ -85,38 +170,115 @@ main(int argc, char **argv)
         }
     }
 
+    if (log)
+    {
+        // debug output goes through the trace ring, written from its own thread
+        log_fp = (strcmp(log, "-") ? fopen(log, "a") : stderr);
+        if (!log_fp  ||  dbg_ring_start(log_fp, 0))
+        {
+            ERR("Failed to log to %s\n", log);
+            return 1;
+        }
+    }
+    
+    if (replay)
+    {
+        f = replay_capture(&cli, replay, replay_flags);
+        goto out;
+    }
+    
+    if (manage  ||  emu_count > 1)
+    {
+        f = mgr_open(&cli, emulate, emu_usec, emu_count, emu, frames);
+        goto out;
+    }
+    
+    if (emulate)
+    {
+        // Talk to a software USB-UIRT on a pty instead of real hardware
+        buf_attach(&emu_dev, sizeof(opts.tty_dev_name), (UInt8 *)opts.tty_dev_name);
+        if (uemu_create(&emu[0], &emu_dev, 0))
+        {
+            ERR("Failed to start emulator\n");
+            f = 1;
+            goto out;
+        }
+        
+        opts.use_usb = 0;
+        opts.use_tty = 1;
+        
+        if (emu_usec)
+        {
+            uemu_start_rx(emu[0], emu_usec, 0);
+        }
+    }
+    
     if (!opts.use_usb  &&  !opts.use_tty)
     {
         opts.use_usb = opts.use_tty = 1;
     }
     
-    if (add_fd_source(STDIN_FILENO, NULL, stdin_read_callback, NULL))
+    f = 1;
+    
+    if (add_fd_source(STDIN_FILENO, &cli.in, stdin_read_callback, &cli))
     {
         ERR("Failed to open stdin\n");
-        return 1;
+        goto out;
     }
         
-    if (ribsu_init(&ribsu, &opts))
+    if (ribsu_init(&one, &opts))
     {
         ERR("Failed to initialize ribsu\n");
-        return 1;
+        goto out;
+    }
+    cli.ribsu = &one;
+    
+    ribsu_set_callback(cli.ribsu, ribsu_read_callback, &cli);
+    if (frames)
+    {
+        ribsu_set_frame_callback(cli.ribsu, ribsu_frame_callback, &cli);
     }
     
-    ribsu_set_callback(&ribsu, ribsu_read_callback, NULL);
+    if (record  &&  ribsu_capture(cli.ribsu, record))
+    {
+        ERR("Failed to record to %s\n", record);
+        ribsu_deinit(cli.ribsu);
+        goto out;
+    }
     
-    CFRunLoopRun();
+    reactor_run();
    
-    ribsu_deinit(&ribsu);
+    ribsu_deinit(cli.ribsu);
     
-    return 0;
+    f = 0;
+    
+out:
+    
+    for (i = 0; i < MGR_MAX_DEVICES; i++)
+    {
+        if (emu[i]) uemu_shutdown(emu[i]);
+    }
+    
+    if (log_fp)
+    {
+        dbg_ring_stop();
+        if (log_fp != stderr) fclose(log_fp);
+    }
+    
+    return f;
 }
 
 void 
 ribsu_read_callback(void *ctx0, buffer *buf)
 {
+    cli_ctx *cli;
     buffer *hex;
     UInt32 i;
-    hex = buf_alloc(1025);
+    int f;
+    
+    cli = ctx0;
+    
+    hex = buf_alloc(2 * buf->len + 1);
     if (!hex)
     {
         ERR("Failed to allocate buffer\n");
@@ -137,20 +299,243 @@ ribsu_read_callback(void *ctx0, buffer *buf)
     printf("\n");
     
     buf_free(hex);
+    
+    if (cli->learning)
+    {
+        f = ribsu_learn(cli->ribsu);
+        if (f != RIBSU_LEARN_CONTINUE)
+        {
+            printf("L%d\n", f);
+            cli->learning = 0;
+        }
+    }
+}
+
+// A received frame as durations, ahead of the Pronto of it
+void
+ribsu_frame_callback(void *ctx0, usm_frame *fr)
+{
+    UInt32 i, n;
+    
+    (void)ctx0;
+    
+    if (!fr->ps)
+    {
+        printf("# UIR\n");
+        return;
+    }
+    
+    n = fr->ps->nof_pulses + fr->ps->nof_spaces;
+    printf("# %s %uHz (%u%%) after %uus, %u durations",
+           (fr->mode == USM_M_RAW ? "RAW" : "RAW2"), (unsigned)fr->freq,
+           (unsigned)fr->freq_conf, (unsigned)fr->interspace, (unsigned)n);
+    if (fr->code->proto != UP_PROTO_NONE)
+    {
+        printf(", %s %x/%x%s", up_proto_name(fr->code->proto), (unsigned)fr->code->address,
+               (unsigned)fr->code->command, (fr->code->repeat ? " repeat" : ""));
+    }
+    printf("\n#");
+    for (i = 0; i < n; i++)
+    {
+        printf(" %c%u", (i & 1 ? '-' : '+'), (unsigned)USM_FRAME_US(fr, i));
+    }
+    printf("\n");
+}
+
+// The device answered a command typed in
+void
+ribsu_done_callback(void *ctx0, int status, UInt64 latency_ns)
+{
+    (void)ctx0;
+    
+    printf("D%02X %llu.%03llums\n", (unsigned)status & 0xff, (unsigned long long)(latency_ns / 1000000),
+           (unsigned long long)(latency_ns / 1000 % 1000));
+}
+
+// The device answered one of a burst
+void
+burst_done_callback(void *ctx0, int status, UInt64 latency_ns)
+{
+    cli_ctx *cli;
+    UInt64 t;
+    
+    (void)latency_ns;
+    cli = ctx0;
+    
+    cli->burst.out--;
+    if (status != UIRT_STATUS_OK) cli->burst.errors++;
+    burst_fill(cli);
+    
+    if (!cli->burst.left  &&  !cli->burst.out)
+    {
+        t = u_now() - cli->burst.t0;
+        printf("B errors %u in %llu.%03llums\n", (unsigned)cli->burst.errors, (unsigned long long)(t / 1000000),
+               (unsigned long long)(t / 1000 % 1000));
+    }
+}
+
+// Open every device there is, or emu_count emulated ones, and run them
+int
+mgr_open(cli_ctx *cli, int emulate, UInt32 emu_usec, UInt32 emu_count, void **emu, int frames)
+{
+    void *mgr;
+    buffer dev;
+    char name[TTY_MAX_NAME], serial[TTY_MAX_SERIAL];
+    UInt32 i;
+    
+    if (mgr_create(&mgr)) return 1;
+    
+    if (emulate)
+    {
+        for (i = 0; i < emu_count; i++)
+        {
+            buf_attach(&dev, sizeof(name), (UInt8 *)name);
+            if (uemu_create(&emu[i], &dev, 0))
+            {
+                ERR("Failed to start emulator\n");
+                break;
+            }
+            if (emu_usec) uemu_start_rx(emu[i], emu_usec, 0);
+            
+            snprintf(serial, sizeof(serial), "EMU%u", (unsigned)i);
+            mgr_add(mgr, name, serial);
+        }
+    } else
+    {
+        mgr_scan(mgr);
+    }
+    
+    if (!mgr_count(mgr))
+    {
+        ERR("Failed to find USB-UIRT.\n");
+        mgr_shutdown(mgr);
+        return 1;
+    }
+    
+    for (i = 0; i < mgr_count(mgr); i++)
+    {
+        printf("@%u %s\n", (unsigned)i, mgr_serial(mgr, i));
+        if (frames)
+        {
+            ribsu_set_frame_callback(mgr_device(mgr, i), ribsu_frame_callback, cli);
+        }
+    }
+    mgr_set_callback(mgr, mgr_read, cli);
+    cli->mgr = mgr;
+    cli->ribsu = mgr_device(mgr, 0);
+    
+    if (add_fd_source(STDIN_FILENO, &cli->in, stdin_read_callback, cli))
+    {
+        ERR("Failed to open stdin\n");
+        mgr_shutdown(mgr);
+        return 1;
+    }
+    
+    reactor_run();
+    
+    mgr_shutdown(mgr);
+    
+    return 0;
+}
+
+// What one of the managed devices sent
+void
+mgr_read(void *ctx0, UInt32 id, buffer *buf)
+{
+    printf("@%u ", (unsigned)id);
+    ribsu_read_callback(ctx0, buf);
+}
+
+// Commands go to the device with this serial number, or this id
+void
+mgr_select(cli_ctx *cli, const char *which)
+{
+    void *mgr;
+    int id;
+    
+    mgr = cli->mgr;
+    if (!mgr)
+    {
+        ERR("Only one device without -m\n");
+        return;
+    }
+    
+    id = mgr_lookup(mgr, which);
+    if (id < 0  &&  which[0] >= '0'  &&  which[0] <= '9')
+    {
+        id = strtol(which, NULL, 0);
+    }
+    
+    if (id < 0  ||  !mgr_device(mgr, id))
+    {
+        ERR("No device %s\n", which);
+        return;
+    }
+    
+    cli->ribsu = mgr_device(mgr, id);
+    printf("@%d %s\n", id, mgr_serial(mgr, id));
+}
+
+// Keep the queue topped up while the burst lasts
+void
+burst_fill(cli_ctx *cli)
+{
+    while (cli->burst.left  &&  ribsu_queue_space(cli->ribsu))
+    {
+        if (ribsu_send_async(cli->ribsu, &cli->burst.cmd, burst_done_callback, cli))
+        {
+            cli->burst.errors++;
+            cli->burst.left = 0;
+            break;
+        }
+        cli->burst.left--;
+        cli->burst.out++;
+    }
+}
+
+// Print what a recording decodes to, no device needed
+int
+replay_capture(cli_ctx *cli, const char *path, UInt32 flags)
+{
+    void *cap;
+    usm_ctx *usm;
+    int n;
+    
+    if (cap_map(&cap, path)) return 1;
+    
+    usm = malloc(sizeof(*usm));
+    if (!usm)
+    {
+        ERR("No memory\n");
+        cap_unmap(cap);
+        return 1;
+    }
+    
+    usm_init(usm);
+    n = cap_replay(cap, usm, flags, ribsu_read_callback, cli);
+    DBG("Replayed %d frames\n", n);
+    
+    usm_deinit(usm);
+    free(usm);
+    cap_unmap(cap);
+    
+    return 0;
 }
 
 void 
-stdin_read_callback(CFSocketRef s, 
-                    CFSocketCallBackType callbackType, 
-                    CFDataRef address, 
-                    const void *data, 
-                    void *info)
+stdin_read_callback(int fd, void *info)
 {
+    cli_ctx *cli;
+    ribsu_ctx *ribsu;
     FILE *fin;
     int c;
     buffer *hex, *raw;
     UInt32 n;
     
+    (void)fd;
+    
+    cli = info;
+    
     raw = buf_alloc(512);
     if (!raw)
     {
@@ -165,17 +550,18 @@ stdin_read_callback(CFSocketRef s,
         return;
     }
     
-    fin = info;
+    fin = cli->in;
+    ribsu = cli->ribsu;
     
     n = 0;
-    while ((c = fgetc(fin)) != '\n'  &&  c != ' ' &&  c != EOF  &&  n < hex->max)
+    while ((c = fgetc(fin)) != '\n'  &&  c != ' ' &&  c != EOF  &&  n < hex->max - 1)
     {
         hex->buf[n++] = c;
     }
     
     if (ferror(fin)  ||  feof(fin))
     {
-        CFRunLoopStop(CFRunLoopGetCurrent());
+        reactor_stop();
         goto out;
     }
     
@@ -187,7 +573,7 @@ stdin_read_callback(CFSocketRef s,
     switch (hex->buf[0])
     {
         case 'Q': // Quit
-            CFRunLoopStop(CFRunLoopGetCurrent());
+            reactor_stop();
             break;
         case 'F': // Set freq. for RAW mode
             if (hex->len > 2)
@@ -197,7 +583,7 @@ stdin_read_callback(CFSocketRef s,
             {
                 n = 0;
             }
-            ribsu_set_default_frequency(&ribsu, n);
+            ribsu_set_default_frequency(ribsu, n);
             printf("Default frequency %dHz", (int)n);
             break;
         case 'I': // toggle interpretation
@@ -209,12 +595,51 @@ stdin_read_callback(CFSocketRef s,
                  n = 0;
              }
             
-            n = ribsu_toggle_interpretation(&ribsu, n);
+            n = ribsu_toggle_interpretation(ribsu, n);
             printf("I%d\n", (int)n); // echo the previous mode 
             break;
+        case 'L': // learn from the next few codes received
+            cli->learning = 1;
+            printf("L%d\n", ribsu_learn(ribsu));
+            break;
+        case 'P': // parrot the learned code
+            if (!ribsu_parrot(ribsu, raw))
+            {
+                printf("P");
+                ribsu_read_callback(cli, raw);
+            }
+            break;
+        case 'S': // statistics
+            print_stats(cli);
+            break;
+        case '@': // pick the device commands go to, by serial number or id
+            mgr_select(cli, (char *)&hex->buf[1]);
+            break;
+        case 'B': // resend the last command as fast as the device takes it
+            if (!cli->burst.cmd.len  ||  !ribsu->interp  ||  cli->burst.left  ||  cli->burst.out)
+            {
+                ERR("Nothing to burst, or a burst is running\n");
+                break;
+            }
+            cli->burst.left = strtol((char *)&hex->buf[1], NULL, 0);
+            cli->burst.errors = 0;
+            cli->burst.t0 = u_now();
+            burst_fill(cli);
+            break;
         default:
-            u_hex2buf(hex, raw);
-            ribsu_write(&ribsu, raw);
+            if (u_hex2buf(hex, raw))
+            {
+                ERR("Bad hex string %s\n", hex->buf);
+                break;
+            }
+            buf_copy(raw, &cli->burst.cmd);
+            if (ribsu->interp)
+            {
+                ribsu_send_async(ribsu, raw, ribsu_done_callback, NULL);
+            } else
+            {
+                ribsu_write(ribsu, raw);
+            }
     }
     
 out:
@@ -223,20 +648,68 @@ out:
     buf_free(raw);
 }
 
+void
+print_stats(cli_ctx *cli)
+{
+    ribsu_stats st;
+    usm_stats *u;
+    
+    ribsu_get_stats(cli->ribsu, &st);
+    u = &st.usm;
+    
+    printf("%s reads %u bytes in %u writes %u bytes out %u write errors %u\n", st.driver ? st.driver : "none",
+           (unsigned)st.reads, (unsigned)st.bytes_in, (unsigned)st.writes, (unsigned)st.bytes_out,
+           (unsigned)st.write_errors);
+    printf("frames uir %u raw %u raw2 %u proto %u dropped %u agg overflows %u\n", (unsigned)u->frames_uir,
+           (unsigned)u->frames_raw, (unsigned)u->frames_raw2, (unsigned)u->frames_proto,
+           (unsigned)u->frames_dropped, (unsigned)u->agg_overflows);
+    printf("commands %u status ok %u csum %u timeout %u cmd %u other %u\n", (unsigned)u->commands,
+           (unsigned)u->status_ok, (unsigned)u->status_csum_error, (unsigned)u->status_timeout,
+           (unsigned)u->status_cmd_error, (unsigned)u->status_other);
+    printf("tx cache hits %u misses %u evictions %u\n", (unsigned)u->tx_cache_hits,
+           (unsigned)u->tx_cache_misses, (unsigned)u->tx_cache_evictions);
+    printf("queue full %u deepest %u timeouts %u retries %u given up %u\n", (unsigned)st.queue_full,
+           (unsigned)st.queue_max, (unsigned)st.timeouts, (unsigned)st.retries, (unsigned)st.given_up);
+    printf("alloc failures %u\n", (unsigned)st.alloc_failures);
+    print_hist("decode", &u->decode_ns);
+    print_hist("status", &u->status_ns);
+}
+
+// ns, in us
+void
+print_hist(const char *name, hist *h)
+{
+    printf("%s us n %u mean %.1f p50 %.1f p90 %.1f p99 %.1f p999 %.1f max %.1f\n", name, (unsigned)h->count,
+           h->count ? h->sum / 1000.0 / h->count : 0.0, hist_quantile(h, 500) / 1000.0,
+           hist_quantile(h, 900) / 1000.0, hist_quantile(h, 990) / 1000.0, hist_quantile(h, 999) / 1000.0,
+           h->max / 1000.0);
+}
+
 void 
 signal_handler(int sigraised)
 {
-    CFRunLoopStop(CFRunLoopGetCurrent());
+    (void)sigraised;
+    reactor_stop();
 }
 
 void
 usage(void)
 {
-    USG("ribsu [-u] [-v VID] [-p PID] | [-t <device>] [-d]\n"
+    USG("ribsu [-u] [-v VID] [-p PID] | [-t <device>] | [-e <usec>] [-c <file>] [-l <file>] [-f] [-d]\n"
+        "ribsu -m | -e <usec> -n <count> [-l <file>] [-f] [-d]\n"
+        "ribsu -r <file> | -R <file> [-l <file>] [-d]\n"
         "\t-u try direct USB using IOKit\n"
         "\t-t try TTY device specified, - to auto-detect device name (requires FTDI driver, version 2.0 or better)\n"
         "\t-v use USB VID\n"
         "\t-p use USB PID\n"
+        "\t-e use an emulated USB-UIRT, receiving a code every <usec> (0 for never)\n"
+        "\t-n emulate <count> USB-UIRTs at once, managed as with -m\n"
+        "\t-m open every USB-UIRT there is, @<serial> or @<id> picks the one commands go to\n"
+        "\t-c record what the device sends to <file>, appending\n"
+        "\t-r replay a recording as fast as possible\n"
+        "\t-R replay a recording in real time\n"
+        "\t-f print received frames as durations in us, and the protocol if one decodes\n"
+        "\t-l log debug output to <file> (- for stderr) from a thread of its own\n"
         "\t-d increment debug level\n");   
 }
 